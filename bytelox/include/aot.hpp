@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.hpp"
+#include "jit.hpp"
+#include "lox_object.hpp"
+#include "vm.hpp"
+
+#include <string>
+#include <string_view>
+
+namespace bytelox {
+
+// A constant of a function compiled ahead of time. Functions refer to each
+// other by their index in the program.
+struct AotConstant {
+	enum Kind {
+		NIL,
+		BOOL,
+		NUMBER,
+		STRING,
+		FUNCTION,
+	} kind;
+	double number = 0;
+	const char *chars = nullptr;
+	u32 index = 0; // length of a STRING, index of a FUNCTION, or a BOOL's value
+};
+
+// One function of a program made by emit_cpp. run executes the function's
+// bytecode from the instruction at entry, with the same results as compiled
+// code gives run_compiled, and can only be entered at the start of the
+// function or right after a call.
+struct AotFunction {
+	const char *name; // nullptr for the script
+	int arity;
+	int upvalue_count;
+	const u8 *code; // kept for line numbers and closure captures
+	u32 code_size;
+	const LineStart *lines;
+	u32 line_count;
+	const AotConstant *constants;
+	u32 constant_count;
+	JitStatus (*run)(VM &vm, VM::CallFrame *frame, u32 entry);
+};
+
+// Writes a C++ program that runs script and every function it contains.
+// It's built against the runtime library and behaves just like `lox path`.
+std::string emit_cpp(ObjectFunction &script, std::string_view path);
+
+// Creates the functions of a program made by emit_cpp and runs functions[0]
+InterpretResult run_aot(VM &vm, const AotFunction *functions, size_t count);
+
+// The runtime emitted programs call into. Helpers that can fail report the
+// error against the instruction ending at next, and return false.
+namespace aot {
+
+using Frame = VM::CallFrame;
+
+// the two values on top of the stack are both numbers
+inline bool numbers(VM &vm) {
+	return vm.stack.top[-1].is_number() && vm.stack.top[-2].is_number();
+}
+
+inline void get_upvalue(VM &vm, Frame *frame, u16 slot) {
+	ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+	if (upvalue->stack_index == UINT32_MAX) vm.stack.push_back(upvalue->closed);
+	else vm.stack.push_back(vm.stack[upvalue->stack_index]);
+}
+
+inline void set_upvalue(VM &vm, Frame *frame, u16 slot) {
+	ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+	if (upvalue->stack_index == UINT32_MAX) upvalue->closed = vm.stack.back();
+	else vm.stack[upvalue->stack_index] = vm.stack.back();
+}
+
+inline void print(VM &vm) {
+	vm.stack.back().print_value();
+	fmt::print("\n");
+	vm.stack.pop_back();
+}
+
+// always returns RUNTIME_ERROR
+JitStatus error(VM &vm, Frame *frame, u8 *next, const char *message);
+bool get_global(VM &vm, Frame *frame, u8 *next, ObjectString *name);
+bool set_global(VM &vm, Frame *frame, u8 *next, ObjectString *name);
+bool get_property(VM &vm, Frame *frame, u8 *next, ObjectString *name);
+bool set_property(VM &vm, Frame *frame, u8 *next, ObjectString *name);
+bool get_super(VM &vm, Frame *frame, u8 *next, ObjectString *name);
+// ADD when the operands on the stack aren't both numbers
+bool add(VM &vm, Frame *frame, u8 *next);
+// pushes a + b when they aren't both numbers
+bool add_values(VM &vm, Frame *frame, u8 *next, LoxValue a, LoxValue b);
+bool inherit(VM &vm, Frame *frame, u8 *next);
+
+// Calls run the callee on the native stack, and give CONTINUE once it has
+// returned, with frame updated since pushing frames can move it. Anything
+// else is returned by the caller too.
+JitStatus call(VM &vm, Frame *&frame, u8 *next, int arg_count);
+// FRAME_CHANGED once the callee's frame has replaced frame, unwinding to
+// run_aot to run it, or CONTINUE on to the RETURN after if it pushed none.
+JitStatus tail_call(VM &vm, Frame *&frame, u8 *next, int arg_count);
+JitStatus invoke(VM &vm, Frame *&frame, u8 *next, ObjectString *name, int arg_count);
+JitStatus super_invoke(VM &vm, Frame *&frame, u8 *next, ObjectString *name, int arg_count);
+// DONE after the script returns, otherwise FRAME_CHANGED
+JitStatus return_from(VM &vm, Frame *frame);
+
+}
+
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <initializer_list>
+#include <vector>
+
+// x86-64 encoding shared by the baseline JIT and the trace compiler
+namespace bytelox::x64 {
+
+enum Reg: u8 { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum Condition: u8 {
+	BELOW = 0x2, ABOVE_EQUAL = 0x3, EQUAL = 0x4, NOT_EQUAL = 0x5, BELOW_EQUAL = 0x6, ABOVE = 0x7, PARITY = 0xA,
+};
+enum SSE: u8 { MOVSD = 0x10, ADDSD = 0x58, MULSD = 0x59, SUBSD = 0x5C, DIVSD = 0x5E };
+enum XMM: u8 { XMM0, XMM1 }; // and so on up to xmm15, by number
+
+// Just enough x86-64 for the baseline templates and traces. Memory operands
+// are always [base + disp32].
+struct Assembler {
+	std::vector<u8> code;
+
+	void emit(std::initializer_list<u8> bytes) {
+		code.insert(code.end(), bytes);
+	}
+	void emit32(u32 value) {
+		for (int i=0; i<4; i++) code.push_back(value >> (8 * i));
+	}
+	void emit64(u64 value) {
+		for (int i=0; i<8; i++) code.push_back(value >> (8 * i));
+	}
+	// REX prefix if any of its bits are needed
+	void rex(bool wide, int reg, int base) {
+		u8 prefix = 0x40 | (wide ? 8 : 0) | (reg >= R8 ? 4 : 0) | (base >= R8 ? 1 : 0);
+		if (prefix != 0x40) code.push_back(prefix);
+	}
+	void memory(int reg, Reg base, i32 disp) {
+		code.push_back(0x80 | (reg & 7) << 3 | (base & 7));
+		if ((base & 7) == RSP) code.push_back(0x24); // SIB with no index
+		emit32(disp);
+	}
+
+	void push(Reg reg) {
+		rex(false, 0, reg);
+		code.push_back(0x50 + (reg & 7));
+	}
+	void pop(Reg reg) {
+		rex(false, 0, reg);
+		code.push_back(0x58 + (reg & 7));
+	}
+	// mov dst, src
+	void mov(Reg dst, Reg src) {
+		rex(true, src, dst);
+		emit({0x89, u8(0xC0 | (src & 7) << 3 | (dst & 7))});
+	}
+	// mov reg, imm, zero extending 32 bit immediates
+	void mov(Reg reg, u64 imm) {
+		if (imm <= UINT32_MAX) {
+			rex(false, 0, reg);
+			code.push_back(0xB8 + (reg & 7));
+			emit32(imm);
+		}
+		else {
+			rex(true, 0, reg);
+			code.push_back(0xB8 + (reg & 7));
+			emit64(imm);
+		}
+	}
+	// mov reg, [base + disp]
+	void load(Reg reg, Reg base, i32 disp) {
+		rex(true, reg, base);
+		code.push_back(0x8B);
+		memory(reg, base, disp);
+	}
+	// mov [base + disp], reg
+	void store(Reg base, i32 disp, Reg reg) {
+		rex(true, reg, base);
+		code.push_back(0x89);
+		memory(reg, base, disp);
+	}
+	// add reg, [base + disp]
+	void add(Reg reg, Reg base, i32 disp) {
+		rex(true, reg, base);
+		code.push_back(0x03);
+		memory(reg, base, disp);
+	}
+	// cmp reg, [base + disp]
+	void cmp(Reg reg, Reg base, i32 disp) {
+		rex(true, reg, base);
+		code.push_back(0x3B);
+		memory(reg, base, disp);
+	}
+	void add(Reg reg, i32 imm) {
+		rex(true, 0, reg);
+		emit({0x81, u8(0xC0 | (reg & 7))});
+		emit32(imm);
+	}
+	void sub(Reg reg, i32 imm) {
+		rex(true, 0, reg);
+		emit({0x81, u8(0xE8 | (reg & 7))});
+		emit32(imm);
+	}
+	void shl(Reg reg, u8 imm) {
+		rex(true, 0, reg);
+		emit({0xC1, u8(0xE0 | (reg & 7)), imm});
+	}
+	// cmp dword [base + disp], imm
+	void cmp32(Reg base, i32 disp, i8 imm) {
+		rex(false, 0, base);
+		code.push_back(0x83);
+		memory(7, base, disp);
+		code.push_back(imm);
+	}
+	// add word [base + disp], imm
+	void add16(Reg base, i32 disp, i8 imm) {
+		code.push_back(0x66);
+		rex(false, 0, base);
+		code.push_back(0x83);
+		memory(0, base, disp);
+		code.push_back(imm);
+	}
+	// cmp word [base + disp], imm
+	void cmp16(Reg base, i32 disp, u16 imm) {
+		code.push_back(0x66);
+		rex(false, 0, base);
+		code.push_back(0x81);
+		memory(7, base, disp);
+		emit({u8(imm), u8(imm >> 8)});
+	}
+	// add [base + disp], reg
+	void add_to(Reg base, i32 disp, Reg reg) {
+		rex(true, reg, base);
+		code.push_back(0x01);
+		memory(reg, base, disp);
+	}
+	// cmp byte [base + disp], imm
+	void cmp8(Reg base, i32 disp, i8 imm) {
+		rex(false, 0, base);
+		code.push_back(0x80);
+		memory(7, base, disp);
+		code.push_back(imm);
+	}
+	// mov dword [base + disp], imm
+	void store32(Reg base, i32 disp, u32 imm) {
+		rex(false, 0, base);
+		code.push_back(0xC7);
+		memory(0, base, disp);
+		emit32(imm);
+	}
+	// mov qword [base + disp], imm, sign extended
+	void store64(Reg base, i32 disp, i32 imm) {
+		rex(true, 0, base);
+		code.push_back(0xC7);
+		memory(0, base, disp);
+		emit32(imm);
+	}
+	// setcc al
+	void set_al(Condition condition) {
+		emit({0x0F, u8(0x90 + condition), 0xC0});
+	}
+	// mov byte [base + disp], al
+	void store_al(Reg base, i32 disp) {
+		rex(false, 0, base);
+		code.push_back(0x88);
+		memory(RAX, base, disp);
+	}
+	// movups xmm, [base + disp], all 16 bytes of a LoxValue
+	void load_value(XMM xmm, Reg base, i32 disp) {
+		rex(false, xmm, base);
+		emit({0x0F, 0x10});
+		memory(xmm, base, disp);
+	}
+	void store_value(Reg base, i32 disp, XMM xmm) {
+		rex(false, xmm, base);
+		emit({0x0F, 0x11});
+		memory(xmm, base, disp);
+	}
+	// movsd, addsd and the like: op xmm, [base + disp]
+	void sse(SSE op, XMM xmm, Reg base, i32 disp) {
+		code.push_back(0xF2);
+		rex(false, xmm, base);
+		emit({0x0F, op});
+		memory(xmm, base, disp);
+	}
+	// op dst, src between registers
+	void sse(SSE op, XMM dst, XMM src) {
+		code.push_back(0xF2);
+		rex(false, dst, src);
+		emit({0x0F, op, u8(0xC0 | (dst & 7) << 3 | (src & 7))});
+	}
+	// movsd [base + disp], xmm
+	void store_double(Reg base, i32 disp, XMM xmm) {
+		code.push_back(0xF2);
+		rex(false, xmm, base);
+		emit({0x0F, 0x11});
+		memory(xmm, base, disp);
+	}
+	// ucomisd xmm, [base + disp]
+	void compare_double(XMM xmm, Reg base, i32 disp) {
+		code.push_back(0x66);
+		rex(false, xmm, base);
+		emit({0x0F, 0x2E});
+		memory(xmm, base, disp);
+	}
+	// ucomisd a, b
+	void compare_double(XMM a, XMM b) {
+		code.push_back(0x66);
+		rex(false, a, b);
+		emit({0x0F, 0x2E, u8(0xC0 | (a & 7) << 3 | (b & 7))});
+	}
+	void call(const void *fn) {
+		mov(RAX, (u64) fn);
+		emit({0xFF, 0xD0}); // call rax
+	}
+	void jmp(Reg reg) {
+		rex(false, 0, reg);
+		emit({0xFF, u8(0xE0 + (reg & 7))});
+	}
+	void test_eax() {
+		emit({0x85, 0xC0});
+	}
+	void cmp_eax(i8 imm) {
+		emit({0x83, 0xF8, u8(imm)});
+	}
+	void ret() {
+		code.push_back(0xC3);
+	}
+	// the jumps return where their 32 bit displacement is, for patch and bind
+	size_t jmp() {
+		code.push_back(0xE9);
+		emit32(0);
+		return code.size() - 4;
+	}
+	size_t jump_if(Condition condition) {
+		emit({0x0F, u8(0x80 + condition)});
+		emit32(0);
+		return code.size() - 4;
+	}
+	void patch(size_t displacement, size_t target) {
+		u32 relative = target - (displacement + 4);
+		for (int i=0; i<4; i++) code[displacement + i] = relative >> (8 * i);
+	}
+	// jump here
+	void bind(size_t displacement) {
+		patch(displacement, code.size());
+	}
+};
+
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.hpp"
+#include "lox_object.hpp"
+
+#include <string>
+#include <string_view>
+
+namespace bytelox {
+
+struct VM;
+
+// Compiled scripts are cached in a .loxc file next to their source, so a
+// script that hasn't changed since it last ran isn't compiled again. A cache
+// is only used if it has this version of the format, the hash of the source,
+// and was compiled with the same options, and its code passes verify_function.
+
+// where the cache of the script at path goes, foo.lox's is foo.loxc
+std::string bytecode_cache_path(std::string_view path);
+
+// the script compiled from source, read from the cache at cache_path, or
+// nullptr if there's no fresh and intact cache there
+ObjectFunction *load_bytecode_cache(VM &vm, const std::string &cache_path, std::string_view source);
+
+// writes script, compiled from source, to the cache at cache_path. false if
+// it couldn't, or if the script has lazy bodies it doesn't hold the code of,
+// which just means the next run compiles again.
+bool write_bytecode_cache(VM &vm, ObjectFunction &script, const std::string &cache_path, std::string_view source);
+
+}
@@ -3,6 +3,11 @@
 #include "common.hpp"
 #include "lox_value.hpp"
 
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace bytelox {
@@ -56,27 +61,188 @@ enum class OP {
 	CLASS,         // 1 byte
 	INHERIT,       //
 	METHOD,        //
+	// superinstructions, only emitted by fuse_superinstructions
+	ADD_LOCALS,               // 3 bytes, local a, local b
+	ADD_LOCAL_CONSTANT,       // 3 bytes, local, constant index
+	SUB_LOCAL_CONSTANT,       // 3 bytes, local, constant index
+	LESS_LOCALS_JUMP,         // 5 bytes, local a, local b, 2 byte offset taken if !(a < b)
+	LESS_LOCAL_CONSTANT_JUMP, // 5 bytes, local, constant index, 2 byte offset
+	GET_LOCAL_PROPERTY,       // 3 bytes, local, index of property name
+	SET_LOCAL_POP,            // 2 bytes, local
+	// quickened forms, only written by the VM over their generic op after
+	// seeing its operand types. Same size as the generic op, which they
+	// rewrite themselves back to if their types don't match.
+	ADD_NUM,                    // ADD
+	ADD_STR,                    // ADD
+	ADD_LOCALS_NUM,             // ADD_LOCALS
+	ADD_LOCAL_CONSTANT_NUM,     // ADD_LOCAL_CONSTANT
+	// three-address ops over frame slots, only emitted by lower_to_register_ops
+	MOVE,  // 4 bytes, mode, dst, src
+	ADD_R, // 5 bytes, mode, dst, lhs, rhs
+	SUB_R, // 5 bytes, mode, dst, lhs, rhs
+	MUL_R, // 5 bytes, mode, dst, lhs, rhs
+	DIV_R, // 5 bytes, mode, dst, lhs, rhs
+	// inlined calls, only emitted by Inliner. A guard jumps to the call it
+	// guards, right after the inlined body, unless the call would run the
+	// function inlined.
+	GUARD_CALL,     // 5 bytes, index of function, num args, 2 byte offset
+	GUARD_INVOKE,   // 6 bytes, index of function, index of method name, num args, 2 byte offset
+	RETURN_INLINED, // 4 bytes, slots under the result to drop, 2 byte offset past the call
+	// forms without type checks, only emitted by optimize_ssa for operands it
+	// proved are numbers
+	ADD_UNCHECKED,           // ADD
+	SUB_UNCHECKED,           // SUB
+	MUL_UNCHECKED,           // MUL
+	DIV_UNCHECKED,           // DIV
+	GREATER_UNCHECKED,       // GREATER
+	GREATER_EQUAL_UNCHECKED, // GREATER_EQUAL
+	LESS_UNCHECKED,          // LESS
+	LESS_EQUAL_UNCHECKED,    // LESS_EQUAL
+	// written by the VM over a LOOP once the loop has a compiled trace
+	LOOP_TRACE, // LOOP
+	// written over a CALL right before a RETURN once the function is compiled.
+	// The callee's frame takes the place of the caller's, and the RETURN after
+	// it only runs if the callee didn't push a frame.
+	TAIL_CALL, // CALL
+	// counted for loops, only emitted by fuse_superinstructions. Adds the
+	// step to the counter, then jumps back to the top of the body while the
+	// counter is below the bound, a local or a constant as mode says.
+	FOR_LOOP,       // 7 bytes, mode, counter local, step constant index, bound, 2 byte offset
+	FOR_LOOP_TRACE, // FOR_LOOP, written by the VM once the loop has a compiled trace
+	// prefix for an instruction with operands too big for a byte, only emitted
+	// by the compiler and only before the ops it makes. Every one byte operand
+	// of the instruction after it is 2 little endian bytes, and a jump offset
+	// is 4, so WIDE GET_GLOBAL is 4 bytes and WIDE JUMP 6. CALL's argument
+	// count always fits, and is never wide.
+	WIDE,
 };
 
-struct RLE {
-	// at most 65535 lines
-	// if line == 0, this means skip lines by count
-	u16 line; 
-	u16 count;
-	RLE(u16 line, u16 count): line(line), count(count) {}
+// Where a register op operand lives, packed into its mode byte as
+// lhs | rhs << 2 | dst << 4. MOVE's src goes in the lhs bits.
+// STACK operands are popped (rhs first), and a STACK dst is pushed.
+// Arithmetic with UNCHECKED_NUMBERS set in its mode came from an unchecked
+// op, and skips the type checks.
+enum class RegisterKind {
+	STACK,
+	LOCAL,
+	CONSTANT,
+};
+constexpr u8 UNCHECKED_NUMBERS = 1 << 6;
+
+// the line of the code from start up to the next LineStart
+struct LineStart {
+	u32 start;
+	u32 line;
+};
+
+// A growable array like std::vector, except that once its chunk is packed
+// it's a right-sized view into whatever the chunk was packed into. Growing a
+// packed array copies it back out to storage of its own.
+template <typename T>
+class ChunkArray {
+	static_assert(std::is_trivially_copyable_v<T>);
+	std::unique_ptr<T[]> owned;
+	T *items = nullptr;
+	u32 length = 0;
+	u32 capacity = 0; // 0 while packed
+
+	void reserve(size_t count) {
+		if (count <= capacity) return;
+		size_t grown_capacity = std::max<size_t>({count, 2 * capacity, 8});
+		std::unique_ptr<T[]> grown = std::make_unique_for_overwrite<T[]>(grown_capacity);
+		if (length > 0) std::memcpy(grown.get(), items, length * sizeof(T));
+		owned = std::move(grown);
+		items = owned.get();
+		capacity = grown_capacity;
+	}
+
+public:
+	ChunkArray() = default;
+	ChunkArray(const ChunkArray &that) {
+		assign(that.begin(), that.end());
+	}
+	ChunkArray(ChunkArray &&that) noexcept:
+			owned(std::move(that.owned)), items(that.items), length(that.length), capacity(that.capacity) {
+		that.items = nullptr;
+		that.length = that.capacity = 0;
+	}
+	ChunkArray &operator=(const ChunkArray &that) {
+		if (this != &that) assign(that.begin(), that.end());
+		return *this;
+	}
+	ChunkArray &operator=(ChunkArray &&that) noexcept {
+		owned = std::move(that.owned);
+		items = std::exchange(that.items, nullptr);
+		length = std::exchange(that.length, 0);
+		capacity = std::exchange(that.capacity, 0);
+		return *this;
+	}
+
+	[[nodiscard]] size_t size() const { return length; }
+	[[nodiscard]] bool empty() const { return length == 0; }
+	T *data() { return items; }
+	T *begin() { return items; }
+	T *end() { return items + length; }
+	const T *begin() const { return items; }
+	const T *end() const { return items + length; }
+	T &back() { return items[length - 1]; }
+	T &operator[](size_t index) { return items[index]; }
+
+	void push_back(T item) {
+		reserve(length + 1);
+		items[length++] = item;
+	}
+	void assign(const T *first, const T *last) {
+		length = 0;
+		reserve(last - first);
+		if (first != last) std::memcpy(items, first, (last - first) * sizeof(T));
+		length = last - first;
+	}
+	void resize(size_t count) {
+		reserve(count);
+		std::fill(items + std::min<size_t>(length, count), items + count, T{});
+		length = count;
+	}
+	void clear() {
+		length = 0;
+	}
+	bool operator==(const ChunkArray &that) const {
+		return std::equal(begin(), end(), that.begin(), that.end(), [](const T &a, const T &b) {
+			return std::memcmp(&a, &b, sizeof(T)) == 0;
+		});
+	}
+
+	// copies the items to at, and makes the array a view of them there
+	std::byte *pack_into(std::byte *at) {
+		if (length > 0) std::memcpy(at, items, length * sizeof(T));
+		items = reinterpret_cast<T *>(at);
+		owned.reset();
+		capacity = 0;
+		return at + length * sizeof(T);
+	}
 };
 
 struct Chunk {
-	std::vector<u8> code;
-	std::vector<LoxValue> constants;
-	std::vector<RLE> lines;
-	void write(u8 byte, u16 line);
+	ChunkArray<u8> code;
+	ChunkArray<LoxValue> constants;
+	// sorted by start, one for each change of line
+	ChunkArray<LineStart> lines;
+	void write(u8 byte, u32 line);
 
 	size_t count();
+	// length in bytes of the instruction starting at offset
+	size_t instruction_size(size_t offset);
 	// gets the line of an instruction from its index
-	u16 get_line(int index);
+	u32 get_line(size_t index);
 	size_t add_constant(LoxValue value);
-	void write_constant(LoxValue value, u16 line);
+	void write_constant(LoxValue value, u32 line);
 };
 
+// Packs chunks into one arena, in order: the constants of all of them, then
+// all their code, then all their lines, so the code of chunks next to each
+// other in chunks is next to each other in memory. The chunks are views
+// into the arena, which has to outlive them, and anything growing one after
+// copies what it grows back out.
+std::unique_ptr<std::byte[]> pack_chunks(const std::vector<Chunk *> &chunks);
+
 }
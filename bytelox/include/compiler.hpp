@@ -1,11 +1,17 @@
 #pragma once
 
 #include "chunk.hpp"
+#include "inliner.hpp"
 #include "scanner.hpp"
 #include "lox_object.hpp"
 
-#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <span>
 #include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace bytelox {
 
@@ -23,14 +29,46 @@ enum class Precedence {
 	PRIMARY
 };
 
+struct Compiler;
+
+// parses an expression starting from parser.previous, given whether it can
+// be assigned to
+using ParseFn = void (Compiler::*)(bool can_assign);
+
 struct ParseRule {
-	std::function<void(bool)> prefix;
-	std::function<void(bool)> infix;
+	ParseFn prefix;
+	ParseFn infix;
 	Precedence precedence;
 };
 
 constexpr int num_parse = 40;
 
+struct CompilerOptions {
+	// fold constants, thread jumps and remove dead code before anything else
+	bool peephole = true;
+	// optimize over SSA form after the peephole pass: propagate constants and
+	// copies, eliminate common subexpressions and dead stores, hoist invariants
+	bool ssa = false;
+	// inline small global functions and methods where they're called, behind
+	// guards falling back to the call
+	bool inline_calls = true;
+	// lower stack arithmetic on locals and constants to register ops
+	bool register_ops = true;
+	// reuse the caller's frame for calls right before a return. Frames called
+	// that way are missing from runtime error stack traces.
+	bool tail_calls = true;
+	// compile functions to native code after they have been called jit_threshold times
+	bool jit = true;
+	u32 jit_threshold = 100;
+	// record loops and compile them to native traces after trace_threshold iterations
+	bool trace = true;
+	u16 trace_threshold = 64;
+	// Only find where the bodies of global functions and methods end, and
+	// compile each on its first call. Errors in a body are reported then, and
+	// calls in it aren't inlined.
+	bool lazy = false;
+};
+
 struct VM;
 
 struct Compiler {
@@ -38,6 +76,15 @@ struct Compiler {
 		Token name;
 		int depth;
 		bool is_captured;
+		// read for anything but calling it, so a closure declared as this local
+		// can outlive the scope
+		bool escapes = false;
+		// captured by a closure that can outlive the scope, so the local has
+		// to be closed rather than popped when the scope ends
+		bool needs_closing = false;
+		// locals the closure declared as this local captures, which need
+		// closing if it escapes
+		std::vector<u16> captures = {};
 	};
 	
 	enum class FunctionType {
@@ -48,7 +95,7 @@ struct Compiler {
 	};
 
 	struct Upvalue {
-		u8 index;
+		u16 index;
 		bool is_local;
 	};
 
@@ -56,11 +103,21 @@ struct Compiler {
 		FunctionScope *enclosing = nullptr;
 		ObjectFunction *function = nullptr;
 		FunctionType type = FunctionType::SCRIPT;
-		Local locals[UINT8_MAX + 1];
+		std::vector<Local> locals;
 		int local_count = 0;
 		int scope_depth = 0;
-		Upvalue upvalues[UINT8_MAX + 1];
-		FunctionScope(Compiler &compiler, FunctionType type);
+		std::vector<Upvalue> upvalues;
+		// a function nested in this one captured one of its upvalues
+		bool upvalues_captured = false;
+		// emitted a WIDE instruction, which passes don't handle, so the
+		// function is left unoptimized
+		bool wide = false;
+		// forward jumps too far for a 2 byte offset, as the offsets of the jump
+		// and its target, widened once the function is done
+		std::vector<std::pair<size_t, size_t>> far_jumps;
+		// index of each constant in the chunk by its bits, so a value used
+		// again reuses its constant. Only values of one type share bits.
+		std::unordered_map<u64, u32> constant_indices;
 	};
 	
 	struct ClassScope {
@@ -69,8 +126,6 @@ struct Compiler {
 		ClassScope(ClassScope *enclosing): enclosing(enclosing) {}
 	};
 	
-	std::array<ParseRule, num_parse> rules;
-	
 	struct {
 		Token previous;
 		Token current;
@@ -78,19 +133,40 @@ struct Compiler {
 		bool panic_mode = false;
 	} parser;
 	
-	Scanner &scanner;
+	Scanner scanner{""};
 	VM &vm; // for adding LoxObject constants that need to have references for GC
 	FunctionScope *current_fn = nullptr;
 	ClassScope *current_class = nullptr;
+	Inliner inliner;
+	// every function compiled so far, packed into one arena once the script is
+	std::vector<ObjectFunction *> compiled;
+	// one for each level of functions nested in each other, kept between
+	// compiles with the room their vectors grew
+	std::vector<std::unique_ptr<FunctionScope>> fn_scopes;
+	int fn_scope_count = 0;
+	// the operands of a CLOSURE, kept for the room it grew
+	std::vector<u32> closure_operands;
 	
-	Chunk *compiling_chunk = nullptr;
 	Chunk *current_chunk();
 	
-	Compiler(Scanner &scanner, VM &vm);
-	~Compiler();
+	// One per VM, which compiles every script and lazy body it's given, one
+	// at a time
+	explicit Compiler(VM &vm);
 
-	ObjectFunction *compile(std::string_view src);
+	// compiles the script scanner is at the start of
+	ObjectFunction *compile(const Scanner &scanner);
+	// compiles the body of fn, scanning its LazyBody. false on errors, which
+	// leave fn as it was.
+	bool compile_lazy(ObjectFunction &fn);
+	// forgets everything from the last compile but the room it took
+	void reset();
 
+	// makes the next free FunctionScope current, compiling into function if
+	// it's given, rather than a new one
+	FunctionScope &begin_fn_scope(FunctionType type, ObjectFunction *function = nullptr);
+	// makes the enclosing function current again. The scope ended stays as it
+	// was until the next begin_fn_scope.
+	void pop_fn_scope();
 	ObjectFunction *end_fn_scope();
 
 	void advance();
@@ -99,13 +175,19 @@ struct Compiler {
 	bool check(TokenType type);
 	void emit_byte(u8 byte);
 	void emit_bytes(u8 byte1, u8 byte2);
+	// emits op and its one byte operands, or WIDE and op with two byte
+	// operands if any of them doesn't fit in a byte
+	void emit_operands(u8 op, std::span<const u32> operands);
+	void emit_operands(u8 op, std::initializer_list<u32> operands) {
+		emit_operands(op, std::span(operands.begin(), operands.size()));
+	}
 	void emit_loop(int loop_start);
 	int emit_jump(u8 instruction);
 	void emit_constant(LoxValue value);
 	void patch_jump(int offset);
 	void emit_return();
 	
-	u8 make_constant(LoxValue value);
+	u32 make_constant(LoxValue value);
 	
 	void begin_scope();
 	void end_scope();
@@ -123,7 +205,13 @@ struct Compiler {
 	void if_statement();
 	void while_statement();
 	void for_statement();
-	void function(FunctionType type);
+	ObjectFunction *function(FunctionType type);
+	void parameters();
+	// whether a function of type declared here can wait to be compiled
+	bool can_compile_lazily(FunctionType type);
+	// skips over the body of the function being declared to its closing brace,
+	// capturing what it captures, and keeps where it is in the function
+	void skip_body(const char *start, int line);
 	void return_statement();
 	void method();
 	
@@ -145,17 +233,17 @@ struct Compiler {
 	void super(bool);
 	
 	void parse_precedence(Precedence precedence);
-	u8 identifier_constant(const Token &name);
+	u32 identifier_constant(const Token &name);
 	bool identifiers_equal(Token &a, Token &b);
 	int resolve_local(FunctionScope &fs, Token &name);
-	int add_upvalue(FunctionScope &fs, u8 index, bool is_local);
+	int add_upvalue(FunctionScope &fs, u16 index, bool is_local);
 	int resolve_upvalue(FunctionScope &fs, Token &name);
-	u8 parse_variable(std::string_view msg);
+	u32 parse_variable(std::string_view msg);
 	void declare_variable();
-	void define_variable(u8 global);
+	void define_variable(u32 global);
 	void mark_initialized();
 	void add_local(Token name);
-	ParseRule *get_rule(TokenType type);
+	const ParseRule *get_rule(TokenType type);
 	
 	void error_at_current(std::string_view msg);
 	void error(std::string_view msg);
@@ -164,4 +252,15 @@ struct Compiler {
 	void synchronize();
 };
 
+// The source of a function that hasn't been compiled yet, from the '(' of its
+// parameters to the '}' closing its body. Only functions whose upvalues the
+// compiler knows without compiling them wait, so global functions and
+// methods of global classes, which can only capture their class's super.
+struct LazyBody {
+	std::string_view source;
+	int line;
+	Compiler::FunctionType type;
+	bool has_superclass;
+};
+
 }
@@ -8,5 +8,7 @@ namespace bytelox {
 
 int disassemble_instruction(Chunk &chunk, size_t offset);
 void disassemble_chunk(Chunk &chunk, std::string_view name);
+// prints each instruction that has recorded feedback, followed by the feedback
+void print_feedback(ObjectFunction &fn, std::string_view name);
 
 }
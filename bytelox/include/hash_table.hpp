@@ -4,11 +4,16 @@
 #include "lox_value.hpp"
 
 #include <memory>
+#include <string_view>
 
 namespace bytelox {
 
 struct ObjectString;
 
+// FNV-1a
+u32 hash_string(std::string_view str);
+
+// keys are interned strings, so compared by address
 struct Entry {
 	ObjectString *key;
 	LoxValue value;
@@ -26,7 +31,8 @@ struct HashTable {
 	// finds the entry with the matching key, which is an ADDRESS
 	Entry *find(ObjectString *key);
 	Entry *find_in_array(Entry array[], u32 array_cap, ObjectString *key);
-	ObjectString *find_string(std::string_view str);
+	// the interned string of str, whose hash_string is hash
+	ObjectString *find_string(std::string_view str, u32 hash);
 	
 	void adjust_capacity(u32 new_capacity);
 	void add_all(HashTable &table);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "optimizer.hpp"
+#include "lox_object.hpp"
+
+#include <unordered_map>
+#include <vector>
+
+namespace bytelox {
+
+// Inlines calls to small global functions and methods into their callers.
+// Any global can be reassigned and any method shadowed by a field, so each
+// inlined body runs behind a guard checking the call would still go to the
+// function inlined, and the call stays after the body for when it wouldn't:
+//
+//         GUARD_CALL f, n -> call
+//         <body of f>           callee and arguments are the body's first slots
+//         RETURN_INLINED -> end drops them from under the result
+//   call: CALL n
+//   end:
+struct Inliner {
+	// code of each function small enough to inline, from before register ops
+	// and superinstructions, whose slot operands aren't moved by inlining
+	std::unordered_map<ObjectFunction *, Chunk> bodies;
+	// global functions and methods declared so far, by name. A method is
+	// nullptr once more than one function has its name.
+	std::unordered_map<ObjectString *, ObjectFunction *> functions;
+	std::unordered_map<ObjectString *, ObjectFunction *> methods;
+
+	// keeps the code of fn if it can be inlined
+	void consider(ObjectFunction &fn);
+	void add_function(ObjectFunction &fn);
+	void add_method(ObjectFunction &fn);
+	// Inlines calls to the functions and methods added so far into the code
+	// of a function. Runs before optimize_chunk, which folds the inlined code
+	// into its arguments.
+	void inline_calls(Chunk &chunk, int arity);
+
+private:
+	// appends the guard and body of the call at code[i] to fn to out, adding
+	// to the size of the caller, false if it can't
+	bool inline_call(Chunk &chunk, std::vector<Instruction> &code, std::vector<int> &heights,
+			size_t i, ObjectFunction &fn, std::vector<Instruction> &out, size_t &size);
+};
+
+// offsets of the guards of the inlined calls the instruction at offset is
+// part of, outermost first
+std::vector<size_t> inlined_calls_at(Chunk &chunk, size_t offset);
+
+}
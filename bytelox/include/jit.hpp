@@ -0,0 +1,67 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <vector>
+
+// native code is only generated for x86-64 System V targets, everywhere else
+// jit_compile always fails and every function stays interpreted
+#if defined(__x86_64__) && defined(__unix__)
+#define BYTELOX_JIT
+#endif
+
+namespace bytelox {
+
+struct VM;
+struct ObjectFunction;
+
+// Returned by compiled code to VM::run_compiled, and by the helpers compiled
+// code calls. Helpers return CONTINUE to carry on with the next instruction.
+enum class JitStatus: int {
+	CONTINUE,
+	RUNTIME_ERROR,
+	FRAME_CHANGED, // a call or return changed the current frame, ip was saved
+	DONE,          // returned from the script
+	BRANCH,        // from the helper of a jump, take the jump
+};
+
+struct CodeBlock;
+
+// Native code for one function. It can be entered at any instruction, to
+// return to a frame that was interpreted when the function got compiled, or
+// carry on from wherever a trace left a loop.
+struct JitFunction {
+	u8 *code;
+	size_t size;
+	CodeBlock *block;
+	// native offset for each bytecode offset, UINT32_MAX between instructions
+	std::vector<u32> entries;
+
+	// runs from entry until the frame changes or there's an error
+	JitStatus enter(VM &vm, void *frame, u32 entry);
+};
+
+// Executable memory for compiled functions, bump allocated from blocks that
+// are unmapped once every function in them is released. Blocks are only ever
+// writable or executable, never both.
+struct CodeCache {
+	static constexpr size_t BLOCK_SIZE = 256 * 1024;
+	size_t capacity = 64 * 1024 * 1024;
+	size_t bytes_mapped = 0;
+	CodeBlock *current = nullptr;
+
+	CodeCache() = default;
+	~CodeCache();
+	CodeCache(CodeCache &cache) = delete;
+	CodeCache &operator=(CodeCache &cache) = delete;
+
+	// copies code into executable memory, nullptr if the cache is full
+	JitFunction *install(const std::vector<u8> &code, std::vector<u32> entries);
+	void release(JitFunction *fn);
+};
+
+// Translates fn's bytecode to native code, one template per instruction that
+// calls back into the VM for anything but control flow. nullptr if it can't.
+JitFunction *jit_compile(VM &vm, ObjectFunction &fn);
+
+}
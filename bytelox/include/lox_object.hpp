@@ -4,6 +4,9 @@
 #include "lox_value.hpp"
 #include "hash_table.hpp"
 
+#include <bit>
+#include <vector>
+
 #ifdef DEBUG_LOG_GC
 #define FMT_HEADER_ONLY
 #include "fmt/core.h"
@@ -84,20 +87,22 @@ struct LoxObject {
 
 struct ObjectString: LoxObject {
 	u32 length; // does NOT including trailing '\0'
-	u32 hash;
+	u32 hash = 0; // hash_string of it, set once it's interned
+	// In the VM's strings, the one string of its chars that's there. Strings
+	// made while running, like by concatenating, are only interned once
+	// they're compared, so ones that never are skip hashing.
+	bool interned = false;
 	std::unique_ptr<char[]> chars;
-	constexpr ObjectString(std::string_view str):
+	ObjectString(std::string_view str):
 		length(str.size()),
 		chars(std::make_unique_for_overwrite<char[]>(length + 1)) {
 			type = ObjectType::STRING;
 			std::memcpy(chars.get(), str.data(), str.size());
 			chars[length] = '\0';
-			// FNV-1a hash function
-			hash = 2166136261u;
-			for (u32 i=0; i<length; i++) {
-				hash ^= (u8) str[i];
-				hash *= 16777619;
-			}
+	}
+	// takes chars, which holds length chars and a '\0'
+	ObjectString(std::unique_ptr<char[]> chars, u32 length): length(length), chars(std::move(chars)) {
+		type = ObjectType::STRING;
 	}
 };
 
@@ -111,11 +116,72 @@ struct ObjectUpvalue: LoxObject {
 	}
 };
 
+// What the instruction at the same offset of a chunk has seen at runtime.
+// Number-only ops record nothing, they can't continue with anything else.
+struct FeedbackSlot {
+	enum TypeBit: u8 {
+		NIL = 1,
+		BOOL = 2,
+		NUMBER = 4,
+		STRING = 8,
+		OBJECT = 16, // any other object
+	};
+	u8 lhs_types = 0;
+	u8 rhs_types = 0;
+	// receiver class at property and invoke sites, callee function at calls
+	LoxObject *target = nullptr;
+	bool megamorphic = false; // saw more than one target
+
+	static u8 type_bit(LoxValue value);
+	void record_types(LoxValue lhs, LoxValue rhs) {
+		lhs_types |= type_bit(lhs);
+		rhs_types |= type_bit(rhs);
+	}
+	void record_target(LoxObject *obj) {
+		if (target == obj || megamorphic) return;
+		if (target == nullptr) target = obj;
+		else megamorphic = true;
+	}
+	// both operands have only ever had one type each
+	[[nodiscard]] bool is_monomorphic() const {
+		return std::has_single_bit(lhs_types) && std::has_single_bit(rhs_types);
+	}
+};
+
+inline u8 FeedbackSlot::type_bit(LoxValue value) {
+	switch (value.type) {
+		case ValueType::NIL: return NIL;
+		case ValueType::BOOL: return BOOL;
+		case ValueType::NUMBER: return NUMBER;
+		case ValueType::OBJECT: return value.as.obj->is_string() ? STRING : OBJECT;
+	}
+	return OBJECT; // unreachable
+}
+
+struct JitFunction;
+struct Trace;
+struct AotFunction;
+struct LazyBody;
+struct ObjectClosure;
+
 struct ObjectFunction: LoxObject {
 	int arity = 0;
 	Chunk chunk;
+	// most values its frame holds at once, counting the callee and arguments,
+	// set by verify_function
+	u32 max_stack = 0;
+	u32 call_count = 0; // compiled to native code once this reaches the threshold
+	JitFunction *jit = nullptr;
+	std::vector<Trace *> traces; // every loop that got hot, compiled or not
+	const AotFunction *aot = nullptr; // what it was compiled to by --emit-cpp
+	// indexed by instruction offset, allocated on first record
+	std::vector<FeedbackSlot> feedback;
 	ObjectString *name = nullptr;
 	int upvalue_count = 0;
+	// a function capturing nothing has one closure, made on first use
+	ObjectClosure *closure = nullptr;
+	// where its body is while it waits for its first call to be compiled
+	LazyBody *lazy = nullptr;
 	constexpr ObjectFunction() {
 		type = ObjectType::FUNCTION;
 	}
@@ -125,7 +191,8 @@ using NativeFn = LoxValue (*)(int arg_count, LoxValue *args);
 
 struct ObjectNative: LoxObject {
 	NativeFn function;
-	constexpr ObjectNative(NativeFn fn): function(fn) {
+	std::string_view name; // what it was defined as, kept by snapshots
+	constexpr ObjectNative(NativeFn fn, std::string_view name): function(fn), name(name) {
 		type = ObjectType::NATIVE;
 	}
 };
@@ -135,7 +202,7 @@ struct ObjectClosure: LoxObject {
 	ObjectUpvalue **upvalues;
 	int upvalue_count;
 	ObjectClosure(ObjectFunction *fn): function(fn),
-			upvalues(new ObjectUpvalue *[fn->upvalue_count]()),
+			upvalues(fn->upvalue_count > 0 ? new ObjectUpvalue *[fn->upvalue_count]() : nullptr),
 			upvalue_count(fn->upvalue_count) {
 #ifdef DEBUG_LOG_GC
 	fmt::print("{} allocate {} for {}\n", (void *) upvalues, sizeof(ObjectUpvalue), "ObjectUpvalue");
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "chunk.hpp"
+
+#include <utility>
+#include <vector>
+
+namespace bytelox {
+
+// A decoded instruction. Jump offsets are replaced with the index of the
+// instruction they land on, so passes can remove and replace instructions
+// without fixing up offsets by hand.
+struct Instruction {
+	u8 op;
+	std::vector<u8> operands; // operand bytes, not including a jump offset
+	int target = -1;          // index of the jump target, -1 if not a jump
+	u32 line;
+	bool removed = false;
+	// WIDE prefixed, with 2 bytes in operands for each operand and a 4 byte
+	// jump offset. Passes only ever see wide jumps, in chunks too long for
+	// a 2 byte offset.
+	bool wide = false;
+};
+
+// 1 for forward jumps, -1 for backward jumps, 0 if op doesn't jump.
+// The 2 byte offset is always the last operand of a jump instruction, and is
+// relative to the start of the offset.
+int jump_direction(u8 op);
+
+// op never falls through to the next instruction
+bool is_unconditional(u8 op);
+
+// the op an unchecked op skips the type checks of, op itself for others
+u8 checked_form(u8 op);
+// the unchecked form of a numeric op, op itself if it has none
+u8 unchecked_form(u8 op);
+
+// Number of values an instruction reads off the top of the stack, and the
+// number it leaves in their place. Instructions that only peek at the top
+// read one and leave it. False for ops passes don't see, like
+// superinstructions.
+bool stack_effect(const Instruction &ins, size_t &pops, size_t &pushes);
+// stack height before each instruction of a function, counting the callee
+// and its parameters, -1 where unreachable. Empty if the height isn't the
+// same on every path or an instruction has no stack_effect.
+std::vector<int> stack_heights(std::vector<Instruction> &code, int arity);
+
+// where the jump instruction starting at offset goes
+size_t jump_target(Chunk &chunk, size_t offset);
+
+std::vector<Instruction> decode_chunk(Chunk &chunk);
+// rewrites chunk code and lines from instructions, skipping removed ones.
+// JUMP, JUMP_IF_FALSE and LOOP are widened if their offset doesn't fit in 2
+// bytes.
+void encode_chunk(Chunk &chunk, std::vector<Instruction> &instructions);
+// Lands each of the compiler's forward jumps at the offsets in far_jumps,
+// which were too far for their 2 byte offset, on the offset paired with it.
+void widen_far_jumps(Chunk &chunk, const std::vector<std::pair<size_t, size_t>> &far_jumps);
+
+// Folds operators on constants and branches on constant conditions, drops
+// values pushed only to be popped, threads jumps through jumps and removes
+// unreachable code, until none of them change anything. Runs first.
+void optimize_chunk(Chunk &chunk);
+
+// Replaces common instruction sequences with superinstructions
+void fuse_superinstructions(Chunk &chunk);
+
+// Rewrites each CALL followed by a RETURN to a TAIL_CALL. Runs last, so no
+// other pass sees them.
+void mark_tail_calls(Chunk &chunk);
+
+// Replaces stack arithmetic on locals and constants, and assignments of its
+// results to locals, with three-address register ops. Runs before fusing.
+void lower_to_register_ops(Chunk &chunk, int arity);
+
+}
@@ -34,11 +34,16 @@ struct Token {
 	int line;
 };
 
+struct MappedFile;
+
 struct Scanner {
 	std::string_view src;
 	int start = 0;   // start of lexeme
 	int current = 0; // current character
 	int line = 1;
+	// the file src is mapped from, if it is, whose pages behind the scanner
+	// are let go as it goes
+	MappedFile *file = nullptr;
 	
 	Scanner(std::string_view src);
 	
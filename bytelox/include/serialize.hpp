@@ -0,0 +1,75 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <cstring>
+#include <string>
+#include <string_view>
+
+namespace bytelox {
+
+// FNV-1a, like strings, but 64 bit
+u64 hash_bytes(std::string_view bytes);
+
+// Appends values as their raw bytes, in the byte order of this machine
+struct ByteWriter {
+	std::string out;
+
+	template <typename T>
+	void put(T value) {
+		out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+	}
+	void put_bytes(const void *bytes, size_t size) {
+		out.append(static_cast<const char *>(bytes), size);
+	}
+};
+
+// Reads back what a ByteWriter wrote, failing rather than reading past end
+struct ByteReader {
+	const char *at;
+	const char *end;
+
+	template <typename T>
+	bool get(T &value) {
+		if (static_cast<size_t>(end - at) < sizeof(T)) return false;
+		std::memcpy(&value, at, sizeof(T));
+		at += sizeof(T);
+		return true;
+	}
+
+	// the next size bytes, nullptr if there aren't that many
+	const char *bytes(size_t size) {
+		if (static_cast<size_t>(end - at) < size) return nullptr;
+		const char *start = at;
+		at += size;
+		return start;
+	}
+};
+
+// A whole file, mapped read only where that's possible, and read in a chunk
+// at a time otherwise, like a pipe. data is nullptr if it couldn't be opened
+// or read.
+struct MappedFile {
+	const char *data = nullptr;
+	size_t size = 0;
+
+	explicit MappedFile(const std::string &path);
+	~MappedFile();
+	MappedFile(MappedFile &file) = delete;
+	MappedFile &operator=(MappedFile &file) = delete;
+
+	// Lets the pages of a mapping before at go, once there's a few MB of
+	// them. Reading them again maps them back in from the file, so this only
+	// keeps a file read front to back from staying in memory as a whole.
+	void release_before(const char *at);
+
+	std::string contents; // what was read in, where mapping isn't possible
+	bool mapped = false;
+	size_t released = 0; // bytes from the start let go already
+};
+
+// Writes contents to a temporary file beside path, then renames it over
+// path so a reader never sees half a file. false if it couldn't.
+bool replace_file(const std::string &path, std::string_view contents);
+
+}
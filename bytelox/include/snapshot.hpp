@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.hpp"
+
+#include <string>
+
+namespace bytelox {
+
+struct VM;
+
+// A snapshot is the heap of a VM after it ran a script: its globals and
+// every object they reach, written to a file a new VM can start from
+// instead of running the script again. Natives are saved as the name they
+// were defined with, and have to be defined in the VM loading the snapshot
+// too.
+
+// writes vm's globals and everything they reach to path, compiling any body
+// still waiting for its first call. false if it couldn't, or if something
+// reachable can't be saved, like an open upvalue or a body with errors.
+bool write_snapshot(VM &vm, const std::string &path);
+
+// defines the globals of the snapshot at path in vm, along with everything
+// they reach. false if the file isn't a snapshot this build can load, or
+// the code of a function in it doesn't pass verify_function.
+bool load_snapshot(VM &vm, const std::string &path);
+
+}
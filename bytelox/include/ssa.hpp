@@ -0,0 +1,95 @@
+#pragma once
+
+#include "optimizer.hpp"
+
+#include <map>
+#include <tuple>
+#include <vector>
+
+namespace bytelox {
+
+// Static single assignment form of a function's bytecode. The compiler has no
+// syntax tree to build it from, so it's lifted from the stack code: every
+// slot of the frame, locals and temporaries alike, holds a value, and every
+// value is defined once. Constants and pure operators are hash consed, so an
+// instruction recomputing something already in a slot gives the same value.
+namespace ssa {
+
+using ValueId = int;
+
+struct Value {
+	enum Kind {
+		ENTRY,    // the callee or a parameter
+		CONSTANT, // pushed by instruction origin, or an equal constant
+		PURE,     // op applied to lhs and rhs, -1 for unary ops
+		PHI,      // slot lhs merged where control flow joins at block origin
+		OPAQUE,   // anything else instruction origin pushes, unknown each time it runs
+	} kind;
+	u8 op = 0;
+	ValueId lhs = -1, rhs = -1;
+	int origin = -1;
+	LoxValue constant = LoxValue();
+};
+
+// Instructions first to last, and the value in each slot when entering and
+// leaving it. entry is empty if the block can't be reached.
+struct Block {
+	size_t first, last;
+	std::vector<int> successors = {};
+	std::vector<ValueId> entry = {};
+	std::vector<ValueId> exit = {};
+};
+
+struct Function {
+	Chunk &chunk;
+	std::vector<Instruction> code;
+	size_t entry_height;
+	std::vector<Value> values;
+	std::map<std::tuple<int, u64, int, int>, ValueId> numbering;
+	std::vector<Block> blocks;
+	std::vector<int> block_of; // block of each instruction
+	std::vector<int> height;   // stack height before each instruction, -1 if unreachable
+	// slots captured by a closure, which can be written by any call, so
+	// reading one always gives an opaque value
+	std::vector<bool> captured;
+	// values proven to be numbers by infer_numbers
+	std::vector<bool> numbers;
+
+	Function(Chunk &chunk, int arity);
+
+	// finds blocks and the values in every slot, false if the stack height
+	// isn't the same on every path or an instruction isn't understood
+	bool build();
+	// applies code[i] to the values in slots, false if it can't
+	bool step(std::vector<ValueId> &slots, size_t i);
+	// lowest slot below limit that holds value and isn't captured, -1 if none
+	int holder(const std::vector<ValueId> &slots, ValueId value, size_t limit);
+
+	ValueId number(Value value, std::tuple<int, u64, int, int> key);
+	ValueId constant(size_t i);
+	ValueId pure(u8 op, ValueId lhs, ValueId rhs);
+	ValueId opaque(size_t i);
+	ValueId phi(int block, int slot);
+	// value is a number whenever it has been computed without an error
+	bool is_number(ValueId value);
+
+private:
+	// Finds the values that are numbers. A phi is one if every value it
+	// merges is, so loop counters and accumulators starting from numbers are
+	// proven by assuming every value is a number until shown otherwise.
+	void infer_numbers();
+	// merges slots into the entry of block, false if the heights differ
+	bool merge(int block, const std::vector<ValueId> &slots, bool &changed);
+};
+
+}
+
+// Propagates constants and copies of locals, eliminates common
+// subexpressions and dead stores to locals, and hoists loop invariant
+// computations that can't fail out of loops, over the SSA form of chunk.
+// Runs after optimize_chunk, and again between rounds if peephole is set, to
+// fold what propagation exposes. Arithmetic and comparisons on values proven
+// to be numbers are then replaced with their unchecked forms.
+void optimize_ssa(Chunk &chunk, int arity, bool peephole);
+
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.hpp"
+#include "jit.hpp"
+#include "vm.hpp"
+
+namespace bytelox {
+
+// Native code for a hot loop, compiled from a recording of one iteration.
+// It runs the iterations that take the same path with the loop's locals
+// unboxed in registers, and exits back to the VM anywhere the path differs.
+struct Trace {
+	u32 loop;           // offset of the LOOP instruction
+	u32 depth = 0;      // stack slots the frame uses at the top of the loop
+	u32 max_stack = 0;  // most values an exit pushes above those
+	JitFunction *native = nullptr; // nullptr if it couldn't be compiled, or stopped paying off
+	u64 entries = 0;
+	u64 iterations = 0; // taken natively, counted on exit
+
+	// runs from the top of the loop, returns where to carry on interpreting
+	u8 *run(VM &vm, VM::CallFrame &frame);
+};
+
+// Records the loop starting at frame.ip by running one iteration of it, and
+// compiles the recording if the iteration made it back to the top. Recording
+// stops before any instruction traces don't handle, with frame.ip left there.
+bool record_trace(VM &vm, VM::CallFrame &frame, Trace &trace);
+
+}
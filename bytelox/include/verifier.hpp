@@ -0,0 +1,21 @@
+#pragma once
+
+#include "lox_object.hpp"
+
+namespace bytelox {
+
+// Checks that the code of fn can run without reading or writing past what
+// it's given: every instruction is a known op with all its operands, every
+// constant, local and upvalue index is in range and every constant has the
+// type its op takes, every jump lands on an instruction, the stack is the
+// same height on every path to an instruction and never popped below the
+// callee, and no path runs off the end of the code. Sets fn.max_stack to
+// the most values the frame holds at once. false if any check fails.
+//
+// Takes any code the VM can run, including ops it writes over others while
+// running, so it can check code read back from a file. Function constants
+// are checked as far as their upvalue count, and have to be verified on
+// their own.
+bool verify_function(ObjectFunction &fn);
+
+}
@@ -3,6 +3,8 @@
 #include "chunk.hpp"
 #include "hash_table.hpp"
 #include "compiler.hpp"
+#include "jit.hpp"
+#include "serialize.hpp"
 
 #include <string>
 #include <vector>
@@ -18,6 +20,61 @@ enum class InterpretResult {
 	INTERPRET_RUNTIME_ERROR
 };
 
+// The VM's value stack. Its layout is fixed, unlike std::vector's, so compiled
+// code can keep top in a register and push and pop without calling the VM.
+struct ValueStack {
+	LoxValue *values = nullptr;
+	LoxValue *top = nullptr;   // one past the last value
+	LoxValue *limit = nullptr; // end of the allocation
+
+	ValueStack() = default;
+	~ValueStack() {
+		delete[] values;
+	}
+	ValueStack(ValueStack &stack) = delete;
+	ValueStack &operator=(ValueStack &stack) = delete;
+
+	[[nodiscard]] size_t size() const {
+		return top - values;
+	}
+	LoxValue &operator[](size_t i) {
+		return values[i];
+	}
+	LoxValue &back() {
+		return top[-1];
+	}
+	LoxValue *begin() {
+		return values;
+	}
+	LoxValue *end() {
+		return top;
+	}
+	[[nodiscard]] size_t capacity() const {
+		return limit - values;
+	}
+	void push_back(LoxValue value) {
+		if (top == limit) [[unlikely]] reserve(2 * size());
+		*top++ = value;
+	}
+	// for the instructions of a frame, which VM::call made room for
+	void push(LoxValue value) {
+		*top++ = value;
+	}
+	void pop_back() {
+		top--;
+	}
+	void clear() {
+		top = values;
+	}
+	void resize(size_t new_size) {
+		reserve(new_size);
+		while (size() < new_size) *top++ = LoxValue();
+		top = values + new_size;
+	}
+	// moves the values if capacity is less than n, invalidating pointers to them
+	void reserve(size_t n);
+};
+
 struct VM {
 	struct CallFrame {
 		ObjectClosure *closure;
@@ -27,22 +84,34 @@ struct VM {
 				closure(closure), ip(ip), slots(slots) {}
 	};
 
-	Compiler *compiler;
-	Chunk *chunk;
+	std::unique_ptr<Compiler> compiler;
+	CompilerOptions compiler_options;
 	u8 *ip = nullptr; // next instruction to be executed
-	std::vector<LoxValue> stack;
+	ValueStack stack;
 
 	LoxObject *objects = nullptr;
 	size_t bytes_allocated = 0;
 	size_t next_GC = 1024 * 1024;
 	
 	
+	// sorted by stack index, highest first, and indexed by it
 	ObjectUpvalue *open_upvalues = nullptr;
+	std::vector<ObjectUpvalue *> open_upvalue_at;
 	HashTable globals;
 	HashTable strings;
 	
 	std::vector<CallFrame> frames;
 	std::vector<LoxObject *> gray_stack;
+	CodeCache code_cache;
+	// what the chunks of each compiled script were packed into. Functions
+	// don't track which one they're in, so these last as long as the VM.
+	std::vector<std::unique_ptr<std::byte[]>> code_arenas;
+	// copies of the scripts compiled lazily, which their LazyBodies point into
+	std::vector<std::unique_ptr<char[]>> sources;
+	// the files scripts were compiled from, which they can point into
+	std::vector<std::unique_ptr<MappedFile>> source_files;
+	// iterations of recently run loops, hashed by the address they jump back to
+	u16 loop_counters[64] = {};
 	
 	ObjectString *init_string = nullptr;
 
@@ -57,25 +126,80 @@ struct VM {
 	LoxValue &peek();
 	bool call(ObjectClosure &closure, int arg_count);
 	bool call_value(LoxValue callee, int arg_count);
+	// For TAIL_CALL, once call_value pushed a frame: closes the caller's
+	// upvalues and moves the callee and its arguments down over the caller's
+	// slots, then drops the caller's frame.
+	void replace_caller_frame();
 	ObjectUpvalue *capture_upvalue(u32 local_index);
 	void close_upvalues(u32 last_index);
 	void define_method(ObjectString *name);
 	bool bind_method(ObjectClass *klass, ObjectString *name);
+	// replaces the instance on top of the stack with its property
+	bool get_property(ObjectString *name);
 	bool invoke(ObjectString *name, int arg_count);
 	bool invoke_from_class(ObjectClass *klass, ObjectString *name, int arg_count);
+	// whether the call the GUARD_CALL or GUARD_INVOKE at guard checks would
+	// run the function inlined after it, which can then run in its place
+	bool inlined_target(CallFrame *frame, u8 *guard);
+	// RETURN_INLINED, drops the slots of an inlined call from under its result
+	void return_inlined(u8 drop);
 	LoxValue read_constant(CallFrame *frame);
+	// reads a register op operand of kind RegisterKind, popping STACK operands
+	LoxValue read_register(CallFrame *frame, int kind, u8 index);
+	// feedback for the instruction starting at instruction in frame's function
+	FeedbackSlot &feedback_slot(CallFrame *frame, u8 *instruction);
+	void record_receiver(CallFrame *frame, u8 *instruction, LoxValue receiver);
+	void record_callee(CallFrame *frame, u8 *instruction, LoxValue callee);
+	// print the feedback of every function still on the heap
+	void dump_feedback();
 	void concatenate();
+	// pushes a closure of fn, captures are the CLOSURE instruction's upvalue
+	// operands, 2 bytes each if it's wide
+	void push_closure(CallFrame *frame, ObjectFunction *fn, u8 *captures, bool wide = false);
 	
 	// create garbage collected LoxObject of type T, return wrapped in LoxValue
 	template<typename T, typename... Args>
 	LoxValue GC(Args&&... args);
 	// return LoxValue with pointer to ObjectString of str, either new or interned
 	LoxValue get_ObjectString(std::string_view str);
+	// a new string taking chars, which holds length chars and a '\0', left
+	// out of strings until intern
+	LoxValue new_ObjectString(std::unique_ptr<char[]> chars, u32 length);
+	// the interned string with the chars of string, interning string if
+	// there's none yet
+	ObjectString *intern(ObjectString &string);
+	// a == b, comparing strings by their chars. Interns strings whose chars
+	// might be equal, so comparing them again is by address.
+	bool values_equal(LoxValue a, LoxValue b);
 	void free_LoxObject(LoxObject *object);
 	void define_native(std::string_view name, NativeFn fn);
 	
+	// the script function of src, nullptr if it has compile errors
+	ObjectFunction *compile(std::string_view src);
+	// compiles the contents of file, which the VM keeps instead of copying
+	// them for lazy bodies. Views of them stay valid as long as the VM.
+	ObjectFunction *compile(std::unique_ptr<MappedFile> file);
+	// compiles the body of a function declared lazily, false on errors
+	bool compile_lazy(ObjectFunction &fn);
 	InterpretResult interpret(std::string_view src);
+	// runs a script compiled before, by compile or from a cache
+	InterpretResult interpret(ObjectFunction &script);
 	InterpretResult run();
+	// runs the instruction after a WIDE, with frame->ip past the WIDE.
+	// False on a runtime error.
+	bool run_wide(CallFrame *frame);
+	u16 &loop_counter(u8 *header) {
+		return loop_counters[(reinterpret_cast<uintptr_t>(header) >> 1) % 64];
+	}
+	// The LOOP instruction at loop jumped back to frame->ip enough times to
+	// record a trace of it. Both of these leave frame->ip wherever the loop
+	// should carry on being interpreted from.
+	void hot_loop(CallFrame *frame, u8 *loop);
+	// runs the trace of the loop if it has a usable one
+	void enter_trace(CallFrame *frame, u8 *loop);
+	// runs compiled code for as long as the current frame has it, returns
+	// false to keep interpreting, or true when finished with result
+	bool run_compiled(InterpretResult &result);
 	
 	template<typename... Args>
 	void runtime_error(fmt::format_string<Args...> format, Args&&... args);
@@ -85,7 +209,7 @@ struct VM {
 	void mark_compiler_roots();
 	void mark_value(LoxValue &val);
 	void mark_object(LoxObject *obj);
-	void mark_vec(std::vector<LoxValue> &vec);
+	void mark_vec(ChunkArray<LoxValue> &vec);
 	void mark_table(HashTable &table);
 	void remove_white(HashTable &table);
 	void blacken_object(LoxObject &obj);
@@ -95,4 +219,6 @@ struct VM {
 
 };
 
+bool is_falsey(LoxValue value);
+
 }
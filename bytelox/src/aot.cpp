@@ -0,0 +1,623 @@
+#include "aot.hpp"
+#include "optimizer.hpp"
+#include "verifier.hpp"
+
+#include <cmath>
+#include <iterator>
+#include <unordered_map>
+
+namespace bytelox {
+
+namespace {
+
+std::string cpp_string(std::string_view chars) {
+	std::string literal = "\"";
+	for (char c : chars) {
+		if (c == '"' || c == '\\') {
+			literal += '\\';
+			literal += c;
+		}
+		else if (c >= ' ' && c <= '~') literal += c;
+		else literal += fmt::format("\\{:03o}", static_cast<u8>(c));
+	}
+	return literal + '"';
+}
+
+std::string cpp_number(double number) {
+	if (!std::isfinite(number)) {
+		return fmt::format("std::bit_cast<double>(u64(0x{:x}))", std::bit_cast<u64>(number));
+	}
+	// shortest form that reads back as the same double
+	std::string literal = fmt::format("{}", number);
+	if (literal.find_first_of(".e") == std::string::npos) literal += ".0";
+	return literal;
+}
+
+// Lowers each function to a C++ function over the VM stack. Control flow
+// becomes gotos, arithmetic and comparisons on numbers are inlined, and
+// everything else calls into the runtime with the same errors as the VM.
+struct Emitter {
+	std::string out;
+	std::vector<ObjectFunction *> functions;
+	std::unordered_map<ObjectFunction *, size_t> index_of;
+
+	template<typename... Args>
+	void emit(fmt::format_string<Args...> format, Args&&... args) {
+		fmt::format_to(std::back_inserter(out), format, std::forward<Args>(args)...);
+		out += '\n';
+	}
+
+	void collect(ObjectFunction *fn) {
+		index_of[fn] = functions.size();
+		functions.push_back(fn);
+		for (LoxValue &constant : fn->chunk.constants) {
+			if (constant.is_object() && constant.as.obj->is_function()) collect(&constant.as_function());
+		}
+	}
+
+	// declares name holding a register op operand, popping STACK operands
+	void read_register(int kind, u8 index, const char *name) {
+		switch (static_cast<RegisterKind>(kind)) {
+			case RegisterKind::LOCAL: emit("\t\tLoxValue {} = stack[slots + {}];", name, index); return;
+			case RegisterKind::CONSTANT: emit("\t\tLoxValue {} = constants[{}];", name, index); return;
+			case RegisterKind::STACK: break;
+		}
+		emit("\t\tLoxValue {} = stack.back();", name);
+		emit("\t\tstack.pop_back();");
+	}
+
+	void emit_data(ObjectFunction &fn, size_t index) {
+		Chunk &chunk = fn.chunk;
+		out += fmt::format("const u8 code_{}[] = {{", index);
+		for (size_t i=0; i<chunk.code.size(); i++) {
+			out += fmt::format("{}{}", i % 16 == 0 ? "\n\t" : " ", chunk.code[i]);
+			if (i + 1 < chunk.code.size()) out += ',';
+		}
+		emit("\n}};");
+		emit("const LineStart lines_{}[] = {{", index);
+		for (LineStart run : chunk.lines) {
+			emit("\t{{{}, {}}},", run.start, run.line);
+		}
+		emit("}};");
+		if (chunk.constants.empty()) return;
+		emit("const AotConstant constants_{}[] = {{", index);
+		for (LoxValue constant : chunk.constants) {
+			switch (constant.type) {
+				case ValueType::NIL: emit("\t{{AotConstant::NIL}},"); break;
+				case ValueType::BOOL: emit("\t{{AotConstant::BOOL, 0, nullptr, {}}},", +constant.as.boolean); break;
+				case ValueType::NUMBER: emit("\t{{AotConstant::NUMBER, {}}},", cpp_number(constant.as.number)); break;
+				case ValueType::OBJECT:
+					if (constant.as.obj->is_function()) {
+						emit("\t{{AotConstant::FUNCTION, 0, nullptr, {}}},", index_of[&constant.as_function()]);
+					}
+					else {
+						ObjectString &string = constant.as_string();
+						emit("\t{{AotConstant::STRING, 0, {}, {}}},",
+								cpp_string({string.chars.get(), string.length}), string.length);
+					}
+					break;
+			}
+		}
+		emit("}};");
+	}
+
+	void emit_instruction(Chunk &chunk, size_t offset) {
+		using enum OP;
+		size_t next = offset + chunk.instruction_size(offset);
+		bool wide = chunk.code[offset] == +WIDE;
+		u8 op = chunk.code[offset + wide];
+		// operands by position after the op, 2 bytes each after a WIDE
+		u32 arg[8] = {op};
+		for (size_t k = 1, at = offset + wide + 1; k < 8 && at + wide < next; k++, at += 1 + wide) {
+			arg[k] = wide ? chunk.code[at] | (chunk.code[at + 1] << 8) : chunk.code[at];
+		}
+		size_t target = jump_direction(op) != 0 ? jump_target(chunk, offset) : 0;
+		constexpr const char *FAIL = "return JitStatus::RUNTIME_ERROR;";
+		constexpr const char *CHECK_STATUS = "status != JitStatus::CONTINUE) return status;";
+
+		switch (static_cast<OP>(op)) {
+			case CONSTANT: emit("\tstack.push(constants[{}]);", arg[1]); break;
+			case CONSTANT_LONG: emit("\tstack.push(constants[{}]);", arg[1] | (arg[2] << 8) | (arg[3] << 16)); break;
+			case NIL: emit("\tstack.push(LoxValue());"); break;
+			case TRUE: emit("\tstack.push(LoxValue(true));"); break;
+			case FALSE: emit("\tstack.push(LoxValue(false));"); break;
+			case POP: emit("\tstack.pop_back();"); break;
+			case GET_LOCAL: emit("\tstack.push(stack[slots + {}]);", arg[1]); break;
+			case SET_LOCAL: emit("\tstack[slots + {}] = stack.back();", arg[1]); break;
+			case GET_GLOBAL:
+				emit("\tif (!get_global(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[1], FAIL);
+				break;
+			case DEFINE_GLOBAL:
+				emit("\tvm.globals.set(&constants[{}].as_string(), stack.back());", arg[1]);
+				emit("\tstack.pop_back();");
+				break;
+			case SET_GLOBAL:
+				emit("\tif (!set_global(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[1], FAIL);
+				break;
+			case GET_UPVALUE: emit("\tget_upvalue(vm, frame, {});", arg[1]); break;
+			case SET_UPVALUE: emit("\tset_upvalue(vm, frame, {});", arg[1]); break;
+			case GET_PROPERTY:
+				emit("\tif (!get_property(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[1], FAIL);
+				break;
+			case SET_PROPERTY:
+				emit("\tif (!set_property(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[1], FAIL);
+				break;
+			case GET_SUPER:
+				emit("\tif (!get_super(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[1], FAIL);
+				break;
+			case EQUAL:
+			case NOT_EQUAL:
+				emit("\tstack.top[-2] = LoxValue({}vm.values_equal(stack.top[-2], stack.top[-1]));", op == +EQUAL ? "" : "!");
+				emit("\tstack.pop_back();");
+				break;
+			case GREATER:
+			case GREATER_EQUAL:
+			case LESS:
+			case LESS_EQUAL: {
+				constexpr const char *compare[] = {">", ">=", "<", "<="};
+				emit("\tif (!numbers(vm)) return error(vm, frame, code + {}, \"Operands must be numbers.\");", next);
+				emit("\tstack.top[-2] = LoxValue(stack.top[-2].as.number {} stack.top[-1].as.number);",
+						compare[op - +GREATER]);
+				emit("\tstack.pop_back();");
+				break;
+			}
+			case ADD:
+			case ADD_NUM:
+			case ADD_STR:
+				emit("\tif (numbers(vm)) {{");
+				emit("\t\tstack.top[-2].as.number += stack.top[-1].as.number;");
+				emit("\t\tstack.pop_back();");
+				emit("\t}}");
+				emit("\telse if (!add(vm, frame, code + {})) {}", next, FAIL);
+				break;
+			case SUB:
+			case MUL:
+			case DIV:
+				emit("\tif (!numbers(vm)) return error(vm, frame, code + {}, \"Operands must be numbers.\");", next);
+				emit("\tstack.top[-2].as.number {}= stack.top[-1].as.number;", "-*/"[op - +SUB]);
+				emit("\tstack.pop_back();");
+				break;
+			case ADD_UNCHECKED:
+			case SUB_UNCHECKED:
+			case MUL_UNCHECKED:
+			case DIV_UNCHECKED:
+				emit("\tstack.top[-2].as.number {}= stack.top[-1].as.number;", "+-*/"[op - +ADD_UNCHECKED]);
+				emit("\tstack.pop_back();");
+				break;
+			case GREATER_UNCHECKED:
+			case GREATER_EQUAL_UNCHECKED:
+			case LESS_UNCHECKED:
+			case LESS_EQUAL_UNCHECKED: {
+				constexpr const char *compare[] = {">", ">=", "<", "<="};
+				emit("\tstack.top[-2] = LoxValue(stack.top[-2].as.number {} stack.top[-1].as.number);",
+						compare[op - +GREATER_UNCHECKED]);
+				emit("\tstack.pop_back();");
+				break;
+			}
+			case NOT: emit("\tstack.back() = LoxValue(is_falsey(stack.back()));"); break;
+			case NEGATE:
+				emit("\tif (!stack.back().is_number()) return error(vm, frame, code + {}, \"Operand must be a number.\");", next);
+				emit("\tstack.back().as.number *= -1;");
+				break;
+			case PRINT: emit("\tprint(vm);"); break;
+			case JUMP:
+			case LOOP:
+			case LOOP_TRACE:
+				emit("\tgoto at_{};", target);
+				break;
+			case JUMP_IF_FALSE: emit("\tif (is_falsey(stack.back())) goto at_{};", target); break;
+			case FOR_LOOP:
+			case FOR_LOOP_TRACE:
+				emit("\t{{");
+				emit("\t\tLoxValue &counter = stack[slots + {}];", arg[2]);
+				emit("\t\tif (!counter.is_number()) return error(vm, frame, code + {}, \"Operands must be two numbers or two strings.\");", next);
+				emit("\t\tcounter.as.number += constants[{}].as.number;", arg[3]);
+				read_register(arg[1], arg[4], "bound");
+				emit("\t\tif (!bound.is_number()) return error(vm, frame, code + {}, \"Operands must be numbers.\");", next);
+				emit("\t\tif (counter.as.number < bound.as.number) goto at_{};", target);
+				emit("\t}}");
+				break;
+			case CALL:
+				emit("\tif (JitStatus status = call(vm, frame, code + {}, {}); {}", next, arg[1], CHECK_STATUS);
+				break;
+			case TAIL_CALL:
+				emit("\tif (JitStatus status = tail_call(vm, frame, code + {}, {}); {}", next, arg[1], CHECK_STATUS);
+				break;
+			case INVOKE:
+			case SUPER_INVOKE:
+				emit("\tif (JitStatus status = {}(vm, frame, code + {}, &constants[{}].as_string(), {}); {}",
+						op == +INVOKE ? "invoke" : "super_invoke", next, arg[1], arg[2], CHECK_STATUS);
+				break;
+			case CLOSURE:
+				emit("\tvm.push_closure(frame, &constants[{}].as_function(), code + {}{});", arg[1],
+						offset + (wide ? 4 : 2), wide ? ", true" : "");
+				break;
+			case CLOSE_UPVALUE:
+				emit("\tvm.close_upvalues(stack.size() - 1);");
+				emit("\tstack.pop_back();");
+				break;
+			case RETURN: emit("\treturn return_from(vm, frame);"); break;
+			case GUARD_CALL:
+			case GUARD_INVOKE: emit("\tif (!vm.inlined_target(frame, code + {})) goto at_{};", offset, target); break;
+			case RETURN_INLINED:
+				emit("\tvm.return_inlined({});", arg[1]);
+				emit("\tgoto at_{};", target);
+				break;
+			case CLASS: emit("\tstack.push(vm.GC<ObjectClass>(&constants[{}].as_string()));", arg[1]); break;
+			case INHERIT: emit("\tif (!inherit(vm, frame, code + {})) {}", next, FAIL); break;
+			case METHOD: emit("\tvm.define_method(&constants[{}].as_string());", arg[1]); break;
+			case ADD_LOCALS:
+			case ADD_LOCALS_NUM:
+			case ADD_LOCAL_CONSTANT:
+			case ADD_LOCAL_CONSTANT_NUM: {
+				bool locals = op == +ADD_LOCALS || op == +ADD_LOCALS_NUM;
+				emit("\t{{");
+				emit("\t\tLoxValue a = stack[slots + {}], b = {}[{}];", arg[1], locals ? "stack" : "constants",
+						locals ? fmt::format("slots + {}", arg[2]) : fmt::format("{}", arg[2]));
+				emit("\t\tif (a.is_number() && b.is_number()) stack.push(LoxValue(a.as.number + b.as.number));");
+				emit("\t\telse if (!add_values(vm, frame, code + {}, a, b)) {}", next, FAIL);
+				emit("\t}}");
+				break;
+			}
+			case SUB_LOCAL_CONSTANT:
+			case LESS_LOCALS_JUMP:
+			case LESS_LOCAL_CONSTANT_JUMP: {
+				bool locals = op == +LESS_LOCALS_JUMP;
+				emit("\t{{");
+				emit("\t\tLoxValue a = stack[slots + {}], b = {}[{}];", arg[1], locals ? "stack" : "constants",
+						locals ? fmt::format("slots + {}", arg[2]) : fmt::format("{}", arg[2]));
+				emit("\t\tif (!a.is_number() || !b.is_number()) return error(vm, frame, code + {}, \"Operands must be numbers.\");", next);
+				if (op == +SUB_LOCAL_CONSTANT) emit("\t\tstack.push(LoxValue(a.as.number - b.as.number));");
+				else emit("\t\tif (!(a.as.number < b.as.number)) goto at_{};", target);
+				emit("\t}}");
+				break;
+			}
+			case GET_LOCAL_PROPERTY:
+				emit("\tstack.push(stack[slots + {}]);", arg[1]);
+				emit("\tif (!get_property(vm, frame, code + {}, &constants[{}].as_string())) {}", next, arg[2], FAIL);
+				break;
+			case SET_LOCAL_POP:
+				emit("\tstack[slots + {}] = stack.back();", arg[1]);
+				emit("\tstack.pop_back();");
+				break;
+			case MOVE:
+				emit("\t{{");
+				read_register(arg[1] & 3, arg[3], "value");
+				emit("\t\tstack[slots + {}] = value;", arg[2]);
+				emit("\t}}");
+				break;
+			case ADD_R:
+			case SUB_R:
+			case MUL_R:
+			case DIV_R: {
+				u8 mode = arg[1];
+				bool to_local = static_cast<RegisterKind>((mode >> 4) & 3) == RegisterKind::LOCAL;
+				emit("\t{{");
+				read_register((mode >> 2) & 3, arg[4], "rhs");
+				read_register(mode & 3, arg[3], "lhs");
+				std::string result = fmt::format("LoxValue(lhs.as.number {} rhs.as.number)", "+-*/"[op - +ADD_R]);
+				if (mode & UNCHECKED_NUMBERS) {
+					if (to_local) emit("\t\tstack[slots + {}] = {};", arg[2], result);
+					else emit("\t\tstack.push({});", result);
+					emit("\t}}");
+					break;
+				}
+				if (to_local) emit("\t\tif (lhs.is_number() && rhs.is_number()) stack[slots + {}] = {};", arg[2], result);
+				else emit("\t\tif (lhs.is_number() && rhs.is_number()) stack.push({});", result);
+				if (op != +ADD_R) {
+					emit("\t\telse return error(vm, frame, code + {}, \"Operands must be numbers.\");", next);
+				}
+				else {
+					emit("\t\telse if (!add_values(vm, frame, code + {}, lhs, rhs)) {}", next, FAIL);
+					if (to_local) {
+						emit("\t\telse {{");
+						emit("\t\t\tstack[slots + {}] = stack.back();", arg[2]);
+						emit("\t\t\tstack.pop_back();");
+						emit("\t\t}}");
+					}
+				}
+				emit("\t}}");
+				break;
+			}
+			case WIDE: break; // decoded above
+		}
+	}
+
+	void emit_function(ObjectFunction &fn, size_t index) {
+		Chunk &chunk = fn.chunk;
+		// labels for every jump target, and every instruction a call returns to
+		std::vector<bool> labeled(chunk.code.size() + 1, false);
+		std::vector<size_t> resume_at{0};
+		for (size_t offset = 0; offset < chunk.code.size();) {
+			u8 op = chunk.code[offset] == +OP::WIDE ? chunk.code[offset + 1] : chunk.code[offset];
+			size_t next = offset + chunk.instruction_size(offset);
+			if (jump_direction(op) != 0) {
+				labeled[jump_target(chunk, offset)] = true;
+			}
+			if (op == +OP::CALL || op == +OP::INVOKE || op == +OP::SUPER_INVOKE) {
+				labeled[next] = true;
+				resume_at.push_back(next);
+			}
+			offset = next;
+		}
+
+		emit("JitStatus function_{}(VM &vm, Frame *frame, u32 entry) {{", index);
+		emit("\t[[maybe_unused]] ValueStack &stack = vm.stack;");
+		emit("\t[[maybe_unused]] LoxValue *constants = frame->closure->function->chunk.constants.data();");
+		emit("\t[[maybe_unused]] u8 *code = frame->closure->function->chunk.code.data();");
+		emit("\t[[maybe_unused]] size_t slots = frame->slots;");
+		emit("\tswitch (entry) {{");
+		emit("\t\tcase 0: break;");
+		for (size_t offset : resume_at) {
+			if (offset != 0) emit("\t\tcase {}: goto at_{};", offset, offset);
+		}
+		emit("\t\tdefault: return JitStatus::RUNTIME_ERROR;");
+		emit("\t}}");
+		i64 line = -1;
+		for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+			if (labeled[offset]) emit("at_{}:", offset);
+			if (chunk.get_line(offset) != line) {
+				line = chunk.get_line(offset);
+				emit("\t// line {}", line);
+			}
+			emit_instruction(chunk, offset);
+		}
+		if (labeled[chunk.code.size()]) emit("at_{}:", chunk.code.size());
+		emit("\treturn JitStatus::RUNTIME_ERROR; // unreachable, every function ends by returning");
+		emit("}}");
+	}
+
+	std::string emit_program(ObjectFunction &script, std::string_view path) {
+		collect(&script);
+		emit("// Generated by lox --emit-cpp from {}, link with the bytelox runtime library", path);
+		emit("#include \"aot.hpp\"");
+		emit("");
+		emit("#include <iterator>");
+		emit("");
+		emit("using namespace bytelox;");
+		emit("using namespace bytelox::aot;");
+		emit("");
+		emit("namespace {{");
+		for (size_t i=0; i<functions.size(); i++) {
+			ObjectFunction &fn = *functions[i];
+			emit("");
+			emit("// {}", fn.name != nullptr ? fmt::format("{}()", fn.name->chars.get()) : "script");
+			emit_data(fn, i);
+			emit("");
+			emit_function(fn, i);
+		}
+		emit("");
+		emit("const AotFunction functions[] = {{");
+		for (size_t i=0; i<functions.size(); i++) {
+			ObjectFunction &fn = *functions[i];
+			emit("\t{{{}, {}, {}, code_{}, {}, lines_{}, {}, {}, {}, function_{}}},",
+					fn.name != nullptr ? cpp_string(fn.name->chars.get()) : "nullptr", fn.arity, fn.upvalue_count,
+					i, fn.chunk.code.size(), i, fn.chunk.lines.size(),
+					fn.chunk.constants.empty() ? "nullptr" : fmt::format("constants_{}", i), fn.chunk.constants.size(), i);
+		}
+		emit("}};");
+		emit("");
+		emit("}}");
+		emit("");
+		emit("int main() {{");
+		emit("\tVM vm;");
+		emit("\tInterpretResult result = run_aot(vm, functions, std::size(functions));");
+		emit("\tif (result == InterpretResult::INTERPRET_COMPILE_ERROR) return 65;");
+		emit("\treturn result == InterpretResult::INTERPRET_RUNTIME_ERROR ? 70 : 0;");
+		emit("}}");
+		return std::move(out);
+	}
+};
+
+}
+
+std::string emit_cpp(ObjectFunction &script, std::string_view path) {
+	return Emitter().emit_program(script, path);
+}
+
+InterpretResult run_aot(VM &vm, const AotFunction *functions, size_t count) {
+	// there's nothing left to compile
+	vm.compiler_options.jit = false;
+	vm.compiler_options.trace = false;
+
+	// every function is created before any constants refer to them, and
+	// stays on the stack until the script's closure has been made
+	size_t base = vm.stack.size();
+	for (size_t i=0; i<count; i++) {
+		vm.stack.push_back(vm.GC<ObjectFunction>());
+	}
+	std::vector<Chunk *> chunks;
+	for (size_t i=0; i<count; i++) {
+		const AotFunction &aot = functions[i];
+		ObjectFunction &fn = vm.stack[base + i].as_function();
+		chunks.push_back(&fn.chunk);
+		fn.arity = aot.arity;
+		fn.upvalue_count = aot.upvalue_count;
+		fn.aot = &aot;
+		fn.chunk.code.assign(aot.code, aot.code + aot.code_size);
+		fn.chunk.lines.assign(aot.lines, aot.lines + aot.line_count);
+		if (aot.name != nullptr) fn.name = &vm.get_ObjectString(aot.name).as_string();
+		for (u32 j=0; j<aot.constant_count; j++) {
+			const AotConstant &constant = aot.constants[j];
+			LoxValue value;
+			switch (constant.kind) {
+				case AotConstant::NIL: break;
+				case AotConstant::BOOL: value = LoxValue(constant.index != 0); break;
+				case AotConstant::NUMBER: value = LoxValue(constant.number); break;
+				case AotConstant::STRING: value = vm.get_ObjectString({constant.chars, constant.index}); break;
+				case AotConstant::FUNCTION: value = vm.stack[base + constant.index]; break;
+			}
+			vm.stack[base + i].as_function().chunk.constants.push_back(value);
+		}
+	}
+	vm.code_arenas.push_back(pack_chunks(chunks));
+	// which also finds how much stack each function's frame needs
+	for (size_t i=0; i<count; i++) {
+		if (!verify_function(vm.stack[base + i].as_function())) return InterpretResult::INTERPRET_COMPILE_ERROR;
+	}
+	ObjectFunction *script = &vm.stack[base].as_function();
+	LoxValue closure = vm.GC<ObjectClosure>(script);
+	vm.stack.resize(base);
+	vm.stack.push_back(closure);
+	vm.call(closure.as_closure(), 0);
+
+	for (;;) {
+		VM::CallFrame &frame = vm.frames.back();
+		ObjectFunction *fn = frame.closure->function;
+		switch (fn->aot->run(vm, &frame, frame.ip - fn->chunk.code.data())) {
+			case JitStatus::FRAME_CHANGED: break;
+			case JitStatus::DONE: return InterpretResult::INTERPRET_OK;
+			default: return InterpretResult::INTERPRET_RUNTIME_ERROR;
+		}
+	}
+}
+
+namespace aot {
+
+namespace {
+
+// calls nested on the native stack before unwinding to run_aot
+constexpr int MAX_NATIVE_DEPTH = 2048;
+int native_depth = 0;
+
+JitStatus finish_call(VM &vm, Frame *&frame, size_t frame_count, bool ok) {
+	if (!ok) return JitStatus::RUNTIME_ERROR;
+	if (vm.frames.size() != frame_count) {
+		if (native_depth == MAX_NATIVE_DEPTH) return JitStatus::FRAME_CHANGED;
+		Frame *callee = &vm.frames.back();
+		native_depth++;
+		JitStatus status = callee->closure->function->aot->run(vm, callee, 0);
+		native_depth--;
+		if (status != JitStatus::FRAME_CHANGED || vm.frames.size() != frame_count) return status;
+	}
+	frame = &vm.frames.back();
+	return JitStatus::CONTINUE;
+}
+
+}
+
+JitStatus error(VM &vm, Frame *frame, u8 *next, const char *message) {
+	frame->ip = next;
+	vm.runtime_error("{}", message);
+	return JitStatus::RUNTIME_ERROR;
+}
+
+bool get_global(VM &vm, Frame *frame, u8 *next, ObjectString *name) {
+	LoxValue value;
+	if (!vm.globals.get(name, &value)) {
+		frame->ip = next;
+		vm.runtime_error("Undefined variable '{}'.", name->chars.get());
+		return false;
+	}
+	vm.stack.push_back(value);
+	return true;
+}
+
+bool set_global(VM &vm, Frame *frame, u8 *next, ObjectString *name) {
+	if (vm.globals.set(name, vm.stack.back())) {
+		vm.globals.del(name);
+		frame->ip = next;
+		vm.runtime_error("Undefined variable '{}'.", name->chars.get());
+		return false;
+	}
+	return true;
+}
+
+bool get_property(VM &vm, Frame *frame, u8 *next, ObjectString *name) {
+	frame->ip = next;
+	return vm.get_property(name);
+}
+
+bool set_property(VM &vm, Frame *frame, u8 *next, ObjectString *name) {
+	LoxValue instance = vm.stack.top[-2];
+	if (!instance.is_object() || !instance.is_instance()) {
+		frame->ip = next;
+		vm.runtime_error("Only instances have fields.");
+		return false;
+	}
+	instance.as_instance().fields.set(name, vm.stack.back());
+	vm.stack.top[-2] = vm.stack.back();
+	vm.stack.pop_back();
+	return true;
+}
+
+bool get_super(VM &vm, Frame *frame, u8 *next, ObjectString *name) {
+	ObjectClass *superclass = &vm.stack.back().as_class();
+	vm.stack.pop_back();
+	frame->ip = next;
+	return vm.bind_method(superclass, name);
+}
+
+bool add(VM &vm, Frame *frame, u8 *next) {
+	if (!vm.stack.top[-1].is_string() || !vm.stack.top[-2].is_string()) {
+		error(vm, frame, next, "Operands must be two numbers or two strings.");
+		return false;
+	}
+	vm.concatenate();
+	return true;
+}
+
+bool add_values(VM &vm, Frame *frame, u8 *next, LoxValue a, LoxValue b) {
+	vm.stack.push_back(a);
+	vm.stack.push_back(b);
+	return add(vm, frame, next);
+}
+
+bool inherit(VM &vm, Frame *frame, u8 *next) {
+	LoxValue superclass = vm.stack.top[-2];
+	if (!superclass.is_class()) {
+		error(vm, frame, next, "Superclass must be a class.");
+		return false;
+	}
+	vm.stack.back().as_class().methods.add_all(superclass.as_class().methods);
+	vm.stack.pop_back();
+	return true;
+}
+
+JitStatus call(VM &vm, Frame *&frame, u8 *next, int arg_count) {
+	frame->ip = next;
+	size_t frame_count = vm.frames.size();
+	return finish_call(vm, frame, frame_count, vm.call_value(vm.stack.top[-1 - arg_count], arg_count));
+}
+
+JitStatus tail_call(VM &vm, Frame *&frame, u8 *next, int arg_count) {
+	frame->ip = next;
+	size_t frame_count = vm.frames.size();
+	if (!vm.call_value(vm.stack.top[-1 - arg_count], arg_count)) return JitStatus::RUNTIME_ERROR;
+	if (vm.frames.size() == frame_count) return JitStatus::CONTINUE;
+	vm.replace_caller_frame();
+	return JitStatus::FRAME_CHANGED;
+}
+
+JitStatus invoke(VM &vm, Frame *&frame, u8 *next, ObjectString *name, int arg_count) {
+	frame->ip = next;
+	size_t frame_count = vm.frames.size();
+	return finish_call(vm, frame, frame_count, vm.invoke(name, arg_count));
+}
+
+JitStatus super_invoke(VM &vm, Frame *&frame, u8 *next, ObjectString *name, int arg_count) {
+	frame->ip = next;
+	ObjectClass *superclass = &vm.stack.back().as_class();
+	vm.stack.pop_back();
+	size_t frame_count = vm.frames.size();
+	return finish_call(vm, frame, frame_count, vm.invoke_from_class(superclass, name, arg_count));
+}
+
+JitStatus return_from(VM &vm, Frame *frame) {
+	LoxValue result = vm.stack.back();
+	vm.stack.pop_back();
+	vm.close_upvalues(frame->slots);
+	if (vm.frames.size() == 1) {
+		vm.frames.pop_back();
+		vm.stack.pop_back();
+		return JitStatus::DONE;
+	}
+	vm.stack.resize(frame->slots);
+	vm.stack.push_back(result);
+	vm.frames.pop_back();
+	return JitStatus::FRAME_CHANGED;
+}
+
+}
+
+}
@@ -0,0 +1,250 @@
+#include "bytecode_cache.hpp"
+#include "serialize.hpp"
+#include "verifier.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace bytelox {
+
+namespace {
+
+// bump whenever the layout below or what any op does changes
+constexpr u32 FORMAT_VERSION = 1;
+constexpr char MAGIC[4] = {'L', 'O', 'X', 'C'};
+
+// Followed by the strings, each a u32 length and its chars, then the
+// functions in the order their code was laid out, each
+//   u32 name (index of its string + 1, 0 for the script), i32 arity,
+//   i32 upvalue_count, u32 code size, u32 line count, u32 constant count,
+//   the code, the lines, then each constant as a ConstantKind and its value.
+// Everything is in the byte order of the machine that wrote it.
+struct Header {
+	char magic[4];
+	u32 version;
+	u32 op_count; // catches a cache from a build with other ops
+	u32 options;
+	u64 source_hash;
+	u64 body_hash; // of everything after the header, catches a damaged file
+	u32 string_count;
+	u32 function_count;
+	u32 script; // index of the script among the functions
+};
+
+enum class ConstantKind: u8 {
+	NIL,
+	BOOL,    // u8
+	NUMBER,  // f64
+	STRING,  // u32 index
+	FUNCTION // u32 index
+};
+
+// the options that change what the compiler emits
+u32 options_bits(const CompilerOptions &options) {
+	return options.peephole | options.ssa << 1 | options.inline_calls << 2 |
+			options.register_ops << 3 | options.tail_calls << 4;
+}
+
+Header make_header(VM &vm, std::string_view source) {
+	Header header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = FORMAT_VERSION;
+	header.op_count = +OP::WIDE + 1;
+	header.options = options_bits(vm.compiler_options);
+	header.source_hash = hash_bytes(source);
+	return header;
+}
+
+struct Writer: ByteWriter {
+	std::vector<ObjectFunction *> functions;
+	std::unordered_map<ObjectFunction *, u32> function_index;
+	std::vector<ObjectString *> strings;
+	std::unordered_map<ObjectString *, u32> string_index;
+	bool lazy = false;
+
+	// every function fn contains or refers to, like the callee of an inlined call
+	void collect(ObjectFunction *fn) {
+		if (!function_index.try_emplace(fn, 0).second) return;
+		functions.push_back(fn);
+		lazy = lazy || fn->lazy != nullptr;
+		for (LoxValue &constant : fn->chunk.constants) {
+			if (constant.is_function()) collect(&constant.as_function());
+		}
+	}
+
+	u32 string(ObjectString *string) {
+		auto [it, inserted] = string_index.try_emplace(string, strings.size());
+		if (inserted) strings.push_back(string);
+		return it->second;
+	}
+
+	void write(ObjectFunction &script) {
+		collect(&script);
+		// in the order compile packed them, for loading to pack them the same way
+		std::sort(functions.begin(), functions.end(), [](ObjectFunction *a, ObjectFunction *b) {
+			return std::less<const u8 *>()(a->chunk.code.data(), b->chunk.code.data());
+		});
+		for (u32 i=0; i<functions.size(); i++) {
+			function_index[functions[i]] = i;
+			if (functions[i]->name != nullptr) string(functions[i]->name);
+			for (LoxValue &constant : functions[i]->chunk.constants) {
+				if (constant.is_string()) string(&constant.as_string());
+			}
+		}
+
+		for (ObjectString *string : strings) {
+			put<u32>(string->length);
+			put_bytes(string->chars.get(), string->length);
+		}
+		for (ObjectFunction *fn : functions) {
+			Chunk &chunk = fn->chunk;
+			put<u32>(fn->name == nullptr ? 0 : string_index[fn->name] + 1);
+			put<i32>(fn->arity);
+			put<i32>(fn->upvalue_count);
+			put<u32>(chunk.code.size());
+			put<u32>(chunk.lines.size());
+			put<u32>(chunk.constants.size());
+			put_bytes(chunk.code.data(), chunk.code.size());
+			put_bytes(chunk.lines.data(), chunk.lines.size() * sizeof(LineStart));
+			for (LoxValue constant : chunk.constants) {
+				switch (constant.type) {
+					case ValueType::NIL: put(ConstantKind::NIL); break;
+					case ValueType::BOOL: put(ConstantKind::BOOL); put<u8>(constant.as.boolean); break;
+					case ValueType::NUMBER: put(ConstantKind::NUMBER); put<f64>(constant.as.number); break;
+					case ValueType::OBJECT:
+						if (constant.is_function()) {
+							put(ConstantKind::FUNCTION);
+							put<u32>(function_index[&constant.as_function()]);
+						}
+						else {
+							put(ConstantKind::STRING);
+							put<u32>(string_index[&constant.as_string()]);
+						}
+						break;
+				}
+			}
+		}
+	}
+};
+
+// Reads the strings and functions of the body into objects kept on the
+// stack, from base up, so a collection can't free them before the script
+// is reachable. false if the body doesn't hold what the header says.
+bool read_body(VM &vm, ByteReader &reader, const Header &header, size_t base) {
+	for (u32 i=0; i<header.string_count; i++) {
+		u32 length;
+		if (!reader.get(length)) return false;
+		const char *chars = reader.bytes(length);
+		if (chars == nullptr) return false;
+		vm.stack.push_back(vm.get_ObjectString({chars, length}));
+	}
+	size_t functions = vm.stack.size();
+	for (u32 i=0; i<header.function_count; i++) {
+		vm.stack.push_back(vm.GC<ObjectFunction>());
+	}
+	auto string = [&](u32 index) { return &vm.stack[base + index].as_string(); };
+
+	std::vector<Chunk *> chunks;
+	for (u32 i=0; i<header.function_count; i++) {
+		ObjectFunction &fn = vm.stack[functions + i].as_function();
+		u32 name, code_size, line_count, constant_count;
+		if (!reader.get(name) || !reader.get(fn.arity) || !reader.get(fn.upvalue_count) ||
+				!reader.get(code_size) || !reader.get(line_count) || !reader.get(constant_count)) {
+			return false;
+		}
+		if (name > header.string_count) return false;
+		if (name != 0) fn.name = string(name - 1);
+		const char *code = reader.bytes(code_size);
+		const char *lines = reader.bytes(static_cast<size_t>(line_count) * sizeof(LineStart));
+		if (code == nullptr || lines == nullptr) return false;
+		fn.chunk.code.assign(reinterpret_cast<const u8 *>(code), reinterpret_cast<const u8 *>(code) + code_size);
+		fn.chunk.lines.resize(line_count);
+		std::memcpy(fn.chunk.lines.data(), lines, line_count * sizeof(LineStart));
+		for (u32 j=0; j<constant_count; j++) {
+			ConstantKind kind;
+			if (!reader.get(kind)) return false;
+			LoxValue value;
+			switch (kind) {
+				case ConstantKind::NIL: break;
+				case ConstantKind::BOOL: {
+					u8 boolean;
+					if (!reader.get(boolean)) return false;
+					value = LoxValue(boolean != 0);
+					break;
+				}
+				case ConstantKind::NUMBER: {
+					f64 number;
+					if (!reader.get(number)) return false;
+					value = LoxValue(number);
+					break;
+				}
+				case ConstantKind::STRING:
+				case ConstantKind::FUNCTION: {
+					u32 index;
+					if (!reader.get(index)) return false;
+					if (index >= (kind == ConstantKind::STRING ? header.string_count : header.function_count)) return false;
+					value = kind == ConstantKind::STRING ? vm.stack[base + index] : vm.stack[functions + index];
+					break;
+				}
+				default:
+					return false;
+			}
+			fn.chunk.constants.push_back(value);
+		}
+		chunks.push_back(&fn.chunk);
+	}
+	if (reader.at != reader.end) return false;
+	for (u32 i=0; i<header.function_count; i++) {
+		if (!verify_function(vm.stack[functions + i].as_function())) return false;
+	}
+	vm.code_arenas.push_back(pack_chunks(chunks));
+	return true;
+}
+
+}
+
+std::string bytecode_cache_path(std::string_view path) {
+	if (path.ends_with(".lox")) return std::string(path) + 'c';
+	return std::string(path) + ".loxc";
+}
+
+ObjectFunction *load_bytecode_cache(VM &vm, const std::string &cache_path, std::string_view source) {
+	MappedFile file(cache_path);
+	ByteReader reader{file.data, file.data + file.size};
+	Header header;
+	if (file.data == nullptr || !reader.get(header)) return nullptr;
+	Header expected = make_header(vm, source);
+	if (std::memcmp(header.magic, expected.magic, sizeof(MAGIC)) != 0 || header.version != expected.version ||
+			header.op_count != expected.op_count || header.options != expected.options ||
+			header.source_hash != expected.source_hash ||
+			header.body_hash != hash_bytes({reader.at, static_cast<size_t>(reader.end - reader.at)}) ||
+			header.script >= header.function_count) {
+		return nullptr;
+	}
+
+	size_t base = vm.stack.size();
+	bool read = read_body(vm, reader, header, base);
+	ObjectFunction *script = read ? &vm.stack[base + header.string_count + header.script].as_function() : nullptr;
+	vm.stack.resize(base);
+	return script;
+}
+
+bool write_bytecode_cache(VM &vm, ObjectFunction &script, const std::string &cache_path, std::string_view source) {
+	Writer writer;
+	writer.write(script);
+	if (writer.lazy) return false;
+	Header header = make_header(vm, source);
+	header.body_hash = hash_bytes(writer.out);
+	header.string_count = writer.strings.size();
+	header.function_count = writer.functions.size();
+	header.script = writer.function_index[&script];
+
+	std::string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+	return replace_file(cache_path, contents + writer.out);
+}
+
+}
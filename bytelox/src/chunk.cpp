@@ -1,29 +1,122 @@
 #include "chunk.hpp"
+#include "lox_object.hpp"
+
+#include <algorithm>
 
 namespace bytelox {
 
-void Chunk::write(u8 byte, u16 line) {
-	code.push_back(byte);
+void Chunk::write(u8 byte, u32 line) {
 	if (lines.empty() || lines.back().line != line) {
-		lines.emplace_back(line, 1);
-	}
-	else {
-		lines.back().count++;
+		lines.push_back({static_cast<u32>(code.size()), line});
 	}
+	code.push_back(byte);
 }
 
 size_t Chunk::count() {
 	return code.size();
 }
 
-u16 Chunk::get_line(int index) {
-	for (RLE rle : lines) {
-		index -= rle.count;
-		if (index < 0) {
-			return rle.line;
+size_t Chunk::instruction_size(size_t offset) {
+	switch (code[offset]) {
+		case +OP::WIDE: {
+			if (code[offset + 1] == +OP::CLOSURE) {
+				ObjectFunction &fn = constants[code[offset + 2] | (code[offset + 3] << 8)].as_function();
+				return 4 + 4 * fn.upvalue_count;
+			}
+			// the op, and twice the bytes of its operands
+			return 2 * instruction_size(offset + 1);
+		}
+		case +OP::NIL:
+		case +OP::TRUE:
+		case +OP::FALSE:
+		case +OP::POP:
+		case +OP::EQUAL:
+		case +OP::NOT_EQUAL:
+		case +OP::GREATER:
+		case +OP::GREATER_EQUAL:
+		case +OP::LESS:
+		case +OP::LESS_EQUAL:
+		case +OP::ADD:
+		case +OP::SUB:
+		case +OP::MUL:
+		case +OP::DIV:
+		case +OP::NOT:
+		case +OP::NEGATE:
+		case +OP::PRINT:
+		case +OP::CLOSE_UPVALUE:
+		case +OP::RETURN:
+		case +OP::INHERIT:
+		case +OP::ADD_NUM:
+		case +OP::ADD_STR:
+		case +OP::ADD_UNCHECKED:
+		case +OP::SUB_UNCHECKED:
+		case +OP::MUL_UNCHECKED:
+		case +OP::DIV_UNCHECKED:
+		case +OP::GREATER_UNCHECKED:
+		case +OP::GREATER_EQUAL_UNCHECKED:
+		case +OP::LESS_UNCHECKED:
+		case +OP::LESS_EQUAL_UNCHECKED:
+			return 1;
+		case +OP::CONSTANT:
+		case +OP::GET_LOCAL:
+		case +OP::SET_LOCAL:
+		case +OP::GET_GLOBAL:
+		case +OP::DEFINE_GLOBAL:
+		case +OP::SET_GLOBAL:
+		case +OP::GET_UPVALUE:
+		case +OP::SET_UPVALUE:
+		case +OP::GET_PROPERTY:
+		case +OP::SET_PROPERTY:
+		case +OP::GET_SUPER:
+		case +OP::CALL:
+		case +OP::TAIL_CALL:
+		case +OP::CLASS:
+		case +OP::METHOD:
+		case +OP::SET_LOCAL_POP:
+			return 2;
+		case +OP::JUMP:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::LOOP:
+		case +OP::LOOP_TRACE:
+		case +OP::INVOKE:
+		case +OP::SUPER_INVOKE:
+		case +OP::ADD_LOCALS:
+		case +OP::ADD_LOCAL_CONSTANT:
+		case +OP::SUB_LOCAL_CONSTANT:
+		case +OP::GET_LOCAL_PROPERTY:
+		case +OP::ADD_LOCALS_NUM:
+		case +OP::ADD_LOCAL_CONSTANT_NUM:
+			return 3;
+		case +OP::CONSTANT_LONG:
+			return 4;
+		case +OP::MOVE:
+		case +OP::RETURN_INLINED:
+			return 4;
+		case +OP::LESS_LOCALS_JUMP:
+		case +OP::LESS_LOCAL_CONSTANT_JUMP:
+		case +OP::ADD_R:
+		case +OP::SUB_R:
+		case +OP::MUL_R:
+		case +OP::DIV_R:
+		case +OP::GUARD_CALL:
+			return 5;
+		case +OP::GUARD_INVOKE:
+			return 6;
+		case +OP::FOR_LOOP:
+		case +OP::FOR_LOOP_TRACE:
+			return 7;
+		case +OP::CLOSURE: {
+			ObjectFunction &fn = constants[code[offset + 1]].as_function();
+			return 2 + 2 * fn.upvalue_count;
 		}
 	}
-	return lines.size();
+	return 1; // unreachable
+}
+
+u32 Chunk::get_line(size_t index) {
+	auto next = std::upper_bound(lines.begin(), lines.end(), index,
+			[](size_t index, const LineStart &run) { return index < run.start; });
+	return next == lines.begin() ? 0 : std::prev(next)->line;
 }
 
 size_t Chunk::add_constant(LoxValue value) {
@@ -31,15 +124,15 @@ size_t Chunk::add_constant(LoxValue value) {
 	return constants.size() - 1;
 }
 
-void Chunk::write_constant(LoxValue value, u16 line) {
+void Chunk::write_constant(LoxValue value, u32 line) {
 	size_t index = constants.size();
 	constants.push_back(value);
 	if (index > UINT8_MAX) {
 		write(+OP::CONSTANT_LONG, line);
 		// little endian
-		write(index & 0x0000FF, line);
-		write(index & 0x00FF00, line);
-		write(index & 0xFF0000, line);
+		write(index & 0xFF, line);
+		write((index >> 8) & 0xFF, line);
+		write((index >> 16) & 0xFF, line);
 	}
 	else {
 		write(+OP::CONSTANT, line);
@@ -47,4 +140,25 @@ void Chunk::write_constant(LoxValue value, u16 line) {
 	}
 }
 
+std::unique_ptr<std::byte[]> pack_chunks(const std::vector<Chunk *> &chunks) {
+	size_t constants_size = 0, code_size = 0, lines_size = 0;
+	for (Chunk *chunk : chunks) {
+		constants_size += chunk->constants.size() * sizeof(LoxValue);
+		code_size += chunk->code.size();
+		lines_size += chunk->lines.size() * sizeof(LineStart);
+	}
+	// lines come after the code, aligned
+	code_size = (code_size + alignof(LineStart) - 1) / alignof(LineStart) * alignof(LineStart);
+	std::unique_ptr<std::byte[]> arena = std::make_unique_for_overwrite<std::byte[]>(constants_size + code_size + lines_size);
+	std::byte *constants = arena.get();
+	std::byte *code = constants + constants_size;
+	std::byte *lines = code + code_size;
+	for (Chunk *chunk : chunks) {
+		constants = chunk->constants.pack_into(constants);
+		code = chunk->code.pack_into(code);
+		lines = chunk->lines.pack_into(lines);
+	}
+	return arena;
+}
+
 }
@@ -1,7 +1,16 @@
 #include "compiler.hpp"
+#include "optimizer.hpp"
 #include "scanner.hpp"
+#include "ssa.hpp"
+#include "verifier.hpp"
 #include "vm.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <unordered_map>
+#include <unordered_set>
+
 #ifdef DEBUG_PRINT_CODE
 #include "debug.hpp"
 #endif
@@ -11,109 +20,264 @@
 
 namespace bytelox {
 
-Compiler::FunctionScope::FunctionScope(Compiler &compiler, FunctionType type): enclosing(compiler.current_fn), type(type) {
-	compiler.current_fn = this;
-	function = &compiler.vm.GC<ObjectFunction>().as_function();
-#ifdef DEBUG_LOG_GC
-	fmt::print("{} allocate {} for {}\n", (void *) function, sizeof(ObjectFunction), "ObjectFunction");
-#endif
-	if (type != FunctionType::SCRIPT) {
-		function->name = &(compiler.vm.get_ObjectString(compiler.parser.previous.lexeme).as_string());
-	}
-	// scope starts with its function in first slot
-	local_count = 1;
-	locals[0].depth = 0;
-	locals[0].is_captured = false;
-	if (type != FunctionType::FUNCTION) {
-		locals[0].name.lexeme = "this";
-	}
-	else {
-		locals[0].name.lexeme = "";
-	}
+namespace {
+
+// what make_constant looks a constant up by. Numbers are their bits, so -0
+// and 0 stay apart, and strings are interned, so equal ones share a pointer.
+u64 constant_bits(LoxValue value) {
+	switch (value.type) {
+		case ValueType::BOOL: return value.as.boolean;
+		case ValueType::NIL: return 0;
+		case ValueType::NUMBER: return std::bit_cast<u64>(value.as.number);
+		case ValueType::OBJECT: return reinterpret_cast<uintptr_t>(value.as.obj);
+	}
+	return 0; // unreachable
+}
+
+// The chunks of functions in the order they go in their arena, each right
+// after the first function that mentions its name, so code calling down a
+// chain of functions runs through memory that's close together. Functions
+// nothing names go last, in the order they were compiled.
+std::vector<Chunk *> code_order(ObjectFunction &script, const std::vector<ObjectFunction *> &functions) {
+	std::unordered_map<ObjectString *, std::vector<ObjectFunction *>> named;
+	for (ObjectFunction *fn : functions) {
+		if (fn->name != nullptr) named[fn->name].push_back(fn);
+	}
+	std::vector<Chunk *> order;
+	std::unordered_set<ObjectFunction *> placed;
+	auto place = [&](ObjectFunction *root) {
+		std::vector<ObjectFunction *> next{root};
+		while (!next.empty()) {
+			ObjectFunction *fn = next.back();
+			next.pop_back();
+			if (!placed.insert(fn).second) continue;
+			order.push_back(&fn->chunk);
+			// reversed, so the first name it mentions comes out first
+			for (size_t i=fn->chunk.constants.size(); i-- > 0;) {
+				LoxValue constant = fn->chunk.constants[i];
+				if (!constant.is_string()) continue;
+				auto callees = named.find(&constant.as_string());
+				if (callees == named.end()) continue;
+				next.insert(next.end(), callees->second.rbegin(), callees->second.rend());
+			}
+		}
+	};
+	place(&script);
+	for (ObjectFunction *fn : functions) place(fn);
+	return order;
 }
 
-using ParseFn = void (*)();
-
-Compiler::Compiler(Scanner &scanner, VM &vm): scanner(scanner), vm(vm) {
-// everything needs to match signature with can_assign
-#define RULE(method) [&](bool can_assign) { method(can_assign); }
-	rules[+TokenType::LEFT_PAREN]    = {RULE(grouping), RULE(call), Precedence::CALL};
+// the parsers of each token as a prefix and an infix, and its precedence as
+// an infix
+constexpr std::array<ParseRule, num_parse> RULES = [] {
+	std::array<ParseRule, num_parse> rules{};
+	rules[+TokenType::LEFT_PAREN]    = {&Compiler::grouping, &Compiler::call, Precedence::CALL};
 	rules[+TokenType::RIGHT_PAREN]   = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::LEFT_BRACE]    = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::RIGHT_BRACE]   = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::COMMA]         = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::DOT]           = {nullptr, RULE(dot), Precedence::CALL};
-	rules[+TokenType::MINUS]         = {RULE(unary), RULE(binary), Precedence::TERM};
-	rules[+TokenType::PLUS]          = {nullptr, RULE(binary), Precedence::TERM};
+	rules[+TokenType::DOT]           = {nullptr, &Compiler::dot, Precedence::CALL};
+	rules[+TokenType::MINUS]         = {&Compiler::unary, &Compiler::binary, Precedence::TERM};
+	rules[+TokenType::PLUS]          = {nullptr, &Compiler::binary, Precedence::TERM};
 	rules[+TokenType::SEMICOLON]     = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::SLASH]         = {nullptr, RULE(binary), Precedence::FACTOR};
-	rules[+TokenType::STAR]          = {nullptr, RULE(binary), Precedence::FACTOR};
-	rules[+TokenType::BANG]          = {RULE(unary), nullptr, Precedence::NONE};
-	rules[+TokenType::BANG_EQUAL]    = {nullptr, RULE(binary), Precedence::EQUALITY};
+	rules[+TokenType::SLASH]         = {nullptr, &Compiler::binary, Precedence::FACTOR};
+	rules[+TokenType::STAR]          = {nullptr, &Compiler::binary, Precedence::FACTOR};
+	rules[+TokenType::BANG]          = {&Compiler::unary, nullptr, Precedence::NONE};
+	rules[+TokenType::BANG_EQUAL]    = {nullptr, &Compiler::binary, Precedence::EQUALITY};
 	rules[+TokenType::EQUAL]         = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::EQUAL_EQUAL]   = {nullptr, RULE(binary), Precedence::EQUALITY};
-	rules[+TokenType::GREATER]       = {nullptr, RULE(binary), Precedence::COMPARISON};
-	rules[+TokenType::GREATER_EQUAL] = {nullptr, RULE(binary), Precedence::COMPARISON};
-	rules[+TokenType::LESS]          = {nullptr, RULE(binary), Precedence::COMPARISON};
-	rules[+TokenType::LESS_EQUAL]    = {nullptr, RULE(binary), Precedence::COMPARISON};
-	rules[+TokenType::IDENTIFIER]    = {RULE(variable), nullptr, Precedence::NONE};
-	rules[+TokenType::STRING]        = {RULE(string), nullptr, Precedence::NONE};
-	rules[+TokenType::NUMBER]        = {RULE(number), nullptr, Precedence::NONE};
-	rules[+TokenType::AND]           = {nullptr, RULE(and_), Precedence::AND};
+	rules[+TokenType::EQUAL_EQUAL]   = {nullptr, &Compiler::binary, Precedence::EQUALITY};
+	rules[+TokenType::GREATER]       = {nullptr, &Compiler::binary, Precedence::COMPARISON};
+	rules[+TokenType::GREATER_EQUAL] = {nullptr, &Compiler::binary, Precedence::COMPARISON};
+	rules[+TokenType::LESS]          = {nullptr, &Compiler::binary, Precedence::COMPARISON};
+	rules[+TokenType::LESS_EQUAL]    = {nullptr, &Compiler::binary, Precedence::COMPARISON};
+	rules[+TokenType::IDENTIFIER]    = {&Compiler::variable, nullptr, Precedence::NONE};
+	rules[+TokenType::STRING]        = {&Compiler::string, nullptr, Precedence::NONE};
+	rules[+TokenType::NUMBER]        = {&Compiler::number, nullptr, Precedence::NONE};
+	rules[+TokenType::AND]           = {nullptr, &Compiler::and_, Precedence::AND};
 	rules[+TokenType::CLASS]         = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::ELSE]          = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::FALSE]         = {RULE(literal), nullptr, Precedence::NONE};
+	rules[+TokenType::FALSE]         = {&Compiler::literal, nullptr, Precedence::NONE};
 	rules[+TokenType::FOR]           = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::FUN]           = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::IF]            = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::NIL]           = {RULE(literal), nullptr, Precedence::NONE};
-	rules[+TokenType::OR]            = {nullptr, RULE(or_), Precedence::OR};
+	rules[+TokenType::NIL]           = {&Compiler::literal, nullptr, Precedence::NONE};
+	rules[+TokenType::OR]            = {nullptr, &Compiler::or_, Precedence::OR};
 	rules[+TokenType::PRINT]         = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::RETURN]        = {nullptr, nullptr, Precedence::NONE};
-	rules[+TokenType::SUPER]         = {RULE(super), nullptr, Precedence::NONE};
-	rules[+TokenType::THIS]          = {RULE(this_), nullptr, Precedence::NONE};
-	rules[+TokenType::TRUE]          = {RULE(literal), nullptr, Precedence::NONE};
+	rules[+TokenType::SUPER]         = {&Compiler::super, nullptr, Precedence::NONE};
+	rules[+TokenType::THIS]          = {&Compiler::this_, nullptr, Precedence::NONE};
+	rules[+TokenType::TRUE]          = {&Compiler::literal, nullptr, Precedence::NONE};
 	rules[+TokenType::VAR]           = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::WHILE]         = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::ERROR]         = {nullptr, nullptr, Precedence::NONE};
 	rules[+TokenType::END_OF_FILE]   = {nullptr, nullptr, Precedence::NONE};
-#undef RULE
-	current_fn = new FunctionScope(*this, FunctionType::SCRIPT);
+	return rules;
+}();
+
+}
+
+Compiler::Compiler(VM &vm): vm(vm) { }
+
+Compiler::FunctionScope &Compiler::begin_fn_scope(FunctionType type, ObjectFunction *function) {
+	if (fn_scope_count == static_cast<int>(fn_scopes.size())) {
+		fn_scopes.push_back(std::make_unique<FunctionScope>());
 #ifdef DEBUG_LOG_GC
-	fmt::print("{} allocate {} for {}\n", (void *) current_fn, sizeof(FunctionScope), "FunctionScope");
+		fmt::print("{} allocate {} for {}\n", (void *) fn_scopes.back().get(), sizeof(FunctionScope), "FunctionScope");
 #endif
-	
+	}
+	FunctionScope &fs = *fn_scopes[fn_scope_count++];
+	fs.enclosing = current_fn;
+	fs.function = function;
+	fs.type = type;
+	fs.scope_depth = 0;
+	fs.upvalues.clear();
+	fs.upvalues_captured = false;
+	fs.wide = false;
+	fs.far_jumps.clear();
+	fs.constant_indices.clear();
+	current_fn = &fs;
+	if (function != nullptr) {
+		// named by its declaration, and counted again
+		function->arity = 0;
+		function->upvalue_count = 0;
+	}
+	else {
+		fs.function = &vm.GC<ObjectFunction>().as_function();
+#ifdef DEBUG_LOG_GC
+		fmt::print("{} allocate {} for {}\n", (void *) fs.function, sizeof(ObjectFunction), "ObjectFunction");
+#endif
+		if (type != FunctionType::SCRIPT) {
+			fs.function->name = &(vm.get_ObjectString(parser.previous.lexeme).as_string());
+		}
+	}
+	// scope starts with its function in first slot
+	fs.local_count = 0;
+	add_local(synthetic_token(type != FunctionType::FUNCTION ? "this" : ""));
+	fs.locals[0].depth = 0;
+	return fs;
+}
+
+void Compiler::pop_fn_scope() {
+	current_fn = current_fn->enclosing;
+	fn_scope_count--;
 }
 
-Compiler::~Compiler() {
-	if (current_fn != nullptr) delete current_fn;
+void Compiler::reset() {
+	parser.had_error = false;
+	parser.panic_mode = false;
+	current_fn = nullptr;
+	current_class = nullptr;
+	fn_scope_count = 0;
+	// bodies of functions from another script, which could be freed by now
+	inliner = Inliner();
+	compiled.clear();
 }
 
 Chunk *Compiler::current_chunk() {
 	return &(current_fn->function->chunk);
 }
 
-ObjectFunction *Compiler::compile(std::string_view src) {
-	Scanner scanner(src);
-
+ObjectFunction *Compiler::compile(const Scanner &scanner) {
+	reset();
+	this->scanner = scanner;
+	begin_fn_scope(FunctionType::SCRIPT);
 	advance();
 	
 	while (!match(TokenType::END_OF_FILE)) {
 		declaration();
 	}
 	ObjectFunction *fn = end_fn_scope();
+	if (!parser.had_error) {
+		vm.code_arenas.push_back(pack_chunks(code_order(*fn, compiled)));
+	}
+	compiled.clear();
 	return parser.had_error ? nullptr : fn;
 }
 
+bool Compiler::compile_lazy(ObjectFunction &fn) {
+	reset();
+	LazyBody &body = *fn.lazy;
+	scanner = Scanner(body.source);
+	scanner.line = body.line;
+	int arity = fn.arity;
+	int upvalue_count = fn.upvalue_count;
+	// the script it was declared in, with the super of its class
+	begin_fn_scope(FunctionType::SCRIPT);
+	ClassScope class_scope(nullptr);
+	class_scope.has_superclass = body.has_superclass;
+	if (body.type != FunctionType::FUNCTION) {
+		current_class = &class_scope;
+	}
+	if (body.has_superclass) {
+		begin_scope();
+		add_local(synthetic_token("super"));
+		mark_initialized();
+	}
+
+	advance();
+	begin_fn_scope(body.type, &fn);
+	parameters();
+	block();
+	end_fn_scope();
+	pop_fn_scope();
+	current_class = nullptr;
+	// it can capture less than its declaration assumed, when every super in
+	// it belongs to a class declared inside it
+	bool ok = !parser.had_error && fn.upvalue_count <= upvalue_count;
+	fn.upvalue_count = upvalue_count;
+	if (!ok) {
+		fn.arity = arity;
+		fn.chunk.code.clear();
+		fn.chunk.constants.clear();
+		fn.chunk.lines.clear();
+	}
+	else {
+		delete fn.lazy;
+		fn.lazy = nullptr;
+		vm.code_arenas.push_back(pack_chunks(code_order(fn, compiled)));
+	}
+	compiled.clear();
+	return ok;
+}
+
 ObjectFunction *Compiler::end_fn_scope() {
 	emit_return();
 	ObjectFunction *fn = current_fn->function;
+	if (!parser.had_error && !current_fn->far_jumps.empty()) {
+		widen_far_jumps(*current_chunk(), current_fn->far_jumps);
+	}
+	if (!parser.had_error && !current_fn->wide) {
+		if (vm.compiler_options.inline_calls) {
+			inliner.inline_calls(*current_chunk(), fn->arity);
+		}
+		if (vm.compiler_options.peephole) {
+			optimize_chunk(*current_chunk());
+		}
+		if (vm.compiler_options.ssa) {
+			optimize_ssa(*current_chunk(), fn->arity, vm.compiler_options.peephole);
+		}
+		if (vm.compiler_options.inline_calls && current_fn->type != FunctionType::SCRIPT) {
+			inliner.consider(*fn);
+		}
+		if (vm.compiler_options.register_ops) {
+			lower_to_register_ops(*current_chunk(), fn->arity);
+		}
+		fuse_superinstructions(*current_chunk());
+	}
+	if (!parser.had_error && vm.compiler_options.tail_calls) {
+		mark_tail_calls(*current_chunk());
+	}
+	// only fails if a pass emitted broken code
+	if (!parser.had_error && !verify_function(*fn)) {
+		error("Could not verify the compiled code.");
+	}
 #ifdef DEBUG_PRINT_CODE
 	if (!parser.had_error) {
 		disassemble_chunk(*current_chunk(), fn->name != nullptr ? fn->name->chars.get() : "<script>");
 	}
 #endif
-	current_fn = current_fn->enclosing;
+	compiled.push_back(fn);
+	pop_fn_scope();
 
 	return fn;
 }
@@ -154,15 +318,35 @@ void Compiler::emit_bytes(u8 byte1, u8 byte2) {
 	current_chunk()->write(byte2, parser.previous.line);
 }
 
+void Compiler::emit_operands(u8 op, std::span<const u32> operands) {
+	if (std::all_of(operands.begin(), operands.end(), [](u32 operand) { return operand <= UINT8_MAX; })) {
+		emit_byte(op);
+		for (u32 operand : operands) emit_byte(operand);
+		return;
+	}
+	current_fn->wide = true;
+	emit_bytes(+OP::WIDE, op);
+	for (u32 operand : operands) {
+		if (operand > UINT16_MAX) {
+			error("Too many constants in one chunk.");
+		}
+		emit_bytes(operand & 0xFF, (operand >> 8) & 0xFF); // little endian
+	}
+}
+
 void Compiler::emit_loop(int loop_start) {
-	emit_byte(+OP::LOOP);
-	
-	int offset = current_chunk()->code.size() - loop_start;
-	if (offset > UINT16_MAX) {
-		error("Loop body is too large.");
+	// the offset is from the byte after the op
+	if (current_chunk()->code.size() + 1 - loop_start <= UINT16_MAX) {
+		emit_byte(+OP::LOOP);
+		int offset = current_chunk()->code.size() - loop_start;
+		emit_bytes(offset & 0xFF, (offset >> 8) & 0xFF); // little endian
+		return;
 	}
-	
-	emit_bytes(offset & 0xFF, (offset >> 8) & 0xFF); // little endian
+	current_fn->wide = true;
+	emit_bytes(+OP::WIDE, +OP::LOOP);
+	u32 offset = current_chunk()->code.size() - loop_start;
+	emit_bytes(offset & 0xFF, (offset >> 8) & 0xFF);
+	emit_bytes((offset >> 16) & 0xFF, (offset >> 24) & 0xFF);
 }
 
 int Compiler::emit_jump(u8 instruction) {
@@ -172,13 +356,24 @@ int Compiler::emit_jump(u8 instruction) {
 }
 
 void Compiler::emit_constant(LoxValue value) {
-	emit_bytes(+OP::CONSTANT, make_constant(value));
+	u32 constant = make_constant(value);
+	if (constant <= UINT8_MAX) {
+		emit_bytes(+OP::CONSTANT, constant);
+		return;
+	}
+	// JIT compiled code and traces take CONSTANT_LONG but not WIDE
+	emit_byte(+OP::CONSTANT_LONG);
+	emit_bytes(constant & 0xFF, (constant >> 8) & 0xFF);
+	emit_byte((constant >> 16) & 0xFF);
 }
 
 void Compiler::patch_jump(int offset) {
 	int jump = current_chunk()->code.size() - offset; // no bytecode jump offset, taken care of
 	if (jump > UINT16_MAX) {
-		error("Too much code to jump over.");
+		// widened when the function is done, when nothing moves anymore
+		current_fn->wide = true;
+		current_fn->far_jumps.push_back({offset - 1, current_chunk()->code.size()});
+		jump = 0;
 	}
 	
 	// little endian
@@ -196,14 +391,19 @@ void Compiler::emit_return() {
 	emit_byte(+OP::RETURN);
 }
 
-u8 Compiler::make_constant(LoxValue value) {
-	// replace with code for more than 255 constants
-	size_t constant = current_chunk()->add_constant(value);
-	if (constant > UINT8_MAX) {
+u32 Compiler::make_constant(LoxValue value) {
+	Chunk &chunk = *current_chunk();
+	auto [known, inserted] = current_fn->constant_indices.try_emplace(constant_bits(value), chunk.constants.size());
+	if (!inserted && chunk.constants[known->second].type == value.type) {
+		return known->second;
+	}
+	// CONSTANT_LONG has 3 bytes for the index
+	size_t constant = chunk.add_constant(value);
+	if (constant > 0xFFFFFF) {
 		error("Too many constants in one chunk.");
 		return 0;
 	}
-	return static_cast<u8>(constant);
+	return constant;
 }
 
 void Compiler::begin_scope() {
@@ -214,7 +414,15 @@ void Compiler::end_scope() {
 	current_fn->scope_depth--;
 	while (current_fn->local_count > 0 &&
 			current_fn->locals[current_fn->local_count-1].depth > current_fn->scope_depth) {
-		if (current_fn->locals[current_fn->local_count - 1].is_captured) {
+		Local &local = current_fn->locals[current_fn->local_count - 1];
+		if (local.escapes) {
+			for (u16 captured : local.captures) {
+				current_fn->locals[captured].needs_closing = true;
+			}
+		}
+		// a local only captured by closures gone by now is left open, for the
+		// VM to close with the frame or reuse for whatever takes its slot
+		if (local.is_captured && local.needs_closing) {
 			emit_byte(+OP::CLOSE_UPVALUE);
 		}
 		else {
@@ -273,7 +481,7 @@ void Compiler::statement() {
 }
 
 void Compiler::var_declaration() {
-	u8 global = parse_variable("Expect variable name.");
+	u32 global = parse_variable("Expect variable name.");
 	if (match(TokenType::EQUAL)) {
 		expression();
 	}
@@ -285,19 +493,22 @@ void Compiler::var_declaration() {
 }
 
 void Compiler::fun_declaration() {
-	u8 global = parse_variable("Expect function name.");
+	u32 global = parse_variable("Expect function name.");
 	mark_initialized();
-	function(FunctionType::FUNCTION);
+	ObjectFunction *fn = function(FunctionType::FUNCTION);
+	if (current_fn->enclosing == nullptr && current_fn->scope_depth == 0) {
+		inliner.add_function(*fn);
+	}
 	define_variable(global);
 }
 
 void Compiler::class_declaration() {
 	consume(TokenType::IDENTIFIER, "Expect class name.");
 	Token class_name = parser.previous;
-	u8 name_constant = identifier_constant(parser.previous);
+	u32 name_constant = identifier_constant(parser.previous);
 	declare_variable();
 
-	emit_bytes(+OP::CLASS, name_constant);
+	emit_operands(+OP::CLASS, {name_constant});
 	define_variable(name_constant);
 	
 	ClassScope class_scope(current_class);
@@ -429,8 +640,51 @@ void Compiler::for_statement() {
 	end_scope();
 }
 
-void Compiler::function(FunctionType type) {
-	FunctionScope fs(*this, type);
+ObjectFunction *Compiler::function(FunctionType type) {
+	bool lazy = vm.compiler_options.lazy && can_compile_lazily(type);
+	const char *start = parser.current.lexeme.data();
+	int line = parser.current.line;
+	// read until the next begin_fn_scope
+	FunctionScope &fs = begin_fn_scope(type);
+	parameters();
+	ObjectFunction *fn = fs.function;
+	if (lazy) {
+		skip_body(start, line);
+		pop_fn_scope();
+	}
+	else {
+		block();
+		end_fn_scope();
+	}
+	closure_operands.assign({make_constant(LoxValue(fn))});
+	for (int i=0; i<fn->upvalue_count; i++) {
+		closure_operands.push_back(fs.upvalues[i].is_local ? 1 : 0);
+		closure_operands.push_back(fs.upvalues[i].index);
+	}
+	emit_operands(+OP::CLOSURE, closure_operands);
+	//emit_bytes(+OP::CONSTANT, make_constant(vm->make_ObjectFunction(fn)));
+	// A local function declaration that's only ever called can't outlive the
+	// locals it captures, unless a closure nested in it takes its upvalues.
+	// Anything else might.
+	Local *declared = nullptr;
+	if (type == FunctionType::FUNCTION && current_fn->scope_depth > 0 && !fs.upvalues_captured) {
+		declared = &current_fn->locals[current_fn->local_count - 1];
+	}
+	for (int i=0; i<fn->upvalue_count; i++) {
+		if (!fs.upvalues[i].is_local) {
+			current_fn->upvalues_captured = true;
+		}
+		else if (declared != nullptr) {
+			declared->captures.push_back(fs.upvalues[i].index);
+		}
+		else {
+			current_fn->locals[fs.upvalues[i].index].needs_closing = true;
+		}
+	}
+	return fn;
+}
+
+void Compiler::parameters() {
 	begin_scope();
 	consume(TokenType::LEFT_PAREN, "Expect '(' after function name.");
 	if (!check(TokenType::RIGHT_PAREN)) {
@@ -439,31 +693,56 @@ void Compiler::function(FunctionType type) {
 			if (current_fn->function->arity > 255) {
 				error_at_current("Can't have more than 255 parameters.");
 			}
-			u8 constant = parse_variable("Expect parameter name.");
+			u32 constant = parse_variable("Expect parameter name.");
 			define_variable(constant);
 		} while (match(TokenType::COMMA));
 	}
 	consume(TokenType::RIGHT_PAREN, "Expect ')' after parameters.");
 	consume(TokenType::LEFT_BRACE, "Expect '{' before function body.");
-	block();
-	
-	ObjectFunction *fn = end_fn_scope();
-	emit_bytes(+OP::CLOSURE, make_constant(LoxValue(fn)));
-	//emit_bytes(+OP::CONSTANT, make_constant(vm->make_ObjectFunction(fn)));
-	for (int i=0; i<fn->upvalue_count; i++) {
-		emit_bytes(fs.upvalues[i].is_local ? 1 : 0, fs.upvalues[i].index);
+}
+
+bool Compiler::can_compile_lazily(FunctionType type) {
+	// declared in the script outside of any block, where there are no locals
+	// to capture but the super of a class
+	if (current_fn->type != FunctionType::SCRIPT) return false;
+	if (type == FunctionType::FUNCTION) return current_fn->scope_depth == 0;
+	return current_class->enclosing == nullptr && current_fn->scope_depth == (current_class->has_superclass ? 1 : 0);
+}
+
+void Compiler::skip_body(const char *start, int line) {
+	bool uses_super = false;
+	int depth = 1;
+	while (!check(TokenType::END_OF_FILE)) {
+		if (check(TokenType::LEFT_BRACE)) depth++;
+		else if (check(TokenType::RIGHT_BRACE) && --depth == 0) break;
+		else if (check(TokenType::SUPER)) uses_super = true;
+		advance();
+	}
+	consume(TokenType::RIGHT_BRACE, "Expect '}' after block.");
+	if (parser.had_error) return;
+
+	FunctionType type = current_fn->type;
+	bool has_superclass = type != FunctionType::FUNCTION && current_class->has_superclass;
+	if (uses_super && has_superclass) {
+		Token super = synthetic_token("super");
+		resolve_upvalue(*current_fn, super);
 	}
+	std::string_view end = parser.previous.lexeme;
+	current_fn->function->lazy = new LazyBody{{start, end.data() + end.size()}, line, type, has_superclass};
 }
 
 void Compiler::method() {
 	consume(TokenType::IDENTIFIER, "Expect method name.");
-	u8 constant = identifier_constant(parser.previous);
+	u32 constant = identifier_constant(parser.previous);
 	auto type = FunctionType::METHOD;
 	if (parser.previous.lexeme == "init") {
 		type = FunctionType::INITIALIZER;
 	}
-	function(type);
-	emit_bytes(+OP::METHOD, constant);
+	ObjectFunction *fn = function(type);
+	if (type == FunctionType::METHOD) {
+		inliner.add_method(*fn);
+	}
+	emit_operands(+OP::METHOD, {constant});
 }
 
 void Compiler::return_statement() {
@@ -502,7 +781,7 @@ void Compiler::unary(bool) {
 }
 void Compiler::binary(bool) {
 	TokenType operator_type = parser.previous.type;
-	ParseRule *rule = get_rule(operator_type);
+	const ParseRule *rule = get_rule(operator_type);
 	parse_precedence(static_cast<Precedence>(+rule->precedence + 1));
 	switch (operator_type) {
 		case TokenType::BANG_EQUAL: emit_byte(+OP::NOT_EQUAL); break;
@@ -542,6 +821,10 @@ void Compiler::named_variable(Token name, bool can_assign) {
 	if (arg != -1) {
 		get_op = +OP::GET_LOCAL;
 		set_op = +OP::SET_LOCAL;
+		// calls are the only reads that don't let the value escape
+		if (!(check(TokenType::LEFT_PAREN) || (can_assign && check(TokenType::EQUAL)))) {
+			current_fn->locals[arg].escapes = true;
+		}
 	}
 	else if ((arg = resolve_upvalue(*current_fn, name)) != -1) {
 		get_op = +OP::GET_UPVALUE;
@@ -554,10 +837,10 @@ void Compiler::named_variable(Token name, bool can_assign) {
 	}
 	if (can_assign && match(TokenType::EQUAL)) {
 		expression();
-		emit_bytes(set_op, static_cast<u8>(arg));
+		emit_operands(set_op, {static_cast<u32>(arg)});
 	}
 	else {
-		emit_bytes(get_op, static_cast<u8>(arg));
+		emit_operands(get_op, {static_cast<u32>(arg)});
 	}
 }
 
@@ -600,19 +883,18 @@ u8 Compiler::argument_list() {
 }
 void Compiler::dot(bool can_assign) {
 	consume(TokenType::IDENTIFIER, "Expect property name after '.'.");
-	u8 name = identifier_constant(parser.previous);
+	u32 name = identifier_constant(parser.previous);
 	
 	if (can_assign && match(TokenType::EQUAL)) {
 		expression();
-		emit_bytes(+OP::SET_PROPERTY, name);
+		emit_operands(+OP::SET_PROPERTY, {name});
 	}
 	else if (match(TokenType::LEFT_PAREN)) {
 		u8 arg_count = argument_list();
-		emit_bytes(+OP::INVOKE, name);
-		emit_byte(arg_count);
+		emit_operands(+OP::INVOKE, {name, arg_count});
 	}
 	else {
-		emit_bytes(+OP::GET_PROPERTY, name);
+		emit_operands(+OP::GET_PROPERTY, {name});
 	}
 }
 
@@ -640,43 +922,42 @@ void Compiler::super(bool) {
 
 	consume(TokenType::DOT, "Expect '.' after 'super'.");
 	consume(TokenType::IDENTIFIER, "Expect superclass method name.");
-	u8 name = identifier_constant(parser.previous);
+	u32 name = identifier_constant(parser.previous);
 	
 	named_variable(synthetic_token("this"), false);
 	if (match(TokenType::LEFT_PAREN)) {
 		u8 arg_count = argument_list();
 		named_variable(synthetic_token("super"), false);
-		emit_bytes(+OP::SUPER_INVOKE, name);
-		emit_byte(arg_count);
+		emit_operands(+OP::SUPER_INVOKE, {name, arg_count});
 	}
 	else {
 		named_variable(synthetic_token("super"), false);
-		emit_bytes(+OP::GET_SUPER, name);
+		emit_operands(+OP::GET_SUPER, {name});
 	}
 }
 
 void Compiler::parse_precedence(Precedence precedence) {
 	advance();
-	auto prefix_rule = get_rule(parser.previous.type)->prefix;
+	ParseFn prefix_rule = get_rule(parser.previous.type)->prefix;
 	if (prefix_rule == nullptr) {
 		error("Expect expression.");
 		return;
 	}
 	
 	bool can_assign = precedence <= Precedence::ASSIGNMENT;
-	prefix_rule(can_assign);
+	(this->*prefix_rule)(can_assign);
 
 	while (precedence <= get_rule(parser.current.type)->precedence) {
 		advance();
-		auto infix_rule = get_rule(parser.previous.type)->infix;
-		infix_rule(can_assign);
+		ParseFn infix_rule = get_rule(parser.previous.type)->infix;
+		(this->*infix_rule)(can_assign);
 	}
 	if (can_assign && match(TokenType::EQUAL)) {
 		error("Invalid assignment target.");
 	}
 }
 
-u8 Compiler::identifier_constant(const Token &name) {
+u32 Compiler::identifier_constant(const Token &name) {
 	return make_constant(vm.get_ObjectString(name.lexeme));
 }
 
@@ -696,18 +977,17 @@ int Compiler::resolve_local(FunctionScope &fs, Token &name) {
 	return -1;
 }
 
-int Compiler::add_upvalue(FunctionScope &fs, u8 index, bool is_local) {
+int Compiler::add_upvalue(FunctionScope &fs, u16 index, bool is_local) {
 	int upvalue_count = fs.function->upvalue_count;
 	for (int i=0; i<upvalue_count; i++) {
 		Upvalue &upvalue = fs.upvalues[i];
 		if (upvalue.index == index && upvalue.is_local == is_local) return i;
 	}
-	if (upvalue_count == UINT8_MAX + 1) {
+	if (upvalue_count == UINT16_MAX + 1) {
 		error("Too many closure variables in function.");
 		return 0;
 	}
-	fs.upvalues[upvalue_count].is_local = is_local;
-	fs.upvalues[upvalue_count].index = index;
+	fs.upvalues.push_back({index, is_local});
 	return fs.function->upvalue_count++;
 }
 
@@ -716,16 +996,17 @@ int Compiler::resolve_upvalue(FunctionScope &fs, Token &name) {
 	int local = resolve_local(*fs.enclosing, name);
 	if (local != -1) {
 		fs.enclosing->locals[local].is_captured = true;
-		return add_upvalue(fs, static_cast<u8>(local), true);
+		fs.enclosing->locals[local].escapes = true;
+		return add_upvalue(fs, static_cast<u16>(local), true);
 	}
 
 	int upvalue = resolve_upvalue(*fs.enclosing, name);
-	if (upvalue != -1) return add_upvalue(fs, static_cast<u8>(upvalue), false);
+	if (upvalue != -1) return add_upvalue(fs, static_cast<u16>(upvalue), false);
 
 	return -1;
 }
 
-u8 Compiler::parse_variable(std::string_view msg) {
+u32 Compiler::parse_variable(std::string_view msg) {
 	consume(TokenType::IDENTIFIER, msg);
 	
 	declare_variable();
@@ -749,13 +1030,13 @@ void Compiler::declare_variable() {
 	add_local(parser.previous);
 }
 
-void Compiler::define_variable(u8 global) {
+void Compiler::define_variable(u32 global) {
 	if (current_fn->scope_depth > 0) {
 		mark_initialized();
 		// local variables are on top of the stack when allocated
 		return;
 	}
-	emit_bytes(+OP::DEFINE_GLOBAL, global);
+	emit_operands(+OP::DEFINE_GLOBAL, {global});
 }
 
 void Compiler::mark_initialized() {
@@ -764,14 +1045,24 @@ void Compiler::mark_initialized() {
 }
 
 void Compiler::add_local(Token name) {
+	if (current_fn->local_count == UINT16_MAX + 1) {
+		error("Too many local variables in function.");
+		return;
+	}
+	if (current_fn->local_count == static_cast<int>(current_fn->locals.size())) {
+		current_fn->locals.emplace_back();
+	}
 	Local *local = &current_fn->locals[current_fn->local_count++];
 	local->name = name;
 	local->depth = -1; // uninitialized
 	local->is_captured = false;
+	local->escapes = false;
+	local->needs_closing = false;
+	local->captures.clear();
 }
 
-ParseRule *Compiler::get_rule(TokenType type) {
-	return &rules[+type];
+const ParseRule *Compiler::get_rule(TokenType type) {
+	return &RULES[+type];
 }
 
 void Compiler::error_at(Token &token, std::string_view msg) {
@@ -44,12 +44,204 @@ int byte_instruction(std::string_view name, Chunk &chunk, int offset) {
 	return offset + 2;
 }
 
+int two_byte_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u8 a = chunk.code[offset + 1];
+	u8 b = chunk.code[offset + 2];
+	fmt::print("{:<16} {:4} {:4}\n", name, a, b);
+	return offset + 3;
+}
+
+int local_constant_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u8 slot = chunk.code[offset + 1];
+	u8 constant = chunk.code[offset + 2];
+	fmt::print("{:<16} {:4} {:4} '", name, slot, constant);
+	chunk.constants[constant].print_value();
+	fmt::print("'\n");
+	return offset + 3;
+}
+
+// fused compare and jump, jumps past the offset when the comparison is false
+int compare_jump_instruction(std::string_view name, Chunk &chunk, int offset, bool constant) {
+	u8 slot = chunk.code[offset + 1];
+	u8 operand = chunk.code[offset + 2];
+	u16 jump = *((u16 *) (&chunk.code[offset + 3]));
+	fmt::print("{:<16} {:4} {:4} -> {}", name, slot, operand, offset + 3 + jump);
+	if (constant) {
+		fmt::print(" '");
+		chunk.constants[operand].print_value();
+		fmt::print("'");
+	}
+	fmt::print("\n");
+	return offset + 5;
+}
+
+std::string type_names(u8 types) {
+	constexpr std::pair<u8, std::string_view> names[] = {
+		{FeedbackSlot::NIL, "nil"},
+		{FeedbackSlot::BOOL, "bool"},
+		{FeedbackSlot::NUMBER, "number"},
+		{FeedbackSlot::STRING, "string"},
+		{FeedbackSlot::OBJECT, "object"},
+	};
+	std::string res;
+	for (auto [bit, name] : names) {
+		if (types & bit) {
+			if (!res.empty()) res += "|";
+			res += name;
+		}
+	}
+	return res;
+}
+
+std::string register_operand(Chunk &chunk, int kind, u8 index) {
+	switch (static_cast<RegisterKind>(kind)) {
+		case RegisterKind::STACK: return "pop";
+		case RegisterKind::LOCAL: return fmt::format("r{}", index);
+		case RegisterKind::CONSTANT: {
+			LoxValue value = chunk.constants[index];
+			if (value.is_number()) return fmt::format("k{}({:g})", index, value.as.number);
+			return fmt::format("k{}", index);
+		}
+	}
+	return "?";
+}
+
+std::string register_dst(u8 mode, u8 dst) {
+	return static_cast<RegisterKind>((mode >> 4) & 3) == RegisterKind::LOCAL ? fmt::format("r{}", dst) : "push";
+}
+
+int move_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u8 mode = chunk.code[offset + 1];
+	fmt::print("{:<16} {} = {}\n", name, register_dst(mode, chunk.code[offset + 2]),
+			register_operand(chunk, mode & 3, chunk.code[offset + 3]));
+	return offset + 4;
+}
+
+int register_instruction(std::string_view name, char op, Chunk &chunk, int offset) {
+	u8 mode = chunk.code[offset + 1];
+	fmt::print("{:<16} {} = {} {} {}{}\n", name, register_dst(mode, chunk.code[offset + 2]),
+			register_operand(chunk, mode & 3, chunk.code[offset + 3]), op,
+			register_operand(chunk, (mode >> 2) & 3, chunk.code[offset + 4]),
+			mode & UNCHECKED_NUMBERS ? " unchecked" : "");
+	return offset + 5;
+}
+
 int jump_instruction(std::string_view name, int sign, Chunk &chunk, int offset) {
 	u16 jump = *((u16 *) (&chunk.code[offset + 1])); // stored in little endian
 	fmt::print("{:<16} {:4} -> {}\n", name, offset, offset + 1 + sign * jump);
 	return offset + 3;
 }
 
+// GUARD_CALL and GUARD_INVOKE, which jump to the call they guard
+int guard_instruction(std::string_view name, Chunk &chunk, int offset, bool method) {
+	u8 function = chunk.code[offset + 1];
+	int size = method ? 6 : 5;
+	u8 arg_count = chunk.code[offset + size - 3];
+	u16 jump = *((u16 *) (&chunk.code[offset + size - 2]));
+	fmt::print("{:<16} ({} args) {:4} ", name, arg_count, function);
+	chunk.constants[function].print_value();
+	if (method) {
+		fmt::print(" '");
+		chunk.constants[chunk.code[offset + 2]].print_value();
+		fmt::print("'");
+	}
+	fmt::print(" -> {}\n", offset + size - 2 + jump);
+	return offset + size;
+}
+
+// FOR_LOOP, which jumps back while the counter is below the bound
+int for_loop_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u8 mode = chunk.code[offset + 1];
+	u8 counter = chunk.code[offset + 2];
+	u16 jump = *((u16 *) (&chunk.code[offset + 5]));
+	fmt::print("{:<16} r{} += {}, r{} < {} -> {}\n", name, counter,
+			register_operand(chunk, +RegisterKind::CONSTANT, chunk.code[offset + 3]), counter,
+			register_operand(chunk, mode, chunk.code[offset + 4]), offset + 5 - jump);
+	return offset + 7;
+}
+
+// 2 byte operand of a WIDE instruction at offset at
+u16 wide_operand(Chunk &chunk, int at) {
+	return chunk.code[at] | (chunk.code[at + 1] << 8);
+}
+
+// instructions after a WIDE, with 2 byte operands and a 4 byte jump offset
+int wide_constant_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u16 index = wide_operand(chunk, offset + 2);
+	fmt::print("{:<16} {:4} '", name, index);
+	chunk.constants[index].print_value();
+	fmt::print("'\n");
+	return offset + 4;
+}
+
+int wide_slot_instruction(std::string_view name, Chunk &chunk, int offset) {
+	fmt::print("{:<16} {:4}\n", name, wide_operand(chunk, offset + 2));
+	return offset + 4;
+}
+
+int wide_invoke_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u16 constant = wide_operand(chunk, offset + 2);
+	fmt::print("{:<16} ({} args) {:4} '", name, wide_operand(chunk, offset + 4), constant);
+	chunk.constants[constant].print_value();
+	fmt::print("'\n");
+	return offset + 6;
+}
+
+int wide_jump_instruction(std::string_view name, int sign, Chunk &chunk, int offset) {
+	u32 jump = wide_operand(chunk, offset + 2) | (wide_operand(chunk, offset + 4) << 16);
+	fmt::print("{:<16} {:4} -> {}\n", name, offset, offset + 2 + sign * static_cast<i64>(jump));
+	return offset + 6;
+}
+
+int wide_closure_instruction(Chunk &chunk, int offset) {
+	u16 constant = wide_operand(chunk, offset + 2);
+	fmt::print("{:<16} {:4} ", "OP_WIDE_CLOSURE", constant);
+	chunk.constants[constant].print_value();
+	fmt::print("\n");
+	ObjectFunction &fn = chunk.constants[constant].as_function();
+	offset += 4;
+	for (int j=0; j<fn.upvalue_count; j++) {
+		fmt::print("{:0>4}      |                     {} {}\n",
+				offset, wide_operand(chunk, offset) ? "local" : "upvalue", wide_operand(chunk, offset + 2));
+		offset += 4;
+	}
+	return offset;
+}
+
+int wide_instruction(Chunk &chunk, int offset) {
+	switch (chunk.code[offset + 1]) {
+		case +OP::CONSTANT: return wide_constant_instruction("OP_WIDE_CONSTANT", chunk, offset);
+		case +OP::GET_LOCAL: return wide_slot_instruction("OP_WIDE_GET_LOCAL", chunk, offset);
+		case +OP::SET_LOCAL: return wide_slot_instruction("OP_WIDE_SET_LOCAL", chunk, offset);
+		case +OP::GET_GLOBAL: return wide_constant_instruction("OP_WIDE_GET_GLOBAL", chunk, offset);
+		case +OP::DEFINE_GLOBAL: return wide_constant_instruction("OP_WIDE_DEFINE_GLOBAL", chunk, offset);
+		case +OP::SET_GLOBAL: return wide_constant_instruction("OP_WIDE_SET_GLOBAL", chunk, offset);
+		case +OP::GET_UPVALUE: return wide_slot_instruction("OP_WIDE_GET_UPVALUE", chunk, offset);
+		case +OP::SET_UPVALUE: return wide_slot_instruction("OP_WIDE_SET_UPVALUE", chunk, offset);
+		case +OP::GET_PROPERTY: return wide_constant_instruction("OP_WIDE_GET_PROPERTY", chunk, offset);
+		case +OP::SET_PROPERTY: return wide_constant_instruction("OP_WIDE_SET_PROPERTY", chunk, offset);
+		case +OP::GET_SUPER: return wide_constant_instruction("OP_WIDE_GET_SUPER", chunk, offset);
+		case +OP::JUMP: return wide_jump_instruction("OP_WIDE_JUMP", 1, chunk, offset);
+		case +OP::JUMP_IF_FALSE: return wide_jump_instruction("OP_WIDE_JUMP_IF_FALSE", 1, chunk, offset);
+		case +OP::LOOP: return wide_jump_instruction("OP_WIDE_LOOP", -1, chunk, offset);
+		case +OP::INVOKE: return wide_invoke_instruction("OP_WIDE_INVOKE", chunk, offset);
+		case +OP::SUPER_INVOKE: return wide_invoke_instruction("OP_WIDE_SUPER_INVOKE", chunk, offset);
+		case +OP::CLOSURE: return wide_closure_instruction(chunk, offset);
+		case +OP::CLASS: return wide_constant_instruction("OP_WIDE_CLASS", chunk, offset);
+		case +OP::METHOD: return wide_constant_instruction("OP_WIDE_METHOD", chunk, offset);
+		default:
+			fmt::print("Unknown wide opcode {}\n", chunk.code[offset + 1]);
+			return offset + 2;
+	}
+}
+
+int return_inlined_instruction(std::string_view name, Chunk &chunk, int offset) {
+	u8 drop = chunk.code[offset + 1];
+	u16 jump = *((u16 *) (&chunk.code[offset + 2]));
+	fmt::print("{:<16} {:4} -> {}\n", name, drop, offset + 2 + jump);
+	return offset + 4;
+}
+
 }
 
 namespace bytelox {
@@ -161,6 +353,70 @@ int disassemble_instruction(Chunk &chunk, size_t offset) {
 			return simple_instruction("OP_INHERIT", offset);
 		case +OP::METHOD:
 			return constant_instruction("OP_METHOD", chunk, offset);
+		case +OP::ADD_LOCALS:
+			return two_byte_instruction("OP_ADD_LOCALS", chunk, offset);
+		case +OP::ADD_LOCAL_CONSTANT:
+			return local_constant_instruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+		case +OP::SUB_LOCAL_CONSTANT:
+			return local_constant_instruction("OP_SUB_LOCAL_CONSTANT", chunk, offset);
+		case +OP::LESS_LOCALS_JUMP:
+			return compare_jump_instruction("OP_LESS_LOCALS_JUMP", chunk, offset, false);
+		case +OP::LESS_LOCAL_CONSTANT_JUMP:
+			return compare_jump_instruction("OP_LESS_LOCAL_CONSTANT_JUMP", chunk, offset, true);
+		case +OP::GET_LOCAL_PROPERTY:
+			return local_constant_instruction("OP_GET_LOCAL_PROPERTY", chunk, offset);
+		case +OP::SET_LOCAL_POP:
+			return byte_instruction("OP_SET_LOCAL_POP", chunk, offset);
+		case +OP::ADD_NUM:
+			return simple_instruction("OP_ADD_NUM", offset);
+		case +OP::ADD_STR:
+			return simple_instruction("OP_ADD_STR", offset);
+		case +OP::ADD_LOCALS_NUM:
+			return two_byte_instruction("OP_ADD_LOCALS_NUM", chunk, offset);
+		case +OP::ADD_LOCAL_CONSTANT_NUM:
+			return local_constant_instruction("OP_ADD_LOCAL_CONSTANT_NUM", chunk, offset);
+		case +OP::MOVE:
+			return move_instruction("OP_MOVE", chunk, offset);
+		case +OP::ADD_R:
+			return register_instruction("OP_ADD_R", '+', chunk, offset);
+		case +OP::SUB_R:
+			return register_instruction("OP_SUB_R", '-', chunk, offset);
+		case +OP::MUL_R:
+			return register_instruction("OP_MUL_R", '*', chunk, offset);
+		case +OP::DIV_R:
+			return register_instruction("OP_DIV_R", '/', chunk, offset);
+		case +OP::GUARD_CALL:
+			return guard_instruction("OP_GUARD_CALL", chunk, offset, false);
+		case +OP::GUARD_INVOKE:
+			return guard_instruction("OP_GUARD_INVOKE", chunk, offset, true);
+		case +OP::RETURN_INLINED:
+			return return_inlined_instruction("OP_RETURN_INLINED", chunk, offset);
+		case +OP::ADD_UNCHECKED:
+			return simple_instruction("OP_ADD_UNCHECKED", offset);
+		case +OP::SUB_UNCHECKED:
+			return simple_instruction("OP_SUB_UNCHECKED", offset);
+		case +OP::MUL_UNCHECKED:
+			return simple_instruction("OP_MUL_UNCHECKED", offset);
+		case +OP::DIV_UNCHECKED:
+			return simple_instruction("OP_DIV_UNCHECKED", offset);
+		case +OP::GREATER_UNCHECKED:
+			return simple_instruction("OP_GREATER_UNCHECKED", offset);
+		case +OP::GREATER_EQUAL_UNCHECKED:
+			return simple_instruction("OP_GREATER_EQUAL_UNCHECKED", offset);
+		case +OP::LESS_UNCHECKED:
+			return simple_instruction("OP_LESS_UNCHECKED", offset);
+		case +OP::LESS_EQUAL_UNCHECKED:
+			return simple_instruction("OP_LESS_EQUAL_UNCHECKED", offset);
+		case +OP::LOOP_TRACE:
+			return jump_instruction("OP_LOOP_TRACE", -1, chunk, offset);
+		case +OP::TAIL_CALL:
+			return byte_instruction("OP_TAIL_CALL", chunk, offset);
+		case +OP::FOR_LOOP:
+			return for_loop_instruction("OP_FOR_LOOP", chunk, offset);
+		case +OP::FOR_LOOP_TRACE:
+			return for_loop_instruction("OP_FOR_LOOP_TRACE", chunk, offset);
+		case +OP::WIDE:
+			return wide_instruction(chunk, offset);
 		default:
 			fmt::print("Unknown opcode {}\n", instruction);
 			return offset + 1;
@@ -174,4 +430,26 @@ void disassemble_chunk(Chunk &chunk, std::string_view name) {
 	}
 }
 
+void print_feedback(ObjectFunction &fn, std::string_view name) {
+	fmt::print("== {} feedback ==\n", name);
+	Chunk &chunk = fn.chunk;
+	for (size_t offset = 0; offset < chunk.count(); offset += chunk.instruction_size(offset)) {
+		FeedbackSlot &slot = fn.feedback[offset];
+		if (slot.lhs_types == 0 && slot.target == nullptr) continue;
+		disassemble_instruction(chunk, offset);
+		fmt::print("          ");
+		if (slot.lhs_types != 0) {
+			fmt::print(" types {}, {}", type_names(slot.lhs_types), type_names(slot.rhs_types));
+		}
+		if (slot.megamorphic) {
+			fmt::print(" target megamorphic");
+		}
+		else if (slot.target != nullptr) {
+			fmt::print(" target ");
+			slot.target->print_object();
+		}
+		fmt::print("\n");
+	}
+}
+
 }
@@ -6,6 +6,15 @@ namespace bytelox {
 constexpr double TABLE_MAX_LOAD = 0.75;
 constexpr u32 MIN_CAPACITY = 32;
 
+u32 hash_string(std::string_view str) {
+	u32 hash = 2166136261u;
+	for (char c : str) {
+		hash ^= (u8) c;
+		hash *= 16777619;
+	}
+	return hash;
+}
+
 HashTable::HashTable() {
 	adjust_capacity(MIN_CAPACITY);
 }
@@ -73,13 +82,8 @@ Entry *HashTable::find_in_array(Entry array[], u32 array_cap, ObjectString *key)
 	}
 }
 
-ObjectString *HashTable::find_string(std::string_view str) {
+ObjectString *HashTable::find_string(std::string_view str, u32 hash) {
 	if (size == 0) return nullptr;
-	u32 hash = 2166136261u;
-	for (u32 i=0; i<str.size(); i++) {
-		hash ^= (u8) str[i];
-		hash *= 16777619;
-	}
 	for (u32 index = (hash & (capacity - 1)); ; index = ((index + 1) & (capacity - 1))) {
 		Entry *entry = &entries[index];
 		if (entry->key == nullptr) {
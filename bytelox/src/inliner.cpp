@@ -0,0 +1,215 @@
+#include "inliner.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace bytelox {
+
+namespace {
+
+// bytes of code a function can have and still be inlined
+constexpr size_t MAX_BODY_SIZE = 48;
+// inlining stops growing a function past this, well within 2 byte jumps
+constexpr size_t MAX_CALLER_SIZE = 16384;
+
+// ops a function can be inlined with. Anything touching upvalues needs the
+// callee's closure, which inlined code doesn't have.
+bool can_inline(u8 op) {
+	switch (checked_form(op)) {
+		case +OP::CONSTANT:
+		case +OP::NIL:
+		case +OP::TRUE:
+		case +OP::FALSE:
+		case +OP::POP:
+		case +OP::GET_LOCAL:
+		case +OP::SET_LOCAL:
+		case +OP::GET_GLOBAL:
+		case +OP::SET_GLOBAL:
+		case +OP::GET_PROPERTY:
+		case +OP::SET_PROPERTY:
+		case +OP::EQUAL:
+		case +OP::NOT_EQUAL:
+		case +OP::GREATER:
+		case +OP::GREATER_EQUAL:
+		case +OP::LESS:
+		case +OP::LESS_EQUAL:
+		case +OP::ADD:
+		case +OP::SUB:
+		case +OP::MUL:
+		case +OP::DIV:
+		case +OP::NOT:
+		case +OP::NEGATE:
+		case +OP::PRINT:
+		case +OP::JUMP:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::LOOP:
+		case +OP::CALL:
+		case +OP::INVOKE:
+		case +OP::RETURN:
+		case +OP::GUARD_CALL:
+		case +OP::GUARD_INVOKE:
+		case +OP::RETURN_INLINED:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// how many of an instruction's first operands are constant indices
+size_t constant_operands(u8 op) {
+	switch (op) {
+		case +OP::CONSTANT:
+		case +OP::GET_GLOBAL:
+		case +OP::SET_GLOBAL:
+		case +OP::GET_PROPERTY:
+		case +OP::SET_PROPERTY:
+		case +OP::INVOKE:
+		case +OP::GUARD_CALL:
+			return 1;
+		case +OP::GUARD_INVOKE:
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+// index of value in chunk's constants, added if it isn't there. Numbers
+// only match the same bits, so -0 and 0 stay apart.
+size_t constant_index(Chunk &chunk, LoxValue value) {
+	for (size_t i=0; i<chunk.constants.size(); i++) {
+		LoxValue constant = chunk.constants[i];
+		if (constant.type != value.type) continue;
+		if (value.is_number() ? std::bit_cast<u64>(constant.as.number) == std::bit_cast<u64>(value.as.number) :
+				constant == value) {
+			return i;
+		}
+	}
+	return chunk.add_constant(value);
+}
+
+}
+
+void Inliner::consider(ObjectFunction &fn) {
+	if (fn.chunk.code.size() > MAX_BODY_SIZE) return;
+	std::vector<Instruction> code = decode_chunk(fn.chunk);
+	if (!std::all_of(code.begin(), code.end(), [](Instruction &ins) { return can_inline(ins.op); })) return;
+	if (stack_heights(code, fn.arity).empty()) return;
+	bodies[&fn] = fn.chunk;
+}
+
+void Inliner::add_function(ObjectFunction &fn) {
+	functions[fn.name] = &fn;
+}
+
+void Inliner::add_method(ObjectFunction &fn) {
+	auto [it, inserted] = methods.try_emplace(fn.name, &fn);
+	if (!inserted) it->second = nullptr;
+}
+
+void Inliner::inline_calls(Chunk &chunk, int arity) {
+	if (bodies.empty()) return;
+	std::vector<Instruction> code = decode_chunk(chunk);
+	std::vector<int> heights = stack_heights(code, arity);
+	if (heights.empty()) return;
+
+	size_t size = chunk.code.size();
+	std::vector<Instruction> out;
+	std::vector<int> index_of(code.size() + 1); // where each instruction of code ends up in out
+	std::vector<size_t> moved; // instructions of code in out, whose targets index code
+	for (size_t i=0; i<code.size(); i++) {
+		index_of[i] = out.size();
+		Instruction &ins = code[i];
+		ObjectFunction *fn = nullptr;
+		if (ins.op == +OP::CALL && heights[i] != -1) {
+			// the callee is whatever pushed its slot, if that's a global
+			int callee = heights[i] - ins.operands[0] - 1;
+			size_t j = i;
+			while (j > 0 && heights[j - 1] > callee) j--;
+			if (j > 0 && heights[j - 1] == callee && code[j - 1].op == +OP::GET_GLOBAL) {
+				auto it = functions.find(&chunk.constants[code[j - 1].operands[0]].as_string());
+				if (it != functions.end()) fn = it->second;
+			}
+		}
+		else if (ins.op == +OP::INVOKE && heights[i] != -1) {
+			auto it = methods.find(&chunk.constants[ins.operands[0]].as_string());
+			if (it != methods.end()) fn = it->second;
+		}
+		if (fn != nullptr) inline_call(chunk, code, heights, i, *fn, out, size);
+		moved.push_back(out.size());
+		out.push_back(ins);
+	}
+	index_of[code.size()] = out.size();
+	if (out.size() == code.size()) return;
+
+	for (size_t j : moved) {
+		if (out[j].target != -1) out[j].target = index_of[out[j].target];
+	}
+	encode_chunk(chunk, out);
+}
+
+bool Inliner::inline_call(Chunk &chunk, std::vector<Instruction> &code, std::vector<int> &heights,
+		size_t i, ObjectFunction &fn, std::vector<Instruction> &out, size_t &size) {
+	Instruction &call = code[i];
+	u8 arg_count = call.operands.back();
+	auto body = bodies.find(&fn);
+	if (body == bodies.end() || fn.arity != arg_count) return false;
+	if (size + body->second.code.size() > MAX_CALLER_SIZE) return false;
+
+	std::vector<Instruction> inlined = decode_chunk(body->second);
+	std::vector<int> body_heights = stack_heights(inlined, fn.arity);
+	// the callee's slots start where the call has the callee
+	int base = heights[i] - arg_count - 1;
+	if (base + *std::max_element(body_heights.begin(), body_heights.end()) > UINT8_MAX) return false;
+
+	size_t constant_count = chunk.constants.size();
+	size_t start = out.size();
+	size_t guard = constant_index(chunk, LoxValue(&fn));
+	Instruction check{+OP::GUARD_CALL, {static_cast<u8>(guard)}, -1, call.line};
+	if (call.op == +OP::INVOKE) {
+		check.op = +OP::GUARD_INVOKE;
+		check.operands.push_back(call.operands[0]);
+	}
+	check.operands.push_back(arg_count);
+	// the call lands right after the body
+	check.target = start + 1 + inlined.size();
+	out.push_back(check);
+
+	for (size_t j=0; j<inlined.size(); j++) {
+		Instruction &ins = out.emplace_back(inlined[j]);
+		for (size_t k=0; k<constant_operands(ins.op); k++) {
+			ins.operands[k] = constant_index(chunk, body->second.constants[ins.operands[k]]);
+		}
+		if (ins.op == +OP::GET_LOCAL || ins.op == +OP::SET_LOCAL) {
+			ins.operands[0] += base;
+		}
+		if (ins.target != -1) {
+			ins.target += start + 1;
+		}
+		if (ins.op == +OP::RETURN) {
+			ins.op = +OP::RETURN_INLINED;
+			ins.operands = {static_cast<u8>(body_heights[j] - 1)};
+			ins.target = start + 2 + inlined.size();
+		}
+	}
+	if (chunk.constants.size() > UINT8_MAX + 1) {
+		chunk.constants.resize(constant_count);
+		out.resize(start);
+		return false;
+	}
+	size += body->second.code.size() + check.operands.size() + 3;
+	return true;
+}
+
+std::vector<size_t> inlined_calls_at(Chunk &chunk, size_t offset) {
+	std::vector<size_t> guards;
+	for (size_t at = 0; at < offset; at += chunk.instruction_size(at)) {
+		u8 op = chunk.code[at];
+		if (op != +OP::GUARD_CALL && op != +OP::GUARD_INVOKE) continue;
+		size_t field = at + chunk.instruction_size(at) - 2;
+		size_t call = field + (chunk.code[field] | (chunk.code[field + 1] << 8));
+		if (offset < call) guards.push_back(at);
+	}
+	return guards;
+}
+
+}
@@ -0,0 +1,908 @@
+#include "jit.hpp"
+#include "assembler.hpp"
+#include "lox_object.hpp"
+#include "optimizer.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+
+#ifdef BYTELOX_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace bytelox {
+
+struct CodeBlock {
+	u8 *memory;
+	size_t size;
+	size_t used = 0;
+	int live = 0; // functions still in the block
+};
+
+#ifdef BYTELOX_JIT
+
+namespace {
+
+size_t round_up(size_t size, size_t alignment) {
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+void unmap(CodeCache &cache, CodeBlock *block) {
+	munmap(block->memory, block->size);
+	cache.bytes_mapped -= block->size;
+	delete block;
+}
+
+}
+
+CodeCache::~CodeCache() {
+	if (current != nullptr && current->live == 0) {
+		unmap(*this, current);
+	}
+}
+
+JitFunction *CodeCache::install(const std::vector<u8> &code, std::vector<u32> entries) {
+	size_t size = round_up(code.size(), 16);
+	if (current == nullptr || current->used + size > current->size) {
+		size_t block_size = std::max(BLOCK_SIZE, round_up(size, sysconf(_SC_PAGESIZE)));
+		if (bytes_mapped + block_size > capacity) return nullptr;
+		void *memory = mmap(nullptr, block_size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (memory == MAP_FAILED) return nullptr;
+		bytes_mapped += block_size;
+		if (current != nullptr && current->live == 0) {
+			unmap(*this, current);
+		}
+		current = new CodeBlock{(u8 *) memory, block_size};
+	}
+
+	// compiled code already in the block may be what called us, it has to be
+	// executable again before returning
+	if (mprotect(current->memory, current->size, PROT_READ | PROT_WRITE) != 0) return nullptr;
+	u8 *start = current->memory + current->used;
+	std::copy(code.begin(), code.end(), start);
+	mprotect(current->memory, current->size, PROT_READ | PROT_EXEC);
+	current->used += size;
+	current->live++;
+	return new JitFunction{start, code.size(), current, std::move(entries)};
+}
+
+void CodeCache::release(JitFunction *fn) {
+	if (fn == nullptr) return;
+	if (--fn->block->live == 0 && fn->block != current) {
+		unmap(*this, fn->block);
+	}
+	delete fn;
+}
+
+JitStatus JitFunction::enter(VM &vm, void *frame, u32 entry) {
+	using Entry = int (*)(VM *vm, void *frame, u8 *start, ValueStack *stack);
+	return static_cast<JitStatus>(reinterpret_cast<Entry>(code)(&vm, frame, code + entry, &vm.stack));
+}
+
+namespace {
+
+using namespace x64;
+using Frame = VM::CallFrame;
+// Every helper gets the VM, the current frame, the bytecode address of the
+// next instruction for when the frame's ip has to be saved, and up to two
+// operands decoded at compile time.
+using Helper = int (*)(VM *vm, Frame *frame, u8 *next, u64 a, u64 b);
+
+// Helpers that can call return the current frame too, in rdx, since pushing
+// frames can move the one compiled code was using.
+struct CallResult {
+	u64 status;
+	Frame *frame;
+};
+using CallHelper = CallResult (*)(VM *vm, Frame *frame, u8 *next, u64 a, u64 b);
+
+constexpr int CONTINUE = +JitStatus::CONTINUE;
+constexpr int RUNTIME_ERROR = +JitStatus::RUNTIME_ERROR;
+constexpr int FRAME_CHANGED = +JitStatus::FRAME_CHANGED;
+constexpr int DONE = +JitStatus::DONE;
+constexpr int BRANCH = +JitStatus::BRANCH;
+
+// calls nested on the native stack before falling back to returning to run_compiled
+constexpr int MAX_NATIVE_DEPTH = 2048;
+int native_depth = 0;
+
+const LoxValue nil_value;
+const LoxValue true_value(true);
+const LoxValue false_value(false);
+
+LoxValue &local(VM *vm, Frame *frame, u64 slot) {
+	return vm->stack[frame->slots + slot];
+}
+
+int op_reserve(VM *vm, Frame *, u8 *, u64, u64) {
+	vm->stack.reserve(2 * vm->stack.size());
+	return CONTINUE;
+}
+
+int op_get_global(VM *vm, Frame *frame, u8 *next, u64 name, u64) {
+	ObjectString *string = (ObjectString *) name;
+	LoxValue value;
+	if (!vm->globals.get(string, &value)) {
+		frame->ip = next;
+		vm->runtime_error("Undefined variable '{}'.", string->chars.get());
+		return RUNTIME_ERROR;
+	}
+	vm->stack.push_back(value);
+	return CONTINUE;
+}
+
+int op_define_global(VM *vm, Frame *, u8 *, u64 name, u64) {
+	vm->globals.set((ObjectString *) name, vm->peek());
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+int op_set_global(VM *vm, Frame *frame, u8 *next, u64 name, u64) {
+	ObjectString *string = (ObjectString *) name;
+	if (vm->globals.set(string, vm->peek())) {
+		vm->globals.del(string);
+		frame->ip = next;
+		vm->runtime_error("Undefined variable '{}'.", string->chars.get());
+		return RUNTIME_ERROR;
+	}
+	return CONTINUE;
+}
+
+int op_get_upvalue(VM *vm, Frame *frame, u8 *, u64 slot, u64) {
+	ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+	if (upvalue->stack_index == UINT32_MAX) vm->stack.push_back(upvalue->closed);
+	else vm->stack.push_back(vm->stack[upvalue->stack_index]);
+	return CONTINUE;
+}
+
+int op_set_upvalue(VM *vm, Frame *frame, u8 *, u64 slot, u64) {
+	ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
+	if (upvalue->stack_index == UINT32_MAX) upvalue->closed = vm->peek();
+	else vm->stack[upvalue->stack_index] = vm->peek();
+	return CONTINUE;
+}
+
+int op_get_property(VM *vm, Frame *frame, u8 *next, u64 name, u64) {
+	frame->ip = next;
+	vm->record_receiver(frame, next - 2, vm->peek());
+	return vm->get_property((ObjectString *) name) ? CONTINUE : RUNTIME_ERROR;
+}
+
+int op_get_local_property(VM *vm, Frame *frame, u8 *next, u64 slot, u64 name) {
+	vm->stack.push_back(local(vm, frame, slot));
+	frame->ip = next;
+	vm->record_receiver(frame, next - 3, vm->peek());
+	return vm->get_property((ObjectString *) name) ? CONTINUE : RUNTIME_ERROR;
+}
+
+int op_set_property(VM *vm, Frame *frame, u8 *next, u64 name, u64) {
+	vm->record_receiver(frame, next - 2, vm->peek(1));
+	if (!vm->peek(1).is_object() || !vm->peek(1).is_instance()) {
+		frame->ip = next;
+		vm->runtime_error("Only instances have fields.");
+		return RUNTIME_ERROR;
+	}
+	vm->peek(1).as_instance().fields.set((ObjectString *) name, vm->peek());
+	vm->peek(1) = vm->peek();
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+int op_get_super(VM *vm, Frame *frame, u8 *next, u64 name, u64) {
+	ObjectClass *superclass = &vm->peek().as_class();
+	vm->stack.pop_back();
+	frame->ip = next;
+	return vm->bind_method(superclass, (ObjectString *) name) ? CONTINUE : RUNTIME_ERROR;
+}
+
+template<bool equal>
+int op_equal(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	vm->feedback_slot(frame, next - 1).record_types(vm->peek(1), vm->peek());
+	vm->peek(1) = LoxValue(vm->values_equal(vm->peek(1), vm->peek()) == equal);
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+// GREATER, LESS, SUB and the like when an operand isn't a number, f gives the result
+template<typename F>
+int op_numeric(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	LoxValue &a = vm->peek(1);
+	LoxValue b = vm->peek();
+	if (!a.is_number() || !b.is_number()) {
+		frame->ip = next;
+		vm->runtime_error("Operands must be numbers.");
+		return RUNTIME_ERROR;
+	}
+	a = LoxValue(F()(a.as.number, b.as.number));
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+int op_add(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	vm->feedback_slot(frame, next - 1).record_types(vm->peek(1), vm->peek());
+	if (vm->peek().is_string() && vm->peek(1).is_string()) {
+		vm->concatenate();
+	}
+	else if (vm->peek().is_number() && vm->peek(1).is_number()) {
+		vm->peek(1).as.number += vm->peek().as.number;
+		vm->stack.pop_back();
+	}
+	else {
+		frame->ip = next;
+		vm->runtime_error("Operands must be two numbers or two strings.");
+		return RUNTIME_ERROR;
+	}
+	return CONTINUE;
+}
+
+// ADD_LOCALS and ADD_LOCAL_CONSTANT, after the operands are read
+int add_values(VM *vm, Frame *frame, u8 *next, LoxValue a, LoxValue b) {
+	vm->feedback_slot(frame, next - 3).record_types(a, b);
+	if (a.is_number() && b.is_number()) {
+		vm->stack.push_back(LoxValue(a.as.number + b.as.number));
+	}
+	else if (a.is_string() && b.is_string()) {
+		vm->stack.push_back(a);
+		vm->stack.push_back(b);
+		vm->concatenate();
+	}
+	else {
+		frame->ip = next;
+		vm->runtime_error("Operands must be two numbers or two strings.");
+		return RUNTIME_ERROR;
+	}
+	return CONTINUE;
+}
+
+int op_add_locals(VM *vm, Frame *frame, u8 *next, u64 a, u64 b) {
+	return add_values(vm, frame, next, local(vm, frame, a), local(vm, frame, b));
+}
+
+int op_add_local_constant(VM *vm, Frame *frame, u8 *next, u64 slot, u64 constant) {
+	return add_values(vm, frame, next, local(vm, frame, slot), *(const LoxValue *) constant);
+}
+
+int op_sub_local_constant(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	frame->ip = next;
+	vm->runtime_error("Operands must be numbers.");
+	return RUNTIME_ERROR;
+}
+
+// LESS_LOCALS_JUMP and LESS_LOCAL_CONSTANT_JUMP, when an operand isn't a number
+int op_less_jump(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	frame->ip = next;
+	vm->runtime_error("Operands must be numbers.");
+	return RUNTIME_ERROR;
+}
+
+// a FOR_LOOP whose counter or bound isn't a number
+int op_for_loop(VM *vm, Frame *frame, u8 *next, u64 counter, u64) {
+	frame->ip = next;
+	if (!local(vm, frame, counter).is_number()) vm->runtime_error("Operands must be two numbers or two strings.");
+	else vm->runtime_error("Operands must be numbers.");
+	return RUNTIME_ERROR;
+}
+
+int op_not(VM *vm, Frame *, u8 *, u64, u64) {
+	vm->peek() = is_falsey(vm->peek());
+	return CONTINUE;
+}
+
+int op_negate(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	if (!vm->peek().is_number()) {
+		frame->ip = next;
+		vm->runtime_error("Operand must be a number.");
+		return RUNTIME_ERROR;
+	}
+	vm->peek().as.number *= -1;
+	return CONTINUE;
+}
+
+int op_print(VM *vm, Frame *, u8 *, u64, u64) {
+	vm->peek().print_value();
+	fmt::print("\n");
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+// After a call pushed a frame, runs the callee's compiled code on the native
+// stack, so its return lands straight back in the caller's compiled code.
+// Otherwise, or once the callee itself calls something interpreted, compiled
+// code unwinds to run_compiled with FRAME_CHANGED.
+CallResult finish_call(VM *vm, size_t frame_count, bool ok) {
+	if (!ok) return {RUNTIME_ERROR, nullptr};
+	if (vm->frames.size() == frame_count) return {CONTINUE, &vm->frames.back()};
+	Frame *callee = &vm->frames.back();
+	JitFunction *jit = callee->closure->function->jit;
+	if (jit == nullptr || native_depth == MAX_NATIVE_DEPTH) return {FRAME_CHANGED, nullptr};
+	native_depth++;
+	JitStatus status = jit->enter(*vm, callee, jit->entries[0]);
+	native_depth--;
+	if (status == JitStatus::FRAME_CHANGED && vm->frames.size() == frame_count) {
+		return {CONTINUE, &vm->frames.back()};
+	}
+	return {static_cast<u64>(status), nullptr};
+}
+
+CallResult op_call(VM *vm, Frame *frame, u8 *next, u64 arg_count, u64) {
+	frame->ip = next;
+	vm->record_callee(frame, next - 2, vm->peek(arg_count));
+	size_t frame_count = vm->frames.size();
+	return finish_call(vm, frame_count, vm->call_value(vm->peek(arg_count), arg_count));
+}
+
+// The callee's frame replaces this one, so compiled code unwinds to
+// run_compiled to run it rather than nesting on the native stack. Calls that
+// push no frame carry on to the RETURN after.
+CallResult op_tail_call(VM *vm, Frame *frame, u8 *next, u64 arg_count, u64) {
+	frame->ip = next;
+	vm->record_callee(frame, next - 2, vm->peek(arg_count));
+	size_t frame_count = vm->frames.size();
+	if (!vm->call_value(vm->peek(arg_count), arg_count)) return {RUNTIME_ERROR, nullptr};
+	if (vm->frames.size() == frame_count) return {CONTINUE, &vm->frames.back()};
+	vm->replace_caller_frame();
+	return {FRAME_CHANGED, nullptr};
+}
+
+CallResult op_invoke(VM *vm, Frame *frame, u8 *next, u64 name, u64 arg_count) {
+	frame->ip = next;
+	vm->record_receiver(frame, next - 3, vm->peek(arg_count));
+	size_t frame_count = vm->frames.size();
+	return finish_call(vm, frame_count, vm->invoke((ObjectString *) name, arg_count));
+}
+
+CallResult op_super_invoke(VM *vm, Frame *frame, u8 *next, u64 name, u64 arg_count) {
+	frame->ip = next;
+	ObjectClass *superclass = &vm->peek().as_class();
+	vm->stack.pop_back();
+	size_t frame_count = vm->frames.size();
+	return finish_call(vm, frame_count, vm->invoke_from_class(superclass, (ObjectString *) name, arg_count));
+}
+
+// GUARD_CALL and GUARD_INVOKE, 1 if the inlined body can run
+int op_guard(VM *vm, Frame *frame, u8 *, u64 guard, u64) {
+	return vm->inlined_target(frame, (u8 *) guard);
+}
+
+int op_closure(VM *vm, Frame *frame, u8 *, u64 fn, u64 captures) {
+	vm->push_closure(frame, (ObjectFunction *) fn, (u8 *) captures);
+	return CONTINUE;
+}
+
+int op_close_upvalue(VM *vm, Frame *, u8 *, u64, u64) {
+	vm->close_upvalues(vm->stack.size() - 1);
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+int op_return(VM *vm, Frame *frame, u8 *, u64, u64) {
+	LoxValue result = vm->stack.back();
+	vm->stack.pop_back();
+	vm->close_upvalues(frame->slots);
+	if (vm->frames.size() == 1) {
+		vm->frames.pop_back();
+		vm->stack.pop_back();
+		return DONE;
+	}
+	vm->stack.resize(frame->slots);
+	vm->stack.push_back(result);
+	vm->frames.pop_back();
+	return FRAME_CHANGED;
+}
+
+// LOOP, FOR_LOOP and their traced forms each time the loop's counter fills up, with the
+// address the loop jumps back to for next. Returns BRANCH with the native
+// address of wherever the loop carries on from if it isn't there.
+struct LoopResult {
+	u64 status;
+	const u8 *native;
+};
+
+LoopResult op_loop(VM *vm, Frame *frame, u8 *header, u64 loop, u64) {
+	vm->loop_counter(header) = 0;
+	frame->ip = header;
+	u8 op = *(u8 *) loop;
+	if (op == +OP::LOOP_TRACE || op == +OP::FOR_LOOP_TRACE) vm->enter_trace(frame, (u8 *) loop);
+	else vm->hot_loop(frame, (u8 *) loop);
+	if (frame->ip == header) return {CONTINUE, nullptr};
+	ObjectFunction *fn = frame->closure->function;
+	return {BRANCH, fn->jit->code + fn->jit->entries[frame->ip - fn->chunk.code.data()]};
+}
+
+int op_class(VM *vm, Frame *, u8 *, u64 name, u64) {
+	vm->stack.push_back(vm->GC<ObjectClass>((ObjectString *) name));
+	return CONTINUE;
+}
+
+int op_inherit(VM *vm, Frame *frame, u8 *next, u64, u64) {
+	LoxValue superclass = vm->peek(1);
+	if (!superclass.is_class()) {
+		frame->ip = next;
+		vm->runtime_error("Superclass must be a class.");
+		return RUNTIME_ERROR;
+	}
+	vm->peek().as_class().methods.add_all(superclass.as_class().methods);
+	vm->stack.pop_back();
+	return CONTINUE;
+}
+
+int op_method(VM *vm, Frame *, u8 *, u64 name, u64) {
+	vm->define_method((ObjectString *) name);
+	return CONTINUE;
+}
+
+// register ops that aren't on numbers
+template<OP op>
+int op_register(VM *vm, Frame *frame, u8 *next, u64 operands, u64) {
+	u8 *ip = (u8 *) operands; // mode, dst, lhs, rhs
+	LoxValue rhs = vm->read_register(frame, (ip[0] >> 2) & 3, ip[3]);
+	LoxValue lhs = vm->read_register(frame, ip[0] & 3, ip[2]);
+	if (op != OP::ADD_R || !lhs.is_string() || !rhs.is_string()) {
+		frame->ip = next;
+		if (op == OP::ADD_R) vm->runtime_error("Operands must be two numbers or two strings.");
+		else vm->runtime_error("Operands must be numbers.");
+		return RUNTIME_ERROR;
+	}
+	vm->stack.push_back(lhs);
+	vm->stack.push_back(rhs);
+	vm->concatenate();
+	if (static_cast<RegisterKind>((ip[0] >> 4) & 3) == RegisterKind::LOCAL) {
+		local(vm, frame, ip[1]) = vm->peek();
+		vm->stack.pop_back();
+	}
+	return CONTINUE;
+}
+
+constexpr i32 VALUE_SIZE = sizeof(LoxValue);
+constexpr i32 NUMBER_OFFSET = offsetof(LoxValue, as);
+static_assert(VALUE_SIZE == 16 && sizeof(ValueType) == 4, "templates copy values with one movups");
+
+constexpr u8 NIL = +ValueType::NIL;
+constexpr u8 BOOL = +ValueType::BOOL;
+constexpr u8 NUMBER = +ValueType::NUMBER;
+
+// Where an operand of an arithmetic template is. CONSTANT operands are
+// addressed through a scratch register.
+struct Operand {
+	RegisterKind kind;
+	u64 value; // slot, or address of the constant
+	Reg base = RAX;
+	i32 disp = 0;
+};
+
+struct JitCompiler {
+	VM &vm;
+	Chunk &chunk;
+	Assembler as;
+	std::vector<u32> native_at; // native offset of each bytecode offset
+	std::vector<std::pair<size_t, size_t>> jumps; // displacement, bytecode target
+	std::vector<size_t> exits; // displacements of jumps to the epilogue
+
+	JitCompiler(VM &vm, Chunk &chunk): vm(vm), chunk(chunk), native_at(chunk.code.size() + 1, UINT32_MAX) {}
+
+	// Compiled code keeps the VM in rbx, the frame in r12, the frame's first
+	// slot in r13, the top of the stack in r14 and &vm->stack in r15.
+	void spill() {
+		as.store(R15, offsetof(ValueStack, top), R14);
+	}
+	void reload() {
+		as.load(R14, R15, offsetof(ValueStack, top));
+		as.load(R13, R12, offsetof(Frame, slots));
+		as.shl(R13, 4);
+		as.add(R13, R15, offsetof(ValueStack, values));
+	}
+
+	void call(const void *helper, u8 *next, u64 a, u64 b) {
+		spill();
+		as.mov(RDI, RBX);
+		as.mov(RSI, R12);
+		as.mov(RDX, (u64) next);
+		as.mov(RCX, a);
+		as.mov(R8, b);
+		as.call(helper);
+	}
+	void call(Helper helper, u8 *next, u64 a = 0, u64 b = 0) {
+		call((const void *) helper, next, a, b);
+		reload();
+	}
+	// leaves compiled code with the helper's status unless it's CONTINUE
+	void check() {
+		as.test_eax();
+		exits.push_back(as.jump_if(NOT_EQUAL));
+	}
+	void call_checked(Helper helper, u8 *next, u64 a = 0, u64 b = 0) {
+		call(helper, next, a, b);
+		check();
+	}
+	void call_frame(CallHelper helper, u8 *next, u64 a = 0, u64 b = 0) {
+		call((const void *) helper, next, a, b);
+		as.mov(R12, RDX);
+		check();
+		reload();
+	}
+	void jump(size_t target) {
+		jumps.push_back({as.jmp(), target});
+	}
+	void jump_if(Condition condition, size_t target) {
+		jumps.push_back({as.jump_if(condition), target});
+	}
+	// after a conditional jump's helper
+	void branch(size_t target) {
+		as.cmp_eax(BRANCH);
+		jump_if(EQUAL, target);
+		check();
+	}
+
+	u64 constant(size_t index) {
+		return (u64) &chunk.constants[index];
+	}
+	u64 object(u8 index) {
+		return (u64) chunk.constants[index].as.obj;
+	}
+
+	void ensure_capacity() {
+		as.cmp(R14, R15, offsetof(ValueStack, limit));
+		size_t has_room = as.jump_if(BELOW);
+		call(op_reserve, nullptr);
+		as.bind(has_room);
+	}
+	void push_value(Reg base, i32 disp) {
+		as.load_value(XMM0, base, disp);
+		as.store_value(R14, 0, XMM0);
+		as.add(R14, VALUE_SIZE);
+	}
+	void push_constant(u64 address) {
+		ensure_capacity();
+		as.mov(RAX, address);
+		push_value(RAX, 0);
+	}
+
+	// Resolves where operands are, after any helper call that could clobber
+	// scratch registers. Stack operands are on top, rhs topmost.
+	void place(Operand &lhs, Operand &rhs) {
+		int on_stack = 0;
+		for (Operand *operand : {&rhs, &lhs}) {
+			switch (operand->kind) {
+				case RegisterKind::LOCAL:
+					operand->base = R13;
+					operand->disp = operand->value * VALUE_SIZE;
+					break;
+				case RegisterKind::CONSTANT:
+					operand->base = operand == &lhs ? RCX : RDX;
+					operand->disp = 0;
+					as.mov(operand->base, operand->value);
+					break;
+				case RegisterKind::STACK:
+					operand->base = R14;
+					operand->disp = -VALUE_SIZE * ++on_stack;
+					break;
+			}
+		}
+	}
+	// jumps to slow unless both operands are numbers
+	void check_numbers(Operand &lhs, Operand &rhs, std::vector<size_t> &slow) {
+		for (Operand *operand : {&lhs, &rhs}) {
+			as.cmp32(operand->base, operand->disp, NUMBER);
+			slow.push_back(as.jump_if(NOT_EQUAL));
+		}
+	}
+	static int popped(Operand &lhs, Operand &rhs) {
+		return (lhs.kind == RegisterKind::STACK) + (rhs.kind == RegisterKind::STACK);
+	}
+
+	// Number arithmetic inline, falling back to slow for anything else, or
+	// trusting the operands are numbers if slow is null.
+	// The result is pushed if dst is -1, otherwise stored to local dst.
+	void arithmetic(SSE op, Operand lhs, Operand rhs, int dst, Helper slow, u8 *next, u64 a = 0, u64 b = 0) {
+		int pops = popped(lhs, rhs);
+		if (pops == 0 && dst == -1) ensure_capacity();
+		place(lhs, rhs);
+		std::vector<size_t> not_numbers;
+		if (slow != nullptr) check_numbers(lhs, rhs, not_numbers);
+		as.sse(MOVSD, XMM0, lhs.base, lhs.disp + NUMBER_OFFSET);
+		as.sse(op, XMM0, rhs.base, rhs.disp + NUMBER_OFFSET);
+		if (pops > 0) as.sub(R14, VALUE_SIZE * pops);
+		if (dst == -1) {
+			as.store32(R14, 0, NUMBER);
+			as.store_double(R14, NUMBER_OFFSET, XMM0);
+			as.add(R14, VALUE_SIZE);
+		}
+		else {
+			as.store32(R13, dst * VALUE_SIZE, NUMBER);
+			as.store_double(R13, dst * VALUE_SIZE + NUMBER_OFFSET, XMM0);
+		}
+		if (slow == nullptr) return;
+		size_t done = as.jmp();
+		for (size_t displacement : not_numbers) as.bind(displacement);
+		call_checked(slow, next, a, b);
+		as.bind(done);
+	}
+
+	// GREATER and the like on the top two values, falling back to slow like
+	// arithmetic
+	void comparison(Condition condition, bool swap, Helper slow, u8 *next) {
+		Operand lhs{RegisterKind::STACK, 0}, rhs{RegisterKind::STACK, 0};
+		place(lhs, rhs);
+		std::vector<size_t> not_numbers;
+		if (slow != nullptr) check_numbers(lhs, rhs, not_numbers);
+		// ucomisd sets flags like an unsigned compare, and unordered like below
+		if (swap) std::swap(lhs, rhs);
+		as.sse(MOVSD, XMM0, lhs.base, lhs.disp + NUMBER_OFFSET);
+		as.compare_double(XMM0, rhs.base, rhs.disp + NUMBER_OFFSET);
+		as.set_al(condition);
+		as.sub(R14, VALUE_SIZE);
+		as.store32(R14, -VALUE_SIZE, BOOL);
+		as.store_al(R14, -VALUE_SIZE + NUMBER_OFFSET);
+		if (slow == nullptr) return;
+		size_t done = as.jmp();
+		for (size_t displacement : not_numbers) as.bind(displacement);
+		call_checked(slow, next);
+		as.bind(done);
+	}
+
+	// LOOP, LOOP_TRACE and a FOR_LOOP going round again. Counts iterations like
+	// the interpreter, to record or enter a trace.
+	void loop_back(u8 *ip, size_t target) {
+		if (!vm.compiler_options.trace) {
+			jump(target);
+			return;
+		}
+		u8 *header = &chunk.code[target];
+		as.mov(RAX, (u64) &vm.loop_counter(header));
+		as.add16(RAX, 0, 1);
+		as.cmp16(RAX, 0, vm.compiler_options.trace_threshold);
+		jump_if(BELOW, target);
+		call((const void *) op_loop, header, (u64) ip, 0);
+		reload();
+		as.test_eax();
+		jump_if(EQUAL, target);
+		as.jmp(RDX);
+	}
+
+	// jumps to target unless lhs < rhs
+	void less_jump(Operand lhs, Operand rhs, size_t target, u8 *next) {
+		place(lhs, rhs);
+		std::vector<size_t> not_numbers;
+		check_numbers(lhs, rhs, not_numbers);
+		as.sse(MOVSD, XMM0, rhs.base, rhs.disp + NUMBER_OFFSET);
+		as.compare_double(XMM0, lhs.base, lhs.disp + NUMBER_OFFSET);
+		jump_if(BELOW_EQUAL, target);
+		size_t done = as.jmp();
+		for (size_t displacement : not_numbers) as.bind(displacement);
+		call_checked(op_less_jump, next);
+		as.bind(done);
+	}
+
+	void register_op(SSE op, Helper slow, u8 *ip, u8 *next) {
+		u8 mode = ip[1];
+		Operand lhs{static_cast<RegisterKind>(mode & 3), ip[3]};
+		Operand rhs{static_cast<RegisterKind>((mode >> 2) & 3), ip[4]};
+		for (Operand *operand : {&lhs, &rhs}) {
+			if (operand->kind == RegisterKind::CONSTANT) operand->value = constant(operand->value);
+		}
+		bool to_local = static_cast<RegisterKind>((mode >> 4) & 3) == RegisterKind::LOCAL;
+		if (mode & UNCHECKED_NUMBERS) slow = nullptr;
+		arithmetic(op, lhs, rhs, to_local ? ip[2] : -1, slow, next, (u64) (ip + 1));
+	}
+
+	// false if the instruction isn't supported
+	bool compile_instruction(size_t offset, size_t size) {
+		using enum RegisterKind;
+		u8 *ip = &chunk.code[offset];
+		u8 *next = ip + size;
+		int direction = jump_direction(*ip);
+		size_t target = 0;
+		if (direction != 0) {
+			size_t field = offset + size - 2;
+			target = field + direction * (chunk.code[field] | (chunk.code[field + 1] << 8));
+		}
+		Operand top{STACK, 0};
+
+		switch (*ip) {
+			case +OP::CONSTANT: push_constant(constant(ip[1])); break;
+			case +OP::CONSTANT_LONG: push_constant(constant(ip[1] | (ip[2] << 8) | (ip[3] << 16))); break;
+			case +OP::NIL: push_constant((u64) &nil_value); break;
+			case +OP::TRUE: push_constant((u64) &true_value); break;
+			case +OP::FALSE: push_constant((u64) &false_value); break;
+			case +OP::POP: as.sub(R14, VALUE_SIZE); break;
+			case +OP::GET_LOCAL:
+				ensure_capacity();
+				push_value(R13, ip[1] * VALUE_SIZE);
+				break;
+			case +OP::SET_LOCAL:
+			case +OP::SET_LOCAL_POP:
+				as.load_value(XMM0, R14, -VALUE_SIZE);
+				as.store_value(R13, ip[1] * VALUE_SIZE, XMM0);
+				if (*ip == +OP::SET_LOCAL_POP) as.sub(R14, VALUE_SIZE);
+				break;
+			case +OP::GET_GLOBAL: call_checked(op_get_global, next, object(ip[1])); break;
+			case +OP::DEFINE_GLOBAL: call(op_define_global, next, object(ip[1])); break;
+			case +OP::SET_GLOBAL: call_checked(op_set_global, next, object(ip[1])); break;
+			case +OP::GET_UPVALUE: call(op_get_upvalue, next, ip[1]); break;
+			case +OP::SET_UPVALUE: call(op_set_upvalue, next, ip[1]); break;
+			case +OP::GET_PROPERTY: call_checked(op_get_property, next, object(ip[1])); break;
+			case +OP::SET_PROPERTY: call_checked(op_set_property, next, object(ip[1])); break;
+			case +OP::GET_SUPER: call_checked(op_get_super, next, object(ip[1])); break;
+			case +OP::EQUAL: call(op_equal<true>, next); break;
+			case +OP::NOT_EQUAL: call(op_equal<false>, next); break;
+			case +OP::GREATER: comparison(ABOVE, false, op_numeric<std::greater<f64>>, next); break;
+			case +OP::GREATER_EQUAL: comparison(ABOVE_EQUAL, false, op_numeric<std::greater_equal<f64>>, next); break;
+			case +OP::LESS: comparison(ABOVE, true, op_numeric<std::less<f64>>, next); break;
+			case +OP::LESS_EQUAL: comparison(ABOVE_EQUAL, true, op_numeric<std::less_equal<f64>>, next); break;
+			case +OP::ADD:
+			case +OP::ADD_NUM:
+				arithmetic(ADDSD, top, top, -1, op_add, next);
+				break;
+			case +OP::ADD_STR: call_checked(op_add, next); break;
+			case +OP::SUB: arithmetic(SUBSD, top, top, -1, op_numeric<std::minus<f64>>, next); break;
+			case +OP::MUL: arithmetic(MULSD, top, top, -1, op_numeric<std::multiplies<f64>>, next); break;
+			case +OP::DIV: arithmetic(DIVSD, top, top, -1, op_numeric<std::divides<f64>>, next); break;
+			case +OP::ADD_UNCHECKED: arithmetic(ADDSD, top, top, -1, nullptr, next); break;
+			case +OP::SUB_UNCHECKED: arithmetic(SUBSD, top, top, -1, nullptr, next); break;
+			case +OP::MUL_UNCHECKED: arithmetic(MULSD, top, top, -1, nullptr, next); break;
+			case +OP::DIV_UNCHECKED: arithmetic(DIVSD, top, top, -1, nullptr, next); break;
+			case +OP::GREATER_UNCHECKED: comparison(ABOVE, false, nullptr, next); break;
+			case +OP::GREATER_EQUAL_UNCHECKED: comparison(ABOVE_EQUAL, false, nullptr, next); break;
+			case +OP::LESS_UNCHECKED: comparison(ABOVE, true, nullptr, next); break;
+			case +OP::LESS_EQUAL_UNCHECKED: comparison(ABOVE_EQUAL, true, nullptr, next); break;
+			case +OP::NOT: call(op_not, next); break;
+			case +OP::NEGATE: call_checked(op_negate, next); break;
+			case +OP::PRINT: call(op_print, next); break;
+			case +OP::JUMP:
+				jump(target);
+				break;
+			case +OP::LOOP:
+			case +OP::LOOP_TRACE:
+				loop_back(ip, target);
+				break;
+			case +OP::FOR_LOOP:
+			case +OP::FOR_LOOP_TRACE: {
+				Operand counter{LOCAL, ip[2]};
+				Operand bound{static_cast<RegisterKind>(ip[1]), ip[4]};
+				if (bound.kind == CONSTANT) bound.value = constant(bound.value);
+				place(counter, bound);
+				std::vector<size_t> not_numbers;
+				check_numbers(counter, bound, not_numbers);
+				as.sse(MOVSD, XMM0, counter.base, counter.disp + NUMBER_OFFSET);
+				as.mov(RAX, constant(ip[3]));
+				as.sse(ADDSD, XMM0, RAX, NUMBER_OFFSET);
+				as.store_double(counter.base, counter.disp + NUMBER_OFFSET, XMM0);
+				// read after the store, in case the bound is the counter
+				as.sse(MOVSD, XMM1, bound.base, bound.disp + NUMBER_OFFSET);
+				as.compare_double(XMM1, XMM0);
+				size_t taken = as.jump_if(ABOVE);
+				size_t done = as.jmp();
+				for (size_t displacement : not_numbers) as.bind(displacement);
+				call_checked(op_for_loop, next, ip[2]);
+				as.bind(taken);
+				loop_back(ip, target);
+				as.bind(done);
+				break;
+			}
+			case +OP::JUMP_IF_FALSE: {
+				as.cmp32(R14, -VALUE_SIZE, NIL);
+				jump_if(EQUAL, target);
+				as.cmp32(R14, -VALUE_SIZE, BOOL);
+				size_t truthy = as.jump_if(NOT_EQUAL);
+				as.cmp8(R14, -VALUE_SIZE + NUMBER_OFFSET, 0);
+				jump_if(EQUAL, target);
+				as.bind(truthy);
+				break;
+			}
+			case +OP::CALL: call_frame(op_call, next, ip[1]); break;
+			case +OP::TAIL_CALL: call_frame(op_tail_call, next, ip[1]); break;
+			case +OP::INVOKE: call_frame(op_invoke, next, object(ip[1]), ip[2]); break;
+			case +OP::SUPER_INVOKE: call_frame(op_super_invoke, next, object(ip[1]), ip[2]); break;
+			case +OP::CLOSURE: call(op_closure, next, object(ip[1]), (u64) (ip + 2)); break;
+			case +OP::CLOSE_UPVALUE: call(op_close_upvalue, next); break;
+			case +OP::RETURN: call_checked(op_return, next); break;
+			case +OP::CLASS: call(op_class, next, object(ip[1])); break;
+			case +OP::INHERIT: call_checked(op_inherit, next); break;
+			case +OP::METHOD: call(op_method, next, object(ip[1])); break;
+			case +OP::ADD_LOCALS:
+			case +OP::ADD_LOCALS_NUM:
+				arithmetic(ADDSD, {LOCAL, ip[1]}, {LOCAL, ip[2]}, -1, op_add_locals, next, ip[1], ip[2]);
+				break;
+			case +OP::ADD_LOCAL_CONSTANT:
+			case +OP::ADD_LOCAL_CONSTANT_NUM:
+				arithmetic(ADDSD, {LOCAL, ip[1]}, {CONSTANT, constant(ip[2])}, -1,
+						op_add_local_constant, next, ip[1], constant(ip[2]));
+				break;
+			case +OP::SUB_LOCAL_CONSTANT:
+				arithmetic(SUBSD, {LOCAL, ip[1]}, {CONSTANT, constant(ip[2])}, -1, op_sub_local_constant, next);
+				break;
+			case +OP::LESS_LOCALS_JUMP: less_jump({LOCAL, ip[1]}, {LOCAL, ip[2]}, target, next); break;
+			case +OP::LESS_LOCAL_CONSTANT_JUMP:
+				less_jump({LOCAL, ip[1]}, {CONSTANT, constant(ip[2])}, target, next);
+				break;
+			case +OP::GET_LOCAL_PROPERTY: call_checked(op_get_local_property, next, ip[1], object(ip[2])); break;
+			case +OP::MOVE: {
+				Operand src{static_cast<RegisterKind>(ip[1] & 3), ip[3]};
+				if (src.kind == CONSTANT) src.value = constant(src.value);
+				place(src, top);
+				as.load_value(XMM0, src.base, src.disp);
+				as.store_value(R13, ip[2] * VALUE_SIZE, XMM0);
+				break;
+			}
+			case +OP::ADD_R: register_op(ADDSD, op_register<OP::ADD_R>, ip, next); break;
+			case +OP::SUB_R: register_op(SUBSD, op_register<OP::SUB_R>, ip, next); break;
+			case +OP::MUL_R: register_op(MULSD, op_register<OP::MUL_R>, ip, next); break;
+			case +OP::DIV_R: register_op(DIVSD, op_register<OP::DIV_R>, ip, next); break;
+			case +OP::GUARD_CALL:
+			case +OP::GUARD_INVOKE:
+				call(op_guard, next, (u64) ip);
+				as.test_eax();
+				jump_if(EQUAL, target);
+				break;
+			case +OP::RETURN_INLINED:
+				as.load_value(XMM0, R14, -VALUE_SIZE);
+				as.sub(R14, VALUE_SIZE * ip[1]);
+				as.store_value(R14, -VALUE_SIZE, XMM0);
+				jump(target);
+				break;
+			default: return false;
+		}
+		return true;
+	}
+
+	JitFunction *compile() {
+		// entered with the VM, the frame, the native address to start at and
+		// the stack. Five pushes keep the stack 16 byte aligned for helpers.
+		for (Reg reg : {RBX, R12, R13, R14, R15}) as.push(reg);
+		as.mov(RBX, RDI);
+		as.mov(R12, RSI);
+		as.mov(R15, RCX);
+		reload();
+		as.jmp(RDX);
+
+		for (size_t offset = 0; offset < chunk.code.size();) {
+			native_at[offset] = as.code.size();
+			size_t size = chunk.instruction_size(offset);
+			if (!compile_instruction(offset, size)) return nullptr;
+			offset += size;
+		}
+
+		size_t epilogue = as.code.size();
+		for (Reg reg : {R15, R14, R13, R12, RBX}) as.pop(reg);
+		as.ret();
+		for (size_t displacement : exits) {
+			as.patch(displacement, epilogue);
+		}
+		for (auto [displacement, target] : jumps) {
+			as.patch(displacement, native_at[target]);
+		}
+
+		return vm.code_cache.install(as.code, std::move(native_at));
+	}
+};
+
+}
+
+JitFunction *jit_compile(VM &vm, ObjectFunction &fn) {
+	return JitCompiler(vm, fn.chunk).compile();
+}
+
+#else
+
+CodeCache::~CodeCache() {}
+
+JitFunction *CodeCache::install(const std::vector<u8> &, std::vector<u32>) {
+	return nullptr;
+}
+
+void CodeCache::release(JitFunction *) {}
+
+JitStatus JitFunction::enter(VM &, void *, u32) {
+	return JitStatus::RUNTIME_ERROR;
+}
+
+JitFunction *jit_compile(VM &, ObjectFunction &) {
+	return nullptr;
+}
+
+#endif
+
+}
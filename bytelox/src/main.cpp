@@ -2,11 +2,20 @@
 #include "chunk.hpp"
 #include "vm.hpp"
 #include "debug.hpp"
+#include "aot.hpp"
+#include "bytecode_cache.hpp"
+#include "serialize.hpp"
+#include "scanner.hpp"
+#include "snapshot.hpp"
 
-#include <string>
+#include <chrono>
 #include <iostream>
-#include <fstream>
-#include <sstream>
+#include <memory>
+#include <string>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #define FMT_HEADER_ONLY
 #include "fmt/core.h"
 
@@ -25,20 +34,34 @@ namespace {
 		}
 	}
 	
-	std::string read_file(const std::string &path) {
-		std::ifstream f(path);
-		if (!f.is_open()) {
+	// the script at path, or standard input for "-"
+	std::unique_ptr<MappedFile> read_file(const std::string &path) {
+		auto file = std::make_unique<MappedFile>(path == "-" ? "/dev/stdin" : path);
+		if (file->data == nullptr) {
 			fmt::print(stderr, "Could not open file \"{}\".\n", path);
 			exit(74);
 		}
-		std::stringstream contents;
-		contents << f.rdbuf();
-		return contents.str();
+		return file;
 	}
 	
-	void run_file(VM &vm, const std::string &path) {
-		std::string src = read_file(path);
-		InterpretResult res = vm.interpret(src);
+	void run_file(VM &vm, const std::string &path, bool dump_feedback, bool use_cache) {
+		std::unique_ptr<MappedFile> file = read_file(path);
+		std::string_view src(file->data, file->size);
+		// a cache holds all of a script's code, so it would compile every body,
+		// and standard input has nowhere to keep one
+		use_cache = use_cache && !vm.compiler_options.lazy && path != "-";
+		std::string cache_path = bytecode_cache_path(path);
+		ObjectFunction *script = use_cache ? load_bytecode_cache(vm, cache_path, src) : nullptr;
+		if (script == nullptr) {
+			script = vm.compile(std::move(file)); // which keeps src alive
+			if (script != nullptr && use_cache) {
+				write_bytecode_cache(vm, *script, cache_path, src);
+			}
+		}
+		InterpretResult res = script == nullptr ? InterpretResult::INTERPRET_COMPILE_ERROR : vm.interpret(*script);
+		if (dump_feedback) {
+			vm.dump_feedback();
+		}
 		
 		if (res == InterpretResult::INTERPRET_COMPILE_ERROR) {
 			exit(65);
@@ -47,20 +70,166 @@ namespace {
 			exit(70);
 		}
 	}
+	
+	void emit_file(VM &vm, const std::string &path) {
+		vm.compiler_options.lazy = false;
+		ObjectFunction *script = vm.compile(read_file(path));
+		if (script == nullptr) {
+			exit(65);
+		}
+		fmt::print("{}", emit_cpp(*script, path));
+	}
+	
+	// runs pass over src again and again for a second, and prints how fast
+	template <typename Pass>
+	void bench(std::string_view src, Pass pass) {
+		using clock = std::chrono::steady_clock;
+		clock::time_point begin = clock::now();
+		std::chrono::duration<double> elapsed{};
+		int passes = 0;
+		do {
+			pass();
+			passes++;
+			elapsed = clock::now() - begin;
+		} while (elapsed.count() < 1.0);
+		double mb = src.size() / 1e6;
+		fmt::print("{:.2f} MB, {} passes, {:.3f} ms a pass, {:.1f} MB/s\n", mb, passes,
+				elapsed.count() * 1e3 / passes, mb * passes / elapsed.count());
+	}
+	
+	void bench_scan(const std::string &path) {
+		std::unique_ptr<MappedFile> file = read_file(path);
+		std::string_view src(file->data, file->size);
+		bench(src, [&] {
+			Scanner scanner(src);
+			while (scanner.scan_token().type != TokenType::END_OF_FILE) {}
+		});
+	}
+	
+	// every pass compiles the whole script with the VM's compiler
+	void bench_compile(VM &vm, const std::string &path) {
+		std::unique_ptr<MappedFile> file = read_file(path);
+		std::string_view src(file->data, file->size);
+		bench(src, [&] {
+			if (vm.compile(src) == nullptr) {
+				exit(65);
+			}
+		});
+	}
 }
 
 int main(int argc, const char *argv[]) {
+#ifdef __GLIBC__
+	// the passes over a big chunk make and free buffers of a few hundred KB
+	// over and over, which glibc would map and unmap fresh each time. It
+	// only raises its threshold on its own after freeing a bigger one, and
+	// with the source mapped there might not be one
+	mallopt(M_MMAP_THRESHOLD, 32 << 20);
+	mallopt(M_TRIM_THRESHOLD, 64 << 20);
+#endif
 	VM vm;
 	
-	if (argc == 1) {
+	bool dump_feedback = false;
+	bool emit = false;
+	bool bench_scanner = false;
+	bool bench_compiler = false;
+	bool use_cache = true;
+	std::string snapshot_path, write_snapshot_path;
+	std::vector<std::string> paths;
+	for (int i=1; i<argc; i++) {
+		std::string_view arg = argv[i];
+		if (arg == "--dump-feedback") {
+			dump_feedback = true;
+		}
+		else if (arg == "--emit-cpp") {
+			emit = true;
+		}
+		else if (arg == "--bench-scan") {
+			bench_scanner = true;
+		}
+		else if (arg == "--bench-compile") {
+			bench_compiler = true;
+		}
+		else if (arg == "--no-cache") {
+			use_cache = false;
+		}
+		else if (arg == "--lazy") {
+			vm.compiler_options.lazy = true;
+		}
+		else if (arg.starts_with("--snapshot=")) {
+			snapshot_path = arg.substr(arg.find('=') + 1);
+		}
+		else if (arg.starts_with("--write-snapshot=")) {
+			write_snapshot_path = arg.substr(arg.find('=') + 1);
+		}
+		else if (arg == "-O") {
+			vm.compiler_options.ssa = true;
+		}
+		else if (arg == "--no-peephole") {
+			vm.compiler_options.peephole = false;
+		}
+		else if (arg == "--no-inline") {
+			vm.compiler_options.inline_calls = false;
+		}
+		else if (arg == "--no-register-ops") {
+			vm.compiler_options.register_ops = false;
+		}
+		else if (arg == "--no-tail-calls") {
+			vm.compiler_options.tail_calls = false;
+		}
+		else if (arg == "--no-jit") {
+			vm.compiler_options.jit = false;
+		}
+		else if (arg.starts_with("--jit-threshold=")) {
+			vm.compiler_options.jit_threshold = std::stoul(std::string(arg.substr(arg.find('=') + 1)));
+		}
+		else if (arg == "--no-trace") {
+			vm.compiler_options.trace = false;
+		}
+		else if (arg.starts_with("--trace-threshold=")) {
+			vm.compiler_options.trace_threshold = std::stoul(std::string(arg.substr(arg.find('=') + 1)));
+		}
+		else if (arg.starts_with("--")) {
+			fmt::print(stderr, "Unknown option {}\n", arg);
+			exit(64);
+		}
+		else {
+			paths.emplace_back(arg);
+		}
+	}
+	
+	bool bench = bench_scanner || bench_compiler;
+	if (!snapshot_path.empty() && !emit && !bench && !load_snapshot(vm, snapshot_path)) {
+		fmt::print(stderr, "Could not load snapshot \"{}\".\n", snapshot_path);
+		exit(74);
+	}
+	if (paths.empty()) {
 		run_repl(vm);
+		if (dump_feedback) {
+			vm.dump_feedback();
+		}
+	}
+	else if (paths.size() == 1 && bench_scanner) {
+		bench_scan(paths[0]);
+	}
+	else if (paths.size() == 1 && bench_compiler) {
+		bench_compile(vm, paths[0]);
 	}
-	else if (argc == 2) {
-		run_file(vm, argv[1]);
+	else if (paths.size() == 1 && emit) {
+		emit_file(vm, paths[0]);
+	}
+	else if (paths.size() == 1) {
+		run_file(vm, paths[0], dump_feedback, use_cache);
 	}
 	else {
-		fmt::print(stderr, "Usage: lox [path]\n");
+		fmt::print(stderr, "Usage: lox [-O] [--dump-feedback] [--no-peephole] [--no-inline] [--no-register-ops]\n"
+				"           [--no-tail-calls] [--no-jit] [--jit-threshold=N] [--no-trace] [--trace-threshold=N] [--no-cache]\n"
+				"           [--lazy] [--snapshot=PATH] [--write-snapshot=PATH] [--emit-cpp] [--bench-scan] [--bench-compile] [path]\n");
 		exit(64);
 	}
+	if (!write_snapshot_path.empty() && !emit && !bench && !write_snapshot(vm, write_snapshot_path)) {
+		fmt::print(stderr, "Could not write snapshot \"{}\".\n", write_snapshot_path);
+		exit(74);
+	}
 	return 0;
 }
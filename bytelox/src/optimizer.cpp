@@ -0,0 +1,818 @@
+#include "optimizer.hpp"
+
+#include <algorithm>
+#include <optional>
+
+namespace bytelox {
+
+int jump_direction(u8 op) {
+	switch (op) {
+		case +OP::JUMP:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::LESS_LOCALS_JUMP:
+		case +OP::LESS_LOCAL_CONSTANT_JUMP:
+		case +OP::GUARD_CALL:
+		case +OP::GUARD_INVOKE:
+		case +OP::RETURN_INLINED:
+			return 1;
+		case +OP::LOOP:
+		case +OP::LOOP_TRACE:
+		case +OP::FOR_LOOP:
+		case +OP::FOR_LOOP_TRACE:
+			return -1;
+		default:
+			return 0;
+	}
+}
+
+namespace {
+
+constexpr std::pair<OP, OP> unchecked_forms[] = {
+	{OP::ADD, OP::ADD_UNCHECKED},
+	{OP::SUB, OP::SUB_UNCHECKED},
+	{OP::MUL, OP::MUL_UNCHECKED},
+	{OP::DIV, OP::DIV_UNCHECKED},
+	{OP::GREATER, OP::GREATER_UNCHECKED},
+	{OP::GREATER_EQUAL, OP::GREATER_EQUAL_UNCHECKED},
+	{OP::LESS, OP::LESS_UNCHECKED},
+	{OP::LESS_EQUAL, OP::LESS_EQUAL_UNCHECKED},
+};
+
+}
+
+u8 checked_form(u8 op) {
+	for (auto [checked, unchecked] : unchecked_forms) {
+		if (op == +unchecked) return +checked;
+	}
+	return op;
+}
+
+u8 unchecked_form(u8 op) {
+	for (auto [checked, unchecked] : unchecked_forms) {
+		if (op == +checked) return +unchecked;
+	}
+	return op;
+}
+
+bool stack_effect(const Instruction &ins, size_t &pops, size_t &pushes) {
+	pops = 0;
+	pushes = 0;
+	switch (checked_form(ins.op)) {
+		case +OP::CONSTANT:
+		case +OP::CONSTANT_LONG:
+		case +OP::NIL:
+		case +OP::TRUE:
+		case +OP::FALSE:
+		case +OP::GET_LOCAL:
+		case +OP::GET_GLOBAL:
+		case +OP::GET_UPVALUE:
+		case +OP::CLOSURE:
+		case +OP::CLASS:
+			pushes = 1;
+			return true;
+		case +OP::POP:
+		case +OP::DEFINE_GLOBAL:
+		case +OP::PRINT:
+		case +OP::CLOSE_UPVALUE:
+		case +OP::RETURN:
+			pops = 1;
+			return true;
+		case +OP::SET_LOCAL:
+		case +OP::SET_GLOBAL:
+		case +OP::SET_UPVALUE:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::GET_PROPERTY:
+		case +OP::NOT:
+		case +OP::NEGATE:
+			pops = 1;
+			pushes = 1;
+			return true;
+		case +OP::JUMP:
+		case +OP::LOOP:
+			return true;
+		case +OP::SET_PROPERTY:
+		case +OP::GET_SUPER:
+		case +OP::INHERIT: // reads the superclass below the subclass it pops
+		case +OP::METHOD:  // adds to the class below the method it pops
+		case +OP::EQUAL:
+		case +OP::NOT_EQUAL:
+		case +OP::GREATER:
+		case +OP::GREATER_EQUAL:
+		case +OP::LESS:
+		case +OP::LESS_EQUAL:
+		case +OP::ADD:
+		case +OP::SUB:
+		case +OP::MUL:
+		case +OP::DIV:
+			pops = 2;
+			pushes = 1;
+			return true;
+		case +OP::CALL:
+			pops = ins.operands[0] + 1;
+			pushes = 1;
+			return true;
+		case +OP::INVOKE:
+			pops = ins.operands[1] + 1;
+			pushes = 1;
+			return true;
+		case +OP::SUPER_INVOKE:
+			pops = ins.operands[1] + 2;
+			pushes = 1;
+			return true;
+		case +OP::GUARD_CALL:
+		case +OP::GUARD_INVOKE:
+			pops = ins.operands.back() + 1;
+			pushes = pops;
+			return true;
+		case +OP::RETURN_INLINED:
+			pops = ins.operands[0] + 1;
+			pushes = 1;
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool is_unconditional(u8 op) {
+	return op == +OP::JUMP || op == +OP::LOOP || op == +OP::RETURN || op == +OP::RETURN_INLINED;
+}
+
+std::vector<int> stack_heights(std::vector<Instruction> &code, int arity) {
+	std::vector<int> heights(code.size(), -1);
+	std::vector<std::pair<size_t, int>> work{{0, arity + 1}};
+	while (!work.empty()) {
+		auto [i, height] = work.back();
+		work.pop_back();
+		for (; i<code.size(); i++) {
+			if (heights[i] != -1) {
+				if (heights[i] != height) return {};
+				break;
+			}
+			heights[i] = height;
+			size_t pops, pushes;
+			if (!stack_effect(code[i], pops, pushes) || static_cast<size_t>(height) < pops) return {};
+			height += static_cast<int>(pushes) - static_cast<int>(pops);
+			if (code[i].target != -1) work.push_back({code[i].target, height});
+			if (is_unconditional(code[i].op)) break;
+		}
+	}
+	return heights;
+}
+
+size_t jump_target(Chunk &chunk, size_t offset) {
+	bool wide = chunk.code[offset] == +OP::WIDE;
+	size_t field = offset + chunk.instruction_size(offset) - (wide ? 4 : 2);
+	u32 jump = chunk.code[field] | (chunk.code[field + 1] << 8);
+	if (wide) jump |= (chunk.code[field + 2] << 16) | (chunk.code[field + 3] << 24);
+	return jump_direction(chunk.code[wide ? offset + 1 : offset]) > 0 ? field + jump : field - jump;
+}
+
+std::vector<Instruction> decode_chunk(Chunk &chunk) {
+	std::vector<Instruction> instructions;
+	std::vector<int> index_at(chunk.code.size() + 1, -1);
+	auto line = chunk.lines.begin();
+	for (size_t offset = 0; offset < chunk.code.size();) {
+		size_t size = chunk.instruction_size(offset);
+		Instruction &ins = instructions.emplace_back();
+		index_at[offset] = instructions.size() - 1;
+		while (std::next(line) != chunk.lines.end() && std::next(line)->start <= offset) line++;
+		ins.line = line->line;
+		ins.wide = chunk.code[offset] == +OP::WIDE;
+		size_t operands_start = offset + (ins.wide ? 2 : 1);
+		ins.op = chunk.code[operands_start - 1];
+		size_t operands_end = offset + size;
+		if (jump_direction(ins.op) != 0) {
+			operands_end -= ins.wide ? 4 : 2;
+			ins.target = jump_target(chunk, offset); // offset for now
+		}
+		ins.operands.assign(chunk.code.begin() + operands_start, chunk.code.begin() + operands_end);
+		offset += size;
+	}
+	index_at[chunk.code.size()] = instructions.size();
+
+	for (Instruction &ins : instructions) {
+		if (ins.target != -1) {
+			ins.target = index_at[ins.target];
+		}
+	}
+	return instructions;
+}
+
+void encode_chunk(Chunk &chunk, std::vector<Instruction> &instructions) {
+	// removed instructions take the position of the next kept instruction,
+	// so jumps to them fall through to whatever follows
+	std::vector<size_t> position(instructions.size() + 1);
+	// offset field of each jump is at
+	auto field_of = [&](size_t i) {
+		Instruction &ins = instructions[i];
+		return position[i] + (ins.wide ? 2 : 1) + ins.operands.size();
+	};
+	// widening a jump moves everything after it, which can take other jumps
+	// out of range, so lay out again until none are
+	for (bool widened = true; widened;) {
+		size_t offset = 0;
+		for (size_t i=0; i<instructions.size(); i++) {
+			position[i] = offset;
+			Instruction &ins = instructions[i];
+			if (ins.removed) continue;
+			offset += (ins.wide ? 2 : 1) + ins.operands.size() + (ins.target == -1 ? 0 : ins.wide ? 4 : 2);
+		}
+		position[instructions.size()] = offset;
+
+		widened = false;
+		for (size_t i=0; i<instructions.size(); i++) {
+			Instruction &ins = instructions[i];
+			if (ins.removed || ins.target == -1 || ins.wide) continue;
+			size_t field = field_of(i);
+			size_t distance = jump_direction(ins.op) > 0 ? position[ins.target] - field : field - position[ins.target];
+			if (distance > UINT16_MAX && (ins.op == +OP::JUMP || ins.op == +OP::JUMP_IF_FALSE || ins.op == +OP::LOOP)) {
+				ins.wide = true;
+				widened = true;
+			}
+		}
+	}
+
+	chunk.code.clear();
+	chunk.lines.clear();
+	for (size_t i=0; i<instructions.size(); i++) {
+		Instruction &ins = instructions[i];
+		if (ins.removed) continue;
+		if (ins.wide) chunk.write(+OP::WIDE, ins.line);
+		chunk.write(ins.op, ins.line);
+		for (u8 byte : ins.operands) {
+			chunk.write(byte, ins.line);
+		}
+		if (ins.target != -1) {
+			size_t field = field_of(i);
+			u32 jump = jump_direction(ins.op) > 0 ?
+					position[ins.target] - field : field - position[ins.target];
+			for (int byte = 0; byte < (ins.wide ? 4 : 2); byte++) {
+				chunk.write((jump >> (8 * byte)) & 0xFF, ins.line);
+			}
+		}
+	}
+}
+
+void widen_far_jumps(Chunk &chunk, const std::vector<std::pair<size_t, size_t>> &far_jumps) {
+	std::vector<Instruction> code = decode_chunk(chunk);
+	std::vector<int> index_at(chunk.code.size() + 1, -1);
+	int index = 0;
+	for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+		index_at[offset] = index++;
+	}
+	index_at[chunk.code.size()] = index;
+	for (auto [at, target] : far_jumps) {
+		code[index_at[at]].target = index_at[target];
+	}
+	encode_chunk(chunk, code);
+}
+
+namespace {
+
+struct Fuser {
+	Chunk &chunk;
+	std::vector<Instruction> code;
+	std::vector<int> jumps_to; // number of jumps landing on each instruction
+
+	Fuser(Chunk &chunk): chunk(chunk), code(decode_chunk(chunk)), jumps_to(code.size() + 1, 0) {
+		for (Instruction &ins : code) {
+			if (ins.target != -1) jumps_to[ins.target]++;
+		}
+	}
+
+	// checks that code[i..i+ops.size()) has the ops given, and that only the
+	// first instruction can be jumped to
+	bool matches(size_t i, std::initializer_list<OP> ops) {
+		if (i + ops.size() > code.size()) return false;
+		size_t first = i;
+		for (OP op : ops) {
+			// fused ops check types anyway
+			if (code[i].removed || checked_form(code[i].op) != +op) return false;
+			if (i != first && jumps_to[i] > 0) return false;
+			i++;
+		}
+		return true;
+	}
+
+	// replaces code[i..i+length) with one instruction
+	void fuse(size_t i, size_t length, OP op, std::vector<u8> operands, u32 line) {
+		code[i].op = +op;
+		code[i].operands = std::move(operands);
+		code[i].line = line;
+		code[i].target = -1;
+		for (size_t j=i+1; j<i+length; j++) {
+			code[j].removed = true;
+		}
+	}
+
+	// A condition followed by JUMP_IF_FALSE, POP leaves the condition on the
+	// stack when jumping, for a POP at the target. A fused compare and jump
+	// never pushes the condition, so it can only be used when that POP is
+	// reached by nothing else, and then skips past it.
+	bool can_skip_pop(int target) {
+		return target > 0 && static_cast<size_t>(target) < code.size() &&
+				!code[target].removed && code[target].op == +OP::POP && jumps_to[target] == 1 &&
+				(code[target - 1].op == +OP::JUMP || code[target - 1].op == +OP::LOOP ||
+				code[target - 1].op == +OP::RETURN);
+	}
+
+	void fuse_compare_jump(size_t i, OP op) {
+		int target = code[i + 3].target;
+		std::vector<u8> operands{code[i].operands[0], code[i + 1].operands[0]};
+		fuse(i, 5, op, operands, code[i + 2].line);
+		code[i].target = target + 1;
+		code[target].removed = true;
+		jumps_to[target]--;
+		jumps_to[target + 1]++;
+	}
+
+	// returns number of instructions consumed
+	size_t fuse_at(size_t i) {
+		using enum OP;
+		if (matches(i, {GET_LOCAL, CONSTANT, LESS, JUMP_IF_FALSE, POP}) && can_skip_pop(code[i + 3].target)) {
+			fuse_compare_jump(i, LESS_LOCAL_CONSTANT_JUMP);
+			return 5;
+		}
+		if (matches(i, {GET_LOCAL, GET_LOCAL, LESS, JUMP_IF_FALSE, POP}) && can_skip_pop(code[i + 3].target)) {
+			fuse_compare_jump(i, LESS_LOCALS_JUMP);
+			return 5;
+		}
+		if (matches(i, {GET_LOCAL, GET_LOCAL, ADD})) {
+			fuse(i, 3, ADD_LOCALS, {code[i].operands[0], code[i + 1].operands[0]}, code[i + 2].line);
+			return 3;
+		}
+		if (matches(i, {GET_LOCAL, CONSTANT, ADD})) {
+			fuse(i, 3, ADD_LOCAL_CONSTANT, {code[i].operands[0], code[i + 1].operands[0]}, code[i + 2].line);
+			return 3;
+		}
+		if (matches(i, {GET_LOCAL, CONSTANT, SUB})) {
+			fuse(i, 3, SUB_LOCAL_CONSTANT, {code[i].operands[0], code[i + 1].operands[0]}, code[i + 2].line);
+			return 3;
+		}
+		if (matches(i, {GET_LOCAL, GET_PROPERTY})) {
+			fuse(i, 2, GET_LOCAL_PROPERTY, {code[i].operands[0], code[i + 1].operands[0]}, code[i + 1].line);
+			return 2;
+		}
+		if (matches(i, {SET_LOCAL, POP})) {
+			fuse(i, 2, SET_LOCAL_POP, code[i].operands, code[i].line);
+			return 2;
+		}
+		return 1;
+	}
+
+	// first instruction at or after i that isn't removed
+	size_t live_at(size_t i) {
+		while (i < code.size() && code[i].removed) i++;
+		return i;
+	}
+
+	// A for loop whose condition fused to a less than jump, and whose
+	// increment lowered to adding a number constant to the counter:
+	//
+	//         LESS_LOCALS_JUMP i, n -> exit
+	//         JUMP -> body
+	//   incr: ADD_R i = i + step
+	//         LOOP -> condition
+	//   body: ...
+	//         LOOP -> incr
+	//   exit:
+	//
+	// keeps the condition for the first iteration, and ends the body with a
+	// FOR_LOOP doing the increment, the condition and the jump back at once.
+	// Any other LOOP to the increment jumps forward to the FOR_LOOP instead.
+	void fuse_counted_loop(size_t condition) {
+		Instruction &test = code[condition];
+		if (test.removed || (test.op != +OP::LESS_LOCALS_JUMP && test.op != +OP::LESS_LOCAL_CONSTANT_JUMP)) return;
+		size_t skip = live_at(condition + 1);
+		size_t increment = live_at(skip + 1);
+		size_t back = live_at(increment + 1);
+		size_t body = live_at(back + 1);
+		size_t exit = live_at(test.target);
+		if (body >= exit || exit > code.size()) return;
+		if (code[skip].op != +OP::JUMP || live_at(code[skip].target) != body || jumps_to[skip] > 0) return;
+		if (code[back].op != +OP::LOOP || code[back].target != static_cast<int>(condition) ||
+				jumps_to[back] > 0 || jumps_to[increment] == 0) {
+			return;
+		}
+
+		Instruction &add = code[increment];
+		u8 counter = test.operands[0];
+		u8 add_mode = +RegisterKind::LOCAL | (+RegisterKind::CONSTANT << 2) | (+RegisterKind::LOCAL << 4);
+		if (add.op != +OP::ADD_R || (add.operands[0] & ~UNCHECKED_NUMBERS) != add_mode ||
+				add.operands[1] != counter || add.operands[2] != counter || add.line != test.line ||
+				!chunk.constants[add.operands[3]].is_number()) {
+			return;
+		}
+
+		// every way back to the increment has to be a LOOP from the body, the
+		// last of them right before the exit
+		size_t end = 0;
+		int loops = 0;
+		for (size_t i=body; i<exit; i++) {
+			if (code[i].removed || code[i].target != static_cast<int>(increment)) continue;
+			if (code[i].op != +OP::LOOP) return;
+			end = i;
+			loops++;
+		}
+		if (loops != jumps_to[increment] || live_at(end + 1) != exit) return;
+
+		for (size_t i=body; i<end; i++) {
+			if (code[i].removed || code[i].target != static_cast<int>(increment)) continue;
+			code[i].op = +OP::JUMP;
+			code[i].target = end;
+			jumps_to[end]++;
+		}
+		u8 bound = +(test.op == +OP::LESS_LOCALS_JUMP ? RegisterKind::LOCAL : RegisterKind::CONSTANT);
+		code[end].op = +OP::FOR_LOOP;
+		code[end].operands = {bound, counter, add.operands[3], test.operands[1]};
+		code[end].target = body;
+		code[end].line = add.line;
+		jumps_to[increment] = 0;
+		jumps_to[condition]--;
+		code[skip].removed = true;
+		code[increment].removed = true;
+		code[back].removed = true;
+	}
+};
+
+}
+
+namespace {
+
+// A value on the stack, as far as lowering is concerned. LOCAL and CONSTANT
+// operands are pushed by a GET_LOCAL or CONSTANT that can still be removed.
+struct Operand {
+	RegisterKind kind;
+	u8 index = 0;
+	size_t instruction; // instruction that pushed this
+	int slot = -1;      // where it is on the stack, before any loads are removed
+};
+
+u8 register_mode(RegisterKind lhs, RegisterKind rhs, RegisterKind dst) {
+	return +lhs | (+rhs << 2) | (+dst << 4);
+}
+
+// A lowered arithmetic op, kept so it can be undone
+struct Lowered {
+	size_t instruction;
+	u8 op;
+	Operand lhs, rhs;
+};
+
+// The superinstructions already cover these without decoding a mode byte,
+// so they're only worth lowering when the result goes straight to a local,
+// or when the register op can skip the type checks the superinstruction
+// would do.
+bool fuser_covers(const Lowered &lowered) {
+	using enum RegisterKind;
+	if (lowered.lhs.kind != LOCAL || lowered.op != checked_form(lowered.op)) return false;
+	if (lowered.op == +OP::ADD) return lowered.rhs.kind == LOCAL || lowered.rhs.kind == CONSTANT;
+	if (lowered.op == +OP::SUB) return lowered.rhs.kind == CONSTANT;
+	return false;
+}
+
+}
+
+namespace {
+
+std::optional<LoxValue> pushed_constant(Chunk &chunk, const Instruction &ins) {
+	switch (ins.op) {
+		case +OP::CONSTANT: return chunk.constants[ins.operands[0]];
+		case +OP::NIL: return LoxValue();
+		case +OP::TRUE: return LoxValue(true);
+		case +OP::FALSE: return LoxValue(false);
+		default: return std::nullopt;
+	}
+}
+
+bool is_falsey_constant(LoxValue value) {
+	return value.is_nil() || (value.is_bool() && !value.as.boolean);
+}
+
+// op applied to constants, if it can't fail at runtime. Folding into
+// strings would need the VM to intern them, so it's left to runtime.
+std::optional<LoxValue> fold(u8 op, LoxValue a, LoxValue b) {
+	bool numbers = a.is_number() && b.is_number();
+	double x = a.as.number, y = b.as.number;
+	switch (op) {
+		case +OP::EQUAL: return LoxValue(a == b);
+		case +OP::NOT_EQUAL: return LoxValue(a != b);
+		default: break;
+	}
+	if (!numbers) return std::nullopt;
+	switch (op) {
+		case +OP::GREATER: return LoxValue(x > y);
+		case +OP::GREATER_EQUAL: return LoxValue(x >= y);
+		case +OP::LESS: return LoxValue(x < y);
+		case +OP::LESS_EQUAL: return LoxValue(x <= y);
+		case +OP::ADD: return LoxValue(x + y);
+		case +OP::SUB: return LoxValue(x - y);
+		case +OP::MUL: return LoxValue(x * y);
+		case +OP::DIV: return LoxValue(x / y);
+		default: return std::nullopt;
+	}
+}
+
+struct Peephole {
+	Chunk &chunk;
+	std::vector<Instruction> code;
+	std::vector<int> jumps_to;
+	bool changed = false;
+
+	Peephole(Chunk &chunk): chunk(chunk), code(decode_chunk(chunk)), jumps_to(code.size() + 1, 0) {
+		for (Instruction &ins : code) {
+			if (ins.target != -1) jumps_to[ins.target]++;
+		}
+	}
+
+	// instructions i+1 to i+length-1 can only be reached from i
+	bool straight(size_t i, size_t length) {
+		if (i + length > code.size()) return false;
+		for (size_t j=i; j<i+length; j++) {
+			if (code[j].removed || (j != i && jumps_to[j] > 0)) return false;
+		}
+		return true;
+	}
+
+	void remove(size_t i) {
+		code[i].removed = true;
+		changed = true;
+	}
+
+	// replaces code[i] with an instruction pushing value, if that can be done without a new long constant
+	bool push(size_t i, LoxValue value) {
+		Instruction &ins = code[i];
+		ins.target = -1;
+		if (value.is_nil()) ins.op = +OP::NIL;
+		else if (value.is_bool()) ins.op = value.as.boolean ? +OP::TRUE : +OP::FALSE;
+		ins.operands.clear();
+		if (!value.is_number()) {
+			changed = true;
+			return true;
+		}
+
+		size_t index = 0;
+		while (index < chunk.constants.size() && !(chunk.constants[index].is_number() &&
+				std::bit_cast<u64>(chunk.constants[index].as.number) == std::bit_cast<u64>(value.as.number))) {
+			index++;
+		}
+		if (index > UINT8_MAX) return false;
+		if (index == chunk.constants.size()) chunk.add_constant(value);
+		ins.op = +OP::CONSTANT;
+		ins.operands = {static_cast<u8>(index)};
+		changed = true;
+		return true;
+	}
+
+	void fold_constants(size_t i) {
+		if (code[i].op == +OP::GET_LOCAL && straight(i, 2) && code[i + 1].op == +OP::POP) {
+			remove(i);
+			remove(i + 1);
+			return;
+		}
+		std::optional<LoxValue> a = pushed_constant(chunk, code[i]);
+		if (!a || !straight(i, 2)) return;
+		u8 op = code[i + 1].op;
+		u32 line = code[i + 1].line;
+		if (op == +OP::NOT || (op == +OP::NEGATE && a->is_number())) {
+			Instruction saved = code[i];
+			LoxValue result = op == +OP::NOT ? LoxValue(is_falsey_constant(*a)) : LoxValue(a->as.number * -1);
+			if (!push(i, result)) {
+				code[i] = saved;
+				return;
+			}
+			code[i].line = line;
+			remove(i + 1);
+			return;
+		}
+		if (op == +OP::JUMP_IF_FALSE) {
+			// the condition stays on the stack for whatever pops it
+			if (is_falsey_constant(*a)) code[i + 1].op = +OP::JUMP;
+			else remove(i + 1);
+			changed = true;
+			return;
+		}
+		if (op == +OP::POP) {
+			remove(i);
+			remove(i + 1);
+			return;
+		}
+		std::optional<LoxValue> b = pushed_constant(chunk, code[i + 1]);
+		if (!b || !straight(i, 3)) return;
+		std::optional<LoxValue> result = fold(checked_form(code[i + 2].op), *a, *b);
+		if (!result) return;
+		Instruction saved = code[i];
+		if (!push(i, *result)) {
+			code[i] = saved;
+			return;
+		}
+		code[i].line = code[i + 2].line;
+		remove(i + 1);
+		remove(i + 2);
+	}
+
+	// where a jump from code[i] to target ends up after any jumps it lands on
+	int thread(size_t i, int target) {
+		u8 op = code[i].op;
+		for (size_t hops = 0; hops < code.size() && static_cast<size_t>(target) < code.size(); hops++) {
+			Instruction &landing = code[target];
+			bool follow = landing.op == +OP::JUMP || (op == +OP::JUMP_IF_FALSE && landing.op == +OP::JUMP_IF_FALSE);
+			if (!follow || landing.target == target) break;
+			target = landing.target;
+		}
+		return target;
+	}
+
+	void thread_jump(size_t i) {
+		Instruction &ins = code[i];
+		if (ins.op != +OP::JUMP && ins.op != +OP::JUMP_IF_FALSE && ins.op != +OP::LOOP) return;
+		int target = thread(i, ins.target);
+		// the jump's direction is part of its opcode
+		bool forward = static_cast<size_t>(target) > i;
+		if (target != ins.target && forward == (jump_direction(ins.op) > 0)) {
+			jumps_to[ins.target]--;
+			jumps_to[target]++;
+			ins.target = target;
+			changed = true;
+		}
+		// a jump to the next instruction goes there anyway, and JUMP_IF_FALSE doesn't pop
+		if (ins.op != +OP::LOOP && static_cast<size_t>(ins.target) == i + 1) {
+			jumps_to[ins.target]--;
+			remove(i);
+		}
+	}
+
+	void remove_unreachable() {
+		std::vector<bool> reachable(code.size(), false);
+		std::vector<size_t> work{0};
+		while (!work.empty()) {
+			size_t i = work.back();
+			work.pop_back();
+			if (i >= code.size() || reachable[i]) continue;
+			reachable[i] = true;
+			if (!is_unconditional(code[i].op)) work.push_back(i + 1);
+			if (code[i].target != -1) work.push_back(code[i].target);
+		}
+		for (size_t i=0; i<code.size(); i++) {
+			if (!reachable[i] && !code[i].removed) remove(i);
+		}
+	}
+
+	bool run() {
+		for (size_t i=0; i<code.size(); i++) {
+			if (code[i].removed) continue;
+			fold_constants(i);
+			if (!code[i].removed) thread_jump(i);
+		}
+		remove_unreachable();
+		if (changed) encode_chunk(chunk, code);
+		return changed;
+	}
+};
+
+}
+
+void optimize_chunk(Chunk &chunk) {
+	while (Peephole(chunk).run()) {}
+}
+
+void lower_to_register_ops(Chunk &chunk, int arity) {
+	std::vector<Instruction> code = decode_chunk(chunk);
+	std::vector<int> heights = stack_heights(code, arity);
+	if (heights.empty()) return;
+	std::vector<bool> is_target(code.size() + 1, false);
+	for (Instruction &ins : code) {
+		if (ins.target != -1) is_target[ins.target] = true;
+	}
+
+	// values pushed since anything other than loads and arithmetic ran.
+	// Only these can be folded into a register op, which keeps every read of a
+	// local in the same order relative to every write.
+	std::vector<Operand> operands;
+	std::vector<Lowered> lowered_ops;
+	for (size_t i=0; i<code.size(); i++) {
+		Instruction &ins = code[i];
+		if (is_target[i]) operands.clear();
+
+		switch (ins.op) {
+			case +OP::GET_LOCAL:
+			case +OP::CONSTANT: {
+				// a removed load can still be jumped to, the jump lands on the
+				// next instruction kept, which is where falling through goes too
+				RegisterKind kind = ins.op == +OP::GET_LOCAL ? RegisterKind::LOCAL : RegisterKind::CONSTANT;
+				// removing a load moves everything above it down a slot, so a
+				// read of a temporary above one has to keep it
+				if (kind == RegisterKind::LOCAL && std::any_of(operands.begin(), operands.end(),
+						[&](Operand &operand) { return operand.kind != RegisterKind::STACK && operand.slot <= ins.operands[0]; })) {
+					operands.clear();
+				}
+				operands.push_back({kind, ins.operands[0], i, heights[i]});
+				break;
+			}
+			case +OP::ADD:
+			case +OP::SUB:
+			case +OP::MUL:
+			case +OP::DIV:
+			case +OP::ADD_UNCHECKED:
+			case +OP::SUB_UNCHECKED:
+			case +OP::MUL_UNCHECKED:
+			case +OP::DIV_UNCHECKED: {
+				if (operands.size() < 2) {
+					operands.clear();
+					break;
+				}
+				Operand rhs = operands.back();
+				operands.pop_back();
+				Operand lhs = operands.back();
+				operands.pop_back();
+				if (lhs.kind == RegisterKind::STACK && rhs.kind == RegisterKind::STACK) {
+					operands.push_back({RegisterKind::STACK, 0, i, lhs.slot});
+					break;
+				}
+				for (Operand *operand : {&lhs, &rhs}) {
+					if (operand->kind != RegisterKind::STACK) code[operand->instruction].removed = true;
+				}
+				lowered_ops.push_back({i, ins.op, lhs, rhs});
+				constexpr std::pair<OP, OP> lowered[] = {
+					{OP::ADD, OP::ADD_R}, {OP::SUB, OP::SUB_R}, {OP::MUL, OP::MUL_R}, {OP::DIV, OP::DIV_R},
+				};
+				u8 mode = register_mode(lhs.kind, rhs.kind, RegisterKind::STACK);
+				if (ins.op != checked_form(ins.op)) mode |= UNCHECKED_NUMBERS;
+				for (auto [op, register_op] : lowered) {
+					if (checked_form(ins.op) == +op) ins.op = +register_op;
+				}
+				ins.operands = {mode, 0, lhs.index, rhs.index};
+				operands.push_back({RegisterKind::STACK, 0, i, lhs.slot});
+				break;
+			}
+			case +OP::SET_LOCAL: {
+				bool pops = i + 1 < code.size() && code[i + 1].op == +OP::POP && !is_target[i + 1];
+				if (!pops || operands.empty()) {
+					operands.clear();
+					break;
+				}
+				Operand value = operands.back();
+				Instruction &producer = code[value.instruction];
+				if (value.kind != RegisterKind::STACK) {
+					// a = b; or a = 1;
+					producer.op = +OP::MOVE;
+					producer.operands = {register_mode(value.kind, RegisterKind::STACK, RegisterKind::LOCAL),
+							ins.operands[0], value.index};
+					producer.removed = false;
+				}
+				else if (producer.op == +OP::ADD_R || producer.op == +OP::SUB_R ||
+						producer.op == +OP::MUL_R || producer.op == +OP::DIV_R) {
+					// store the result straight into the local
+					producer.operands[0] |= +RegisterKind::LOCAL << 4;
+					producer.operands[1] = ins.operands[0];
+				}
+				else {
+					operands.clear();
+					break;
+				}
+				ins.removed = true;
+				code[i + 1].removed = true;
+				i++;
+				operands.clear();
+				break;
+			}
+			default:
+				operands.clear();
+				break;
+		}
+	}
+
+	for (Lowered &lowered : lowered_ops) {
+		Instruction &ins = code[lowered.instruction];
+		if (static_cast<RegisterKind>((ins.operands[0] >> 4) & 3) != RegisterKind::STACK || !fuser_covers(lowered)) {
+			continue;
+		}
+		ins.op = lowered.op;
+		ins.operands.clear();
+		code[lowered.lhs.instruction].removed = false;
+		code[lowered.rhs.instruction].removed = false;
+	}
+	encode_chunk(chunk, code);
+}
+
+void fuse_superinstructions(Chunk &chunk) {
+	Fuser fuser(chunk);
+	for (size_t i=0; i<fuser.code.size();) {
+		i += fuser.fuse_at(i);
+	}
+	for (size_t i=0; i<fuser.code.size(); i++) {
+		fuser.fuse_counted_loop(i);
+	}
+	encode_chunk(chunk, fuser.code);
+}
+
+void mark_tail_calls(Chunk &chunk) {
+	for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+		// same size as the CALL, so nothing moves
+		if (chunk.code[offset] == +OP::CALL && chunk.code[offset + 2] == +OP::RETURN) {
+			chunk.code[offset] = +OP::TAIL_CALL;
+		}
+	}
+}
+
+}
@@ -1,24 +1,192 @@
 #include "scanner.hpp"
+#include "serialize.hpp"
 
-#include <cstring> // memcmp
+#include <algorithm>
+#include <array>
+#include <bit>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace bytelox {
 
 using enum TokenType;
 
+namespace {
+
+enum CharClass: u8 {
+	WHITESPACE = 1,
+	IDENTIFIER_START = 2,
+	IDENTIFIER_CHAR = 4,
+	DIGIT = 8,
+};
+
+constexpr std::array<u8, 256> CHAR_CLASS = [] {
+	std::array<u8, 256> classes{};
+	for (char c : {' ', '\t', '\r', '\n'}) {
+		classes[c] = WHITESPACE;
+	}
+	for (int c='a'; c<='z'; c++) {
+		classes[c] = classes[c - 'a' + 'A'] = IDENTIFIER_START | IDENTIFIER_CHAR;
+	}
+	classes['_'] = IDENTIFIER_START | IDENTIFIER_CHAR;
+	for (int c='0'; c<='9'; c++) {
+		classes[c] = IDENTIFIER_CHAR | DIGIT;
+	}
+	return classes;
+}();
+
+bool is(char c, u8 char_class) {
+	return (CHAR_CLASS[static_cast<u8>(c)] & char_class) != 0;
+}
+
+// Long runs of whitespace, comments, strings and identifiers are scanned a
+// block of bytes at a time, each test on a block giving a mask with a bit
+// per byte it holds for. Byte is a block of one, for the bytes after the
+// last whole block and for machines without SIMD.
+struct Byte {
+	static constexpr int SIZE = 1;
+	static constexpr u32 ALL = 1;
+	char c;
+
+	explicit Byte(const char *at): c(*at) {}
+	[[nodiscard]] u32 eq(char x) const { return c == x; }
+	[[nodiscard]] u32 whitespace() const { return is(c, WHITESPACE); }
+	[[nodiscard]] u32 identifier_char() const { return is(c, IDENTIFIER_CHAR); }
+};
+
+#if defined(__AVX2__)
+struct Block {
+	static constexpr int SIZE = 32;
+	static constexpr u32 ALL = 0xffffffff;
+	__m256i bytes;
+
+	explicit Block(const char *at): bytes(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(at))) {}
+	[[nodiscard]] u32 eq(char x) const {
+		return _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(x)));
+	}
+	// bytes from lo to hi, shifting lo down to the lowest signed byte for one
+	// signed compare
+	[[nodiscard]] u32 in(char lo, char hi) const {
+		__m256i shifted = _mm256_add_epi8(bytes, _mm256_set1_epi8(static_cast<char>(0x80 - lo)));
+		__m256i bound = _mm256_set1_epi8(static_cast<char>(0x80 + hi - lo + 1));
+		return _mm256_movemask_epi8(_mm256_cmpgt_epi8(bound, shifted));
+	}
+	[[nodiscard]] u32 whitespace() const { return eq(' ') | eq('\t') | eq('\r') | eq('\n'); }
+	[[nodiscard]] u32 identifier_char() const { return in('a', 'z') | in('A', 'Z') | in('0', '9') | eq('_'); }
+};
+#elif defined(__SSE2__)
+struct Block {
+	static constexpr int SIZE = 16;
+	static constexpr u32 ALL = 0xffff;
+	__m128i bytes;
+
+	explicit Block(const char *at): bytes(_mm_loadu_si128(reinterpret_cast<const __m128i *>(at))) {}
+	[[nodiscard]] u32 eq(char x) const {
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(x)));
+	}
+	// bytes from lo to hi, shifting lo down to the lowest signed byte for one
+	// signed compare
+	[[nodiscard]] u32 in(char lo, char hi) const {
+		__m128i shifted = _mm_add_epi8(bytes, _mm_set1_epi8(static_cast<char>(0x80 - lo)));
+		__m128i bound = _mm_set1_epi8(static_cast<char>(0x80 + hi - lo + 1));
+		return _mm_movemask_epi8(_mm_cmplt_epi8(shifted, bound));
+	}
+	[[nodiscard]] u32 whitespace() const { return eq(' ') | eq('\t') | eq('\r') | eq('\n'); }
+	[[nodiscard]] u32 identifier_char() const { return in('a', 'z') | in('A', 'Z') | in('0', '9') | eq('_'); }
+};
+#endif
+
+// Moves at past the bytes of whole B blocks until stop marks one, adding the
+// newlines it passes to line. Leaves at on the marked byte, or on the first
+// byte of the last partial block.
+template <typename B, bool count_lines, typename Stop>
+void scan_blocks(const char *&at, const char *end, int &line, Stop stop) {
+	for (; end - at >= B::SIZE; at += B::SIZE) {
+		B block(at);
+		u32 stops = stop(block);
+		if (stops != 0) {
+			int index = std::countr_zero(stops);
+			if constexpr (count_lines) line += std::popcount(block.eq('\n') & ((1u << index) - 1));
+			at += index;
+			return;
+		}
+		if constexpr (count_lines) line += std::popcount(block.eq('\n'));
+	}
+}
+
+// the offset of the first byte of src from offset that stop marks, or its size
+template <bool count_lines, typename Stop>
+int scan_until(std::string_view src, int offset, int &line, Stop stop) {
+	const char *at = src.data() + offset;
+	const char *end = src.data() + src.size();
+#if defined(__AVX2__) || defined(__SSE2__)
+	scan_blocks<Block, count_lines>(at, end, line, stop);
+#endif
+	scan_blocks<Byte, count_lines>(at, end, line, stop);
+	return static_cast<int>(at - src.data());
+}
+
+// most identifiers are shorter, and quicker to scan a byte at a time than
+// to load a block for
+constexpr int SHORT_IDENTIFIER = 8;
+
+struct Keyword {
+	std::string_view text;
+	TokenType type = IDENTIFIER;
+};
+
+constexpr Keyword KEYWORDS[] = {
+	{"and", AND}, {"class", CLASS}, {"else", ELSE}, {"false", FALSE},
+	{"for", FOR}, {"fun", FUN}, {"if", IF}, {"nil", NIL},
+	{"or", OR}, {"print", PRINT}, {"return", RETURN}, {"super", SUPER},
+	{"this", THIS}, {"true", TRUE}, {"var", VAR}, {"while", WHILE},
+};
+
+constexpr size_t KEYWORD_MIN = 2;
+constexpr size_t KEYWORD_MAX = 6;
+
+// different for every keyword, so one compare tells if a word is one
+constexpr size_t keyword_hash(char first, char last, size_t length) {
+	return (static_cast<u8>(first) + static_cast<u8>(last) * 5 + length) & 31;
+}
+
+constexpr std::array<Keyword, 32> KEYWORD_TABLE = [] {
+	std::array<Keyword, 32> table{};
+	for (Keyword keyword : KEYWORDS) {
+		if (keyword.text.size() < KEYWORD_MIN || keyword.text.size() > KEYWORD_MAX) {
+			throw "keyword_hash needs KEYWORD_MIN and KEYWORD_MAX updated";
+		}
+		Keyword &slot = table[keyword_hash(keyword.text.front(), keyword.text.back(), keyword.text.size())];
+		if (!slot.text.empty()) {
+			throw "keyword_hash needs to be changed for the new keyword";
+		}
+		slot = keyword;
+	}
+	return table;
+}();
+
+}
+
 Scanner::Scanner(std::string_view src): src(src) { }
 
 Token Scanner::scan_token() {
 	skip_whitespace();
 	start = current;
+	if (file != nullptr) {
+		file->release_before(src.data() + start);
+	}
 	if (is_at_end()) {
 		return make_token(END_OF_FILE);
 	}
 	char c = advance();
-	if (isalpha(c) || c == '_') {
+	if (is(c, IDENTIFIER_START)) {
 		return identifier();
 	}
-	if (isdigit(c)) {
+	if (is(c, DIGIT)) {
 		return number();
 	}
 	switch (c) {
@@ -43,7 +211,7 @@ Token Scanner::scan_token() {
 }
 
 Token Scanner::make_token(TokenType type) {
-	return {type, src.substr(start, current - start), line};
+	return {type, std::string_view(src.data() + start, current - start), line};
 }
 
 Token Scanner::error_token(std::string_view msg) {
@@ -56,11 +224,15 @@ char Scanner::advance() {
 }
 
 char Scanner::peek() const {
+	// src can be part of a longer source, without a '\0' after it
+	if (is_at_end()) {
+		return '\0';
+	}
 	return src[current];
 }
 
 char Scanner::peek_next() const {
-	if (is_at_end()) {
+	if (current + 1 >= static_cast<int>(src.size())) {
 		return '\0';
 	}
 	return src[current + 1];
@@ -77,19 +249,21 @@ bool Scanner::match(char expected) {
 void Scanner::skip_whitespace() {
 	while (true) {
 		switch (peek()) {
-			case '\n':
-				line++;
-				// FALL THROUGH
 			case ' ':
 			case '\r':
 			case '\t':
 				advance();
 				break;
+			case '\n':
+				// and the indent of the next line
+				line++;
+				current = scan_until<true>(src, current + 1, line, [](const auto &b) {
+					return b.ALL & ~b.whitespace();
+				});
+				break;
 			case '/':
 				if (peek_next() == '/') {
-					while (peek() != '\n' && !is_at_end()) {
-						advance();
-					}
+					current = scan_until<false>(src, current, line, [](const auto &b) { return b.eq('\n'); });
 				}
 				else {
 					return;
@@ -106,12 +280,7 @@ bool Scanner::is_at_end() const {
 }
 
 Token Scanner::string() {
-	while (peek() != '"' && !is_at_end()) {
-		if (peek() == '\n') {
-			line++;
-		}
-		advance();
-	}
+	current = scan_until<true>(src, current, line, [](const auto &b) { return b.eq('"'); });
 	if (is_at_end()) {
 		return error_token("Unterminated string.");
 	}
@@ -120,12 +289,12 @@ Token Scanner::string() {
 }
 
 Token Scanner::number() {
-	while (isdigit(peek())) {
+	while (is(peek(), DIGIT)) {
 		advance();
 	}
-	if (peek() == '.' && isdigit(peek_next())) {
+	if (peek() == '.' && is(peek_next(), DIGIT)) {
 		advance(); // consume '.'
-		while (isdigit(peek())) {
+		while (is(peek(), DIGIT)) {
 			advance();
 		}
 	}
@@ -134,49 +303,25 @@ Token Scanner::number() {
 
 Token Scanner::identifier() {
 	// allow digits after first letter
-	while (isalnum(peek()) || peek() == '_') {
-		advance();
+	int short_end = std::min(current + SHORT_IDENTIFIER, static_cast<int>(src.size()));
+	while (current < short_end && is(src[current], IDENTIFIER_CHAR)) {
+		current++;
+	}
+	if (current == short_end) {
+		current = scan_until<false>(src, current, line, [](const auto &b) {
+			return b.ALL & ~b.identifier_char();
+		});
 	}
 	return make_token(identifier_type());
 }
 
 TokenType Scanner::identifier_type() {
-	switch (src[start]) {
-		case 'a': return current-start == sizeof("and")-1    && src[start+1] == 'n' && src[start+2] == 'd' ?  AND    : IDENTIFIER;
-		case 'c': return current-start == sizeof("class")-1  && std::memcmp(&src[start+1], "lass", 4) == 0 ?  CLASS  : IDENTIFIER;
-		case 'e': return current-start == sizeof("else")-1   && std::memcmp(&src[start+1], "lse", 3) == 0 ?   ELSE   : IDENTIFIER;
-		case 'i': return current-start == sizeof("if")-1     && src[start+1] == 'f' ?                         IF     : IDENTIFIER;
-		case 'n': return current-start == sizeof("nil")-1    && src[start+1] == 'i' && src[start+2] == 'l' ?  NIL    : IDENTIFIER;
-		case 'o': return current-start == sizeof("or")-1     && src[start+1] == 'r' ?                         OR     : IDENTIFIER;
-		case 'p': return current-start == sizeof("print")-1  && std::memcmp(&src[start+1], "rint", 4) == 0 ?  PRINT  : IDENTIFIER;
-		case 'r': return current-start == sizeof("return")-1 && std::memcmp(&src[start+1], "eturn", 5) == 0 ? RETURN : IDENTIFIER; // NOLINT
-		case 's': return current-start == sizeof("super")-1  && std::memcmp(&src[start+1], "uper", 4) == 0 ?  SUPER  : IDENTIFIER;
-		case 'v': return current-start == sizeof("var")-1    && src[start+1] == 'a' && src[start+2] == 'r' ?  VAR    : IDENTIFIER;
-		case 'w': return current-start == sizeof("while")-1  && std::memcmp(&src[start+1], "hile", 4) == 0 ?  WHILE  : IDENTIFIER;
-		
-		case 'f': {
-			switch (current - start) {
-				case 3: switch(src[start+1]) {
-					case 'o': return src[start+2] == 'r' ? FOR : IDENTIFIER;
-					case 'u': return src[start+2] == 'n' ? FUN : IDENTIFIER;
-					default: return IDENTIFIER;
-				}
-				case 5: return std::memcmp(&src[start+1], "alse", 4) == 0 ? FALSE : IDENTIFIER;
-				default: return IDENTIFIER;
-			}
-		}
-		case 't': {
-			if (current - start == 4) {
-				switch (src[start+1]) {
-					case 'h': return std::memcmp(&src[start+2], "is", 2) == 0 ? THIS : IDENTIFIER;
-					case 'r': return std::memcmp(&src[start+2], "ue", 2) == 0 ? TRUE : IDENTIFIER;
-					default: return IDENTIFIER;
-				}
-			}
-			return IDENTIFIER;
-		}
-		default: return IDENTIFIER;
+	size_t length = current - start;
+	if (length < KEYWORD_MIN || length > KEYWORD_MAX) {
+		return IDENTIFIER;
 	}
+	const Keyword &keyword = KEYWORD_TABLE[keyword_hash(src[start], src[current - 1], length)];
+	return keyword.text == std::string_view(src.data() + start, length) ? keyword.type : IDENTIFIER;
 }
 
 }
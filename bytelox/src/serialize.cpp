@@ -0,0 +1,104 @@
+#include "serialize.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+#ifdef __unix__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace bytelox {
+
+u64 hash_bytes(std::string_view bytes) {
+	u64 hash = 14695981039346656037u;
+	for (char c : bytes) {
+		hash ^= static_cast<u8>(c);
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+#ifdef __unix__
+MappedFile::MappedFile(const std::string &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1) return;
+	struct stat info;
+	bool regular = fstat(fd, &info) == 0 && S_ISREG(info.st_mode);
+	if (regular && info.st_size > 0) {
+		void *at = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (at != MAP_FAILED) {
+			// read front to back, so the kernel can read ahead and drop what's behind
+			madvise(at, info.st_size, MADV_SEQUENTIAL);
+			data = static_cast<const char *>(at);
+			size = info.st_size;
+			mapped = true;
+			close(fd);
+			return;
+		}
+	}
+	// pipes and the like can't be mapped, and are read a chunk at a time
+	if (regular) contents.reserve(info.st_size);
+	constexpr size_t CHUNK = 64 * 1024;
+	for (;;) {
+		size_t length = contents.size();
+		contents.resize(length + CHUNK);
+		ssize_t read_size = read(fd, contents.data() + length, CHUNK);
+		contents.resize(length + std::max<ssize_t>(read_size, 0));
+		if (read_size == -1 && errno == EINTR) continue;
+		if (read_size == -1) {
+			close(fd);
+			return;
+		}
+		if (read_size == 0) break;
+	}
+	close(fd);
+	data = contents.data();
+	size = contents.size();
+}
+
+MappedFile::~MappedFile() {
+	if (mapped) munmap(const_cast<char *>(data), size);
+}
+
+void MappedFile::release_before(const char *at) {
+	constexpr size_t STEP = 4 * 1024 * 1024; // a multiple of any page size
+	size_t end = (at - data) / STEP * STEP;
+	if (!mapped || end <= released) return;
+	madvise(const_cast<char *>(data) + released, end - released, MADV_DONTNEED);
+	released = end;
+}
+#else
+MappedFile::MappedFile(const std::string &path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open()) return;
+	contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	if (file.bad()) return;
+	data = contents.data();
+	size = contents.size();
+}
+
+MappedFile::~MappedFile() = default;
+
+void MappedFile::release_before(const char *) {}
+#endif
+
+bool replace_file(const std::string &path, std::string_view contents) {
+	std::string temporary = path + ".tmp";
+	std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+	if (!file.is_open()) return false;
+	file.write(contents.data(), contents.size());
+	file.close();
+	std::error_code error;
+	if (file) std::filesystem::rename(temporary, path, error);
+	if (file && !error) return true;
+	std::filesystem::remove(temporary, error);
+	return false;
+}
+
+}
@@ -0,0 +1,503 @@
+#include "snapshot.hpp"
+#include "lox_object.hpp"
+#include "serialize.hpp"
+#include "verifier.hpp"
+#include "vm.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace bytelox {
+
+namespace {
+
+// bump whenever the layout below or what any op does changes
+constexpr u32 FORMAT_VERSION = 1;
+constexpr char MAGIC[4] = {'L', 'O', 'X', 'S'};
+
+// Followed by the objects, each its ObjectType and then
+//   STRING       u32 length, the chars
+//   UPVALUE      the closed value
+//   FUNCTION     name, i32 arity, i32 upvalue_count, u32 code size,
+//                u32 line count, u32 constant count, the code, the lines,
+//                the constants, closure
+//   NATIVE       u32 length, the name it was defined as
+//   CLOSURE      function, then upvalue_count upvalues
+//   CLASS        name, methods
+//   INSTANCE     class, fields
+//   BOUND_METHOD receiver, method
+// then the globals as a table. An object is referred to by its u32 index,
+// or by its index + 1 where it can be missing. A table is a u32 count and
+// that many keys and values. Objects come sorted by their type, so every
+// function comes before any closure of it.
+struct Header {
+	char magic[4];
+	u32 version;
+	u32 op_count; // catches a snapshot from a build with other ops
+	u32 object_count;
+	u64 body_hash; // of everything after the header, catches a damaged file
+};
+
+enum class ValueTag: u8 {
+	NIL,
+	FALSE,
+	TRUE,
+	NUMBER, // f64
+	OBJECT, // u32 index
+};
+
+Header make_header() {
+	Header header{};
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = FORMAT_VERSION;
+	header.op_count = +OP::WIDE + 1;
+	return header;
+}
+
+struct SnapshotWriter: ByteWriter {
+	VM &vm;
+	std::vector<LoxObject *> objects;
+	std::unordered_map<LoxObject *, u32> index_of;
+	bool ok = true;
+
+	explicit SnapshotWriter(VM &vm): vm(vm) {}
+
+	void reach(LoxObject *obj) {
+		if (obj == nullptr || !index_of.try_emplace(obj, 0).second) return;
+		objects.push_back(obj);
+	}
+	void reach(LoxValue value) {
+		if (value.is_object()) reach(value.as.obj);
+	}
+	void reach(HashTable &table) {
+		for (u32 i=0; i<table.capacity; i++) {
+			if (table.entries[i].key == nullptr) continue;
+			reach(table.entries[i].key);
+			reach(table.entries[i].value);
+		}
+	}
+
+	// everything the globals reach, like the collector marks it
+	void collect() {
+		reach(vm.globals);
+		for (size_t i=0; i<objects.size(); i++) {
+			LoxObject &obj = *objects[i];
+			switch (obj.type) {
+				case ObjectType::STRING:
+				case ObjectType::NATIVE:
+					break;
+				case ObjectType::UPVALUE:
+					if (obj.as_upvalue().stack_index != UINT32_MAX) ok = false;
+					reach(obj.as_upvalue().closed);
+					break;
+				case ObjectType::FUNCTION: {
+					ObjectFunction &fn = obj.as_function();
+					if (fn.lazy != nullptr && !vm.compile_lazy(fn)) ok = false;
+					reach(fn.name);
+					for (LoxValue constant : fn.chunk.constants) reach(constant);
+					reach(fn.closure);
+					break;
+				}
+				case ObjectType::CLOSURE: {
+					ObjectClosure &closure = obj.as_closure();
+					reach(closure.function);
+					for (int j=0; j<closure.upvalue_count; j++) reach(closure.upvalues[j]);
+					break;
+				}
+				case ObjectType::CLASS:
+					reach(obj.as_class().name);
+					reach(obj.as_class().methods);
+					break;
+				case ObjectType::INSTANCE:
+					reach(obj.as_instance().klass);
+					reach(obj.as_instance().fields);
+					break;
+				case ObjectType::BOUND_METHOD:
+					reach(obj.as_bound_method().receiver);
+					reach(obj.as_bound_method().method);
+					break;
+			}
+		}
+		// functions in the order of their code, so loading packs it the same way
+		std::stable_sort(objects.begin(), objects.end(), [](LoxObject *a, LoxObject *b) {
+			if (a->type != b->type) return a->type < b->type;
+			return a->is_function() &&
+					std::less<const u8 *>()(a->as_function().chunk.code.data(), b->as_function().chunk.code.data());
+		});
+		for (u32 i=0; i<objects.size(); i++) index_of[objects[i]] = i;
+	}
+
+	void object(LoxObject *obj) {
+		put<u32>(index_of[obj]);
+	}
+	void maybe_object(LoxObject *obj) {
+		put<u32>(obj == nullptr ? 0 : index_of[obj] + 1);
+	}
+	void value(LoxValue value) {
+		switch (value.type) {
+			case ValueType::NIL: put(ValueTag::NIL); break;
+			case ValueType::BOOL: put(value.as.boolean ? ValueTag::TRUE : ValueTag::FALSE); break;
+			case ValueType::NUMBER: put(ValueTag::NUMBER); put<f64>(value.as.number); break;
+			case ValueType::OBJECT: put(ValueTag::OBJECT); object(value.as.obj); break;
+		}
+	}
+	void table(HashTable &table) {
+		// size counts tombstones too
+		u32 size = 0;
+		for (u32 i=0; i<table.capacity; i++) size += table.entries[i].key != nullptr;
+		put<u32>(size);
+		for (u32 i=0; i<table.capacity; i++) {
+			if (table.entries[i].key == nullptr) continue;
+			object(table.entries[i].key);
+			value(table.entries[i].value);
+		}
+	}
+
+	void write() {
+		for (LoxObject *obj : objects) {
+			put(obj->type);
+			switch (obj->type) {
+				case ObjectType::STRING: {
+					ObjectString &string = obj->as_string();
+					put<u32>(string.length);
+					put_bytes(string.chars.get(), string.length);
+					break;
+				}
+				case ObjectType::UPVALUE:
+					value(obj->as_upvalue().closed);
+					break;
+				case ObjectType::FUNCTION: {
+					ObjectFunction &fn = obj->as_function();
+					Chunk &chunk = fn.chunk;
+					maybe_object(fn.name);
+					put<i32>(fn.arity);
+					put<i32>(fn.upvalue_count);
+					put<u32>(chunk.code.size());
+					put<u32>(chunk.lines.size());
+					put<u32>(chunk.constants.size());
+					put_bytes(chunk.code.data(), chunk.code.size());
+					put_bytes(chunk.lines.data(), chunk.lines.size() * sizeof(LineStart));
+					for (LoxValue constant : chunk.constants) value(constant);
+					maybe_object(fn.closure);
+					break;
+				}
+				case ObjectType::NATIVE: {
+					std::string_view name = obj->as_native().name;
+					put<u32>(name.size());
+					put_bytes(name.data(), name.size());
+					break;
+				}
+				case ObjectType::CLOSURE: {
+					ObjectClosure &closure = obj->as_closure();
+					object(closure.function);
+					for (int i=0; i<closure.upvalue_count; i++) maybe_object(closure.upvalues[i]);
+					break;
+				}
+				case ObjectType::CLASS:
+					object(obj->as_class().name);
+					table(obj->as_class().methods);
+					break;
+				case ObjectType::INSTANCE:
+					object(obj->as_instance().klass);
+					table(obj->as_instance().fields);
+					break;
+				case ObjectType::BOUND_METHOD:
+					value(obj->as_bound_method().receiver);
+					object(obj->as_bound_method().method);
+					break;
+			}
+		}
+		table(vm.globals);
+	}
+};
+
+// Reads the objects in two passes, one creating them and one filling in
+// what they refer to, since they can refer to each other in any order.
+// Objects are kept on the stack from base up while there's nothing else
+// referring to them.
+struct SnapshotReader {
+	VM &vm;
+	ByteReader reader;
+	size_t base;
+	u32 count;
+
+	LoxObject *object(u32 index) {
+		return vm.stack[base + index].as.obj;
+	}
+	u32 created() {
+		return vm.stack.size() - base;
+	}
+
+	// an object of type that's already been created
+	bool get_object(LoxObject *&obj, ObjectType type) {
+		u32 index;
+		if (!reader.get(index) || index >= created()) return false;
+		obj = object(index);
+		return obj->type == type;
+	}
+	bool get_maybe_object(LoxObject *&obj, ObjectType type) {
+		u32 index;
+		if (!reader.get(index) || index > created()) return false;
+		obj = index == 0 ? nullptr : object(index - 1);
+		return obj == nullptr || obj->type == type;
+	}
+	bool get_value(LoxValue &value) {
+		ValueTag tag;
+		if (!reader.get(tag)) return false;
+		switch (tag) {
+			case ValueTag::NIL: value = LoxValue(); return true;
+			case ValueTag::FALSE: value = LoxValue(false); return true;
+			case ValueTag::TRUE: value = LoxValue(true); return true;
+			case ValueTag::NUMBER: {
+				f64 number;
+				if (!reader.get(number)) return false;
+				value = LoxValue(number);
+				return true;
+			}
+			case ValueTag::OBJECT: {
+				u32 index;
+				if (!reader.get(index) || index >= created()) return false;
+				value = LoxValue(object(index));
+				return true;
+			}
+		}
+		return false;
+	}
+	bool get_table(HashTable *table) {
+		u32 size;
+		if (!reader.get(size)) return false;
+		for (u32 i=0; i<size; i++) {
+			LoxObject *key;
+			LoxValue value;
+			if (!get_object(key, ObjectType::STRING) || !get_value(value)) return false;
+			table->set(&key->as_string(), value);
+		}
+		return true;
+	}
+
+	// The first pass only follows references back to objects it has
+	// created, skipping the rest
+	bool skip_reference(bool maybe) {
+		u32 index;
+		return reader.get(index) && index < count + maybe;
+	}
+	bool skip_value() {
+		ValueTag tag;
+		if (!reader.get(tag)) return false;
+		if (tag == ValueTag::NUMBER) return reader.bytes(sizeof(f64)) != nullptr;
+		if (tag == ValueTag::OBJECT) return skip_reference(false);
+		return tag <= ValueTag::OBJECT;
+	}
+	bool skip_table() {
+		u32 size;
+		if (!reader.get(size)) return false;
+		for (u32 i=0; i<size; i++) {
+			if (!skip_reference(false) || !skip_value()) return false;
+		}
+		return true;
+	}
+
+	// creates the next object, the first pass
+	bool create() {
+		ObjectType type;
+		if (!reader.get(type)) return false;
+		switch (type) {
+			case ObjectType::STRING: {
+				u32 length;
+				if (!reader.get(length)) return false;
+				const char *chars = reader.bytes(length);
+				if (chars == nullptr) return false;
+				vm.stack.push_back(vm.get_ObjectString({chars, length}));
+				return true;
+			}
+			case ObjectType::UPVALUE:
+				vm.stack.push_back(vm.GC<ObjectUpvalue>(u32(UINT32_MAX)));
+				return skip_value();
+			case ObjectType::FUNCTION: {
+				vm.stack.push_back(vm.GC<ObjectFunction>());
+				return skip_function(vm.stack.back().as_function());
+			}
+			case ObjectType::NATIVE: {
+				// the native this VM defined with the name
+				u32 length;
+				if (!reader.get(length)) return false;
+				const char *chars = reader.bytes(length);
+				if (chars == nullptr) return false;
+				vm.stack.push_back(vm.get_ObjectString({chars, length}));
+				LoxValue native;
+				bool defined = vm.globals.get(&vm.stack.back().as_string(), &native) && native.is_native() &&
+						native.as_native().name == std::string_view(chars, length);
+				vm.stack.back() = native;
+				return defined;
+			}
+			case ObjectType::CLOSURE: {
+				LoxObject *fn;
+				if (!get_object(fn, ObjectType::FUNCTION)) return false;
+				ObjectFunction *function = &fn->as_function();
+				vm.stack.push_back(vm.GC<ObjectClosure>(function));
+				for (int i=0; i<function->upvalue_count; i++) {
+					if (!skip_reference(true)) return false;
+				}
+				return true;
+			}
+			case ObjectType::CLASS:
+				vm.stack.push_back(vm.GC<ObjectClass>(static_cast<ObjectString *>(nullptr)));
+				return skip_reference(false) && skip_table();
+			case ObjectType::INSTANCE:
+				vm.stack.push_back(vm.GC<ObjectInstance>(static_cast<ObjectClass *>(nullptr)));
+				return skip_reference(false) && skip_table();
+			case ObjectType::BOUND_METHOD:
+				vm.stack.push_back(vm.GC<ObjectBoundMethod>(LoxValue(), static_cast<ObjectClosure *>(nullptr)));
+				return skip_value() && skip_reference(false);
+		}
+		return false;
+	}
+
+	// reads past a function, keeping its upvalue count for closures of it
+	// made before the second pass
+	bool skip_function(ObjectFunction &fn) {
+		u32 code_size, line_count, constant_count;
+		if (!skip_reference(true) || !reader.get(fn.arity) || !reader.get(fn.upvalue_count) || fn.upvalue_count < 0 || fn.upvalue_count > UINT16_MAX + 1 ||
+				!reader.get(code_size) || !reader.get(line_count) || !reader.get(constant_count)) {
+			return false;
+		}
+		if (reader.bytes(code_size) == nullptr || reader.bytes(static_cast<size_t>(line_count) * sizeof(LineStart)) == nullptr) {
+			return false;
+		}
+		for (u32 i=0; i<constant_count; i++) {
+			if (!skip_value()) return false;
+		}
+		return skip_reference(true);
+	}
+
+	// fills in the object at index, the second pass
+	bool fill(u32 index) {
+		ObjectType type;
+		if (!reader.get(type) || type != object(index)->type) return false;
+		LoxObject &obj = *object(index);
+		switch (type) {
+			case ObjectType::STRING:
+			case ObjectType::NATIVE: {
+				u32 length;
+				return reader.get(length) && reader.bytes(length) != nullptr;
+			}
+			case ObjectType::UPVALUE:
+				return get_value(obj.as_upvalue().closed);
+			case ObjectType::FUNCTION: {
+				ObjectFunction &fn = obj.as_function();
+				LoxObject *name, *closure;
+				int arity, upvalue_count; // read in the first pass
+				u32 code_size, line_count, constant_count;
+				if (!get_maybe_object(name, ObjectType::STRING) || !reader.get(arity) || !reader.get(upvalue_count) ||
+						!reader.get(code_size) || !reader.get(line_count) || !reader.get(constant_count) ||
+						upvalue_count != fn.upvalue_count) {
+					return false;
+				}
+				fn.name = name == nullptr ? nullptr : &name->as_string();
+				const u8 *code = reinterpret_cast<const u8 *>(reader.bytes(code_size));
+				const char *lines = reader.bytes(static_cast<size_t>(line_count) * sizeof(LineStart));
+				fn.chunk.code.assign(code, code + code_size);
+				fn.chunk.lines.resize(line_count);
+				std::memcpy(fn.chunk.lines.data(), lines, line_count * sizeof(LineStart));
+				for (u32 i=0; i<constant_count; i++) {
+					LoxValue constant;
+					if (!get_value(constant)) return false;
+					fn.chunk.constants.push_back(constant);
+				}
+				if (!get_maybe_object(closure, ObjectType::CLOSURE)) return false;
+				fn.closure = closure == nullptr ? nullptr : &closure->as_closure();
+				return true;
+			}
+			case ObjectType::CLOSURE: {
+				ObjectClosure &closure = obj.as_closure();
+				LoxObject *fn;
+				if (!get_object(fn, ObjectType::FUNCTION) || &fn->as_function() != closure.function) return false;
+				for (int i=0; i<closure.upvalue_count; i++) {
+					LoxObject *upvalue;
+					if (!get_maybe_object(upvalue, ObjectType::UPVALUE)) return false;
+					closure.upvalues[i] = upvalue == nullptr ? nullptr : &upvalue->as_upvalue();
+				}
+				return true;
+			}
+			case ObjectType::CLASS: {
+				LoxObject *name;
+				if (!get_object(name, ObjectType::STRING)) return false;
+				obj.as_class().name = &name->as_string();
+				return get_table(&obj.as_class().methods);
+			}
+			case ObjectType::INSTANCE: {
+				LoxObject *klass;
+				if (!get_object(klass, ObjectType::CLASS)) return false;
+				obj.as_instance().klass = &klass->as_class();
+				return get_table(&obj.as_instance().fields);
+			}
+			case ObjectType::BOUND_METHOD: {
+				LoxObject *method;
+				if (!get_value(obj.as_bound_method().receiver) || !get_object(method, ObjectType::CLOSURE)) return false;
+				obj.as_bound_method().method = &method->as_closure();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool read() {
+		const char *objects = reader.at;
+		for (u32 i=0; i<count; i++) {
+			if (!create()) return false;
+		}
+		reader.at = objects;
+		std::vector<Chunk *> chunks;
+		for (u32 i=0; i<count; i++) {
+			if (!fill(i)) return false;
+			if (object(i)->is_function()) chunks.push_back(&object(i)->as_function().chunk);
+		}
+		// once every function has its upvalue count, which closures are checked against
+		for (u32 i=0; i<count; i++) {
+			if (object(i)->is_function() && !verify_function(object(i)->as_function())) return false;
+		}
+		HashTable globals;
+		if (!get_table(&globals) || reader.at != reader.end) return false;
+		vm.globals.add_all(globals);
+		vm.code_arenas.push_back(pack_chunks(chunks));
+		return true;
+	}
+};
+
+}
+
+bool write_snapshot(VM &vm, const std::string &path) {
+	SnapshotWriter writer(vm);
+	writer.collect();
+	if (!writer.ok) return false;
+	writer.write();
+	Header header = make_header();
+	header.object_count = writer.objects.size();
+	header.body_hash = hash_bytes(writer.out);
+	std::string contents(reinterpret_cast<const char *>(&header), sizeof(header));
+	return replace_file(path, contents + writer.out);
+}
+
+bool load_snapshot(VM &vm, const std::string &path) {
+	MappedFile file(path);
+	ByteReader reader{file.data, file.data + file.size};
+	Header header;
+	if (file.data == nullptr || !reader.get(header)) return false;
+	Header expected = make_header();
+	if (std::memcmp(header.magic, expected.magic, sizeof(MAGIC)) != 0 || header.version != expected.version ||
+			header.op_count != expected.op_count ||
+			header.body_hash != hash_bytes({reader.at, static_cast<size_t>(reader.end - reader.at)})) {
+		return false;
+	}
+
+	size_t base = vm.stack.size();
+	SnapshotReader snapshot{vm, reader, base, header.object_count};
+	bool read = snapshot.read();
+	vm.stack.resize(base);
+	return read;
+}
+
+}
@@ -0,0 +1,688 @@
+#include "ssa.hpp"
+
+#include <algorithm>
+#include <bit>
+
+namespace bytelox {
+
+namespace ssa {
+
+namespace {
+
+bool is_pure(u8 op) {
+	switch (checked_form(op)) {
+		case +OP::EQUAL:
+		case +OP::NOT_EQUAL:
+		case +OP::GREATER:
+		case +OP::GREATER_EQUAL:
+		case +OP::LESS:
+		case +OP::LESS_EQUAL:
+		case +OP::ADD:
+		case +OP::SUB:
+		case +OP::MUL:
+		case +OP::DIV:
+		case +OP::NOT:
+		case +OP::NEGATE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+bool is_unary(u8 op) {
+	return op == +OP::NOT || op == +OP::NEGATE;
+}
+
+bool pushes_constant(u8 op) {
+	return op == +OP::CONSTANT || op == +OP::CONSTANT_LONG || op == +OP::NIL ||
+			op == +OP::TRUE || op == +OP::FALSE;
+}
+
+u64 bits_of(LoxValue value) {
+	switch (value.type) {
+		case ValueType::BOOL: return value.as.boolean;
+		case ValueType::NIL: return 0;
+		case ValueType::NUMBER: return std::bit_cast<u64>(value.as.number);
+		case ValueType::OBJECT: return reinterpret_cast<u64>(value.as.obj);
+	}
+	return 0;
+}
+
+}
+
+Function::Function(Chunk &chunk, int arity):
+		chunk(chunk), code(decode_chunk(chunk)), entry_height(arity + 1), captured(UINT8_MAX + 1, false) {
+	for (Instruction &ins : code) {
+		if (ins.op != +OP::CLOSURE) continue;
+		for (size_t j=1; j+1<ins.operands.size(); j+=2) {
+			if (ins.operands[j]) captured[ins.operands[j + 1]] = true;
+		}
+	}
+}
+
+ValueId Function::number(Value value, std::tuple<int, u64, int, int> key) {
+	auto [it, inserted] = numbering.try_emplace(key, values.size());
+	if (inserted) values.push_back(value);
+	return it->second;
+}
+
+ValueId Function::constant(size_t i) {
+	Instruction &ins = code[i];
+	LoxValue value;
+	switch (ins.op) {
+		case +OP::CONSTANT: value = chunk.constants[ins.operands[0]]; break;
+		case +OP::CONSTANT_LONG:
+			value = chunk.constants[ins.operands[0] | (ins.operands[1] << 8) | (ins.operands[2] << 16)];
+			break;
+		case +OP::TRUE: value = LoxValue(true); break;
+		case +OP::FALSE: value = LoxValue(false); break;
+		default: break;
+	}
+	Value constant{Value::CONSTANT};
+	constant.origin = i;
+	constant.constant = value;
+	return number(constant, {Value::CONSTANT, bits_of(value), +value.type, 0});
+}
+
+ValueId Function::pure(u8 op, ValueId lhs, ValueId rhs) {
+	return number({Value::PURE, op, lhs, rhs}, {Value::PURE, op, lhs, rhs});
+}
+
+ValueId Function::opaque(size_t i) {
+	Value value{Value::OPAQUE};
+	value.origin = i;
+	return number(value, {Value::OPAQUE, i, 0, 0});
+}
+
+ValueId Function::phi(int block, int slot) {
+	Value value{Value::PHI};
+	value.lhs = slot;
+	value.origin = block;
+	return number(value, {Value::PHI, static_cast<u64>(block), slot, 0});
+}
+
+bool Function::is_number(ValueId id) {
+	if (static_cast<size_t>(id) < numbers.size()) return numbers[id];
+	Value &value = values[id];
+	if (value.kind == Value::CONSTANT) return value.constant.is_number();
+	if (value.kind != Value::PURE) return false;
+	switch (value.op) {
+		case +OP::SUB:
+		case +OP::MUL:
+		case +OP::DIV:
+		case +OP::NEGATE:
+			return true;
+		case +OP::ADD:
+			// strings can be added too
+			return is_number(value.lhs) && is_number(value.rhs);
+		default:
+			return false;
+	}
+}
+
+int Function::holder(const std::vector<ValueId> &slots, ValueId value, size_t limit) {
+	limit = std::min(limit, captured.size());
+	for (size_t slot=0; slot<limit; slot++) {
+		if (slots[slot] == value && !captured[slot]) return slot;
+	}
+	return -1;
+}
+
+bool Function::step(std::vector<ValueId> &slots, size_t i) {
+	Instruction &ins = code[i];
+	size_t pops, pushes;
+	if (!stack_effect(ins, pops, pushes) || slots.size() < pops) return false;
+	switch (ins.op) {
+		case +OP::CONSTANT:
+		case +OP::CONSTANT_LONG:
+		case +OP::NIL:
+		case +OP::TRUE:
+		case +OP::FALSE:
+			slots.push_back(constant(i));
+			return true;
+		case +OP::GET_LOCAL: {
+			u8 slot = ins.operands[0];
+			if (slot >= slots.size()) return false;
+			slots.push_back(captured[slot] ? opaque(i) : slots[slot]);
+			return true;
+		}
+		case +OP::SET_LOCAL: {
+			u8 slot = ins.operands[0];
+			if (slot >= slots.size()) return false;
+			slots[slot] = slots.back();
+			return true;
+		}
+		case +OP::SET_GLOBAL:
+		case +OP::SET_UPVALUE:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::JUMP:
+		case +OP::LOOP:
+		case +OP::GUARD_CALL:
+		case +OP::GUARD_INVOKE:
+			return true;
+		case +OP::RETURN_INLINED: {
+			ValueId result = slots.back();
+			slots.resize(slots.size() - ins.operands[0]);
+			slots.back() = result;
+			return true;
+		}
+		case +OP::SET_PROPERTY: {
+			ValueId value = slots.back();
+			slots.resize(slots.size() - 2);
+			slots.push_back(value);
+			return true;
+		}
+		case +OP::INHERIT:
+		case +OP::METHOD:
+			slots.pop_back();
+			return true;
+		default:
+			break;
+	}
+	if (is_pure(ins.op)) {
+		ValueId rhs = is_unary(ins.op) ? -1 : slots.back();
+		if (!is_unary(ins.op)) slots.pop_back();
+		ValueId lhs = slots.back();
+		slots.back() = pure(checked_form(ins.op), lhs, rhs);
+		return true;
+	}
+	slots.resize(slots.size() - pops);
+	if (pushes > 0) slots.push_back(opaque(i));
+	return true;
+}
+
+bool Function::merge(int block, const std::vector<ValueId> &slots, bool &changed) {
+	std::vector<ValueId> &entry = blocks[block].entry;
+	if (entry.empty()) {
+		entry = slots;
+		changed = true;
+		return true;
+	}
+	if (entry.size() != slots.size()) return false;
+	for (size_t slot=0; slot<slots.size(); slot++) {
+		if (entry[slot] == slots[slot]) continue;
+		ValueId merged = phi(block, slot);
+		if (entry[slot] != merged) {
+			entry[slot] = merged;
+			changed = true;
+		}
+	}
+	return true;
+}
+
+bool Function::build() {
+	std::vector<bool> leader(code.size() + 1, false);
+	leader[0] = true;
+	for (size_t i=0; i<code.size(); i++) {
+		Instruction &ins = code[i];
+		if (ins.target != -1) {
+			if (static_cast<size_t>(ins.target) >= code.size()) return false;
+			leader[ins.target] = true;
+			leader[i + 1] = true;
+		}
+		if (is_unconditional(ins.op)) leader[i + 1] = true;
+	}
+	block_of.assign(code.size(), -1);
+	for (size_t i=0; i<code.size(); i++) {
+		if (leader[i]) blocks.push_back({i, i});
+		block_of[i] = blocks.size() - 1;
+		blocks.back().last = i;
+	}
+	for (Block &block : blocks) {
+		Instruction &last = code[block.last];
+		if (last.target != -1) block.successors.push_back(block_of[last.target]);
+		if (!is_unconditional(last.op)) {
+			if (block.last + 1 >= code.size()) return false;
+			block.successors.push_back(block_of[block.last + 1]);
+		}
+	}
+
+	// optimistically assume slots hold the same value on every path until a
+	// predecessor shows otherwise, which makes each slot of a block's entry
+	// change at most twice
+	height.assign(code.size(), -1);
+	blocks[0].entry.resize(entry_height);
+	for (size_t slot=0; slot<entry_height; slot++) {
+		Value value{Value::ENTRY};
+		value.origin = slot;
+		blocks[0].entry[slot] = number(value, {Value::ENTRY, slot, 0, 0});
+	}
+	std::vector<int> work{0};
+	while (!work.empty()) {
+		int block = work.back();
+		work.pop_back();
+		std::vector<ValueId> slots = blocks[block].entry;
+		for (size_t i=blocks[block].first; i<=blocks[block].last; i++) {
+			height[i] = slots.size();
+			if (!step(slots, i)) return false;
+		}
+		for (int successor : blocks[block].successors) {
+			bool changed = false;
+			if (!merge(successor, slots, changed)) return false;
+			if (changed) work.push_back(successor);
+		}
+		blocks[block].exit = std::move(slots);
+	}
+	infer_numbers();
+	return true;
+}
+
+void Function::infer_numbers() {
+	std::vector<std::vector<int>> predecessors(blocks.size());
+	for (size_t b=0; b<blocks.size(); b++) {
+		if (blocks[b].entry.empty()) continue;
+		for (int successor : blocks[b].successors) {
+			predecessors[successor].push_back(b);
+		}
+	}
+	numbers.assign(values.size(), true);
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t id=0; id<values.size(); id++) {
+			if (!numbers[id]) continue;
+			Value &value = values[id];
+			bool number = false;
+			switch (value.kind) {
+				case Value::CONSTANT:
+					number = value.constant.is_number();
+					break;
+				case Value::PURE:
+					switch (value.op) {
+						case +OP::SUB:
+						case +OP::MUL:
+						case +OP::DIV:
+						case +OP::NEGATE:
+							number = true;
+							break;
+						case +OP::ADD:
+							number = numbers[value.lhs] && numbers[value.rhs];
+							break;
+						default:
+							break;
+					}
+					break;
+				case Value::PHI:
+					// the first block is also entered from the call, with parameters
+					// that could be anything
+					number = value.origin != 0 && std::all_of(predecessors[value.origin].begin(),
+							predecessors[value.origin].end(), [&](int b) {
+								return numbers[blocks[b].exit[value.lhs]];
+							});
+					break;
+				default:
+					break;
+			}
+			if (!number) {
+				numbers[id] = false;
+				changed = true;
+			}
+		}
+	}
+}
+
+namespace {
+
+// Rewrites reads of locals holding a constant to push the constant, and
+// reads of other locals to read the lowest slot with the same value. Stores
+// of the value a local already holds are removed, and so is code computing
+// a value that's still in a slot below, which is read from there instead.
+bool propagate(Function &fn) {
+	bool changed = false;
+	for (Block &block : fn.blocks) {
+		if (block.entry.empty()) continue;
+		std::vector<ValueId> slots = block.entry;
+		// first instruction of the code without side effects that computed
+		// each slot in this block, -1 if there isn't any
+		std::vector<int> starts(slots.size(), -1);
+		for (size_t i=block.first; i<=block.last; i++) {
+			Instruction &ins = fn.code[i];
+			int start = -1;
+			if (ins.op == +OP::GET_LOCAL && !fn.captured[ins.operands[0]]) {
+				u8 slot = ins.operands[0];
+				Value &value = fn.values[slots[slot]];
+				int holder = fn.holder(slots, slots[slot], slot);
+				if (value.kind == Value::CONSTANT) {
+					Instruction &source = fn.code[value.origin];
+					ins.op = source.op;
+					ins.operands = source.operands;
+					changed = true;
+				}
+				else if (holder != -1) {
+					ins.operands[0] = holder;
+					changed = true;
+				}
+				start = i;
+			}
+			else if (pushes_constant(ins.op)) {
+				start = i;
+			}
+			else if (ins.op == +OP::SET_LOCAL && !fn.captured[ins.operands[0]] &&
+					slots[ins.operands[0]] == slots.back()) {
+				ins.removed = true;
+				changed = true;
+			}
+			else if (is_pure(ins.op)) {
+				size_t base = slots.size() - (is_unary(ins.op) ? 1 : 2);
+				if (std::all_of(starts.begin() + base, starts.end(), [](int s) { return s != -1; })) {
+					start = starts[base];
+				}
+			}
+
+			fn.step(slots, i);
+			if (start == -1 && ins.op != +OP::POP) std::fill(starts.begin(), starts.end(), -1);
+			starts.resize(slots.size(), -1);
+			if (start == -1) continue;
+			starts.back() = start;
+			if (!is_pure(ins.op)) continue;
+			int holder = fn.holder(slots, slots.back(), slots.size() - 1);
+			if (holder == -1) continue;
+			for (size_t j=start; j<i; j++) {
+				fn.code[j].removed = true;
+			}
+			ins.op = +OP::GET_LOCAL;
+			ins.operands = {static_cast<u8>(holder)};
+			starts.back() = i;
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+// Removes stores to locals that are never read before being overwritten or
+// popped. Values are read by GET_LOCAL, and by anything but POP taking them
+// off the top of the stack.
+bool remove_dead_stores(Function &fn) {
+	size_t slot_count = 0;
+	for (int h : fn.height) {
+		slot_count = std::max(slot_count, static_cast<size_t>(h + 1));
+	}
+	auto transfer = [&](std::vector<bool> &live, size_t i) {
+		Instruction &ins = fn.code[i];
+		size_t h = fn.height[i];
+		size_t pops, pushes;
+		stack_effect(ins, pops, pushes);
+		if (ins.op == +OP::GET_LOCAL) {
+			live[h] = false;
+			live[ins.operands[0]] = true;
+			return;
+		}
+		if (ins.op == +OP::SET_LOCAL) {
+			live[ins.operands[0]] = false;
+			live[h - 1] = true;
+			return;
+		}
+		for (size_t slot=h-pops; slot<h-pops+pushes; slot++) {
+			live[slot] = false;
+		}
+		if (ins.op == +OP::POP) return;
+		for (size_t slot=h-pops; slot<h; slot++) {
+			live[slot] = true;
+		}
+	};
+
+	std::vector<std::vector<bool>> live_in(fn.blocks.size(), std::vector<bool>(slot_count, false));
+	auto live_out = [&](Block &block) {
+		std::vector<bool> live(slot_count, false);
+		for (int successor : block.successors) {
+			for (size_t slot=0; slot<slot_count; slot++) {
+				if (live_in[successor][slot]) live[slot] = true;
+			}
+		}
+		return live;
+	};
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t b=fn.blocks.size(); b-->0;) {
+			Block &block = fn.blocks[b];
+			if (block.entry.empty()) continue;
+			std::vector<bool> live = live_out(block);
+			for (size_t i=block.last+1; i-->block.first;) {
+				transfer(live, i);
+			}
+			if (live != live_in[b]) {
+				live_in[b] = live;
+				changed = true;
+			}
+		}
+	}
+
+	bool removed = false;
+	for (Block &block : fn.blocks) {
+		if (block.entry.empty()) continue;
+		std::vector<bool> live = live_out(block);
+		for (size_t i=block.last+1; i-->block.first;) {
+			Instruction &ins = fn.code[i];
+			if (ins.op == +OP::SET_LOCAL && !fn.captured[ins.operands[0]] && !live[ins.operands[0]]) {
+				ins.removed = true;
+				removed = true;
+				continue;
+			}
+			transfer(live, i);
+		}
+	}
+	return removed;
+}
+
+// Operators that can't fail on these operands
+bool cannot_fail(Function &fn, u8 op, ValueId lhs, ValueId rhs) {
+	switch (op) {
+		case +OP::EQUAL:
+		case +OP::NOT_EQUAL:
+		case +OP::NOT:
+			return true;
+		case +OP::NEGATE:
+			return fn.is_number(lhs);
+		default:
+			return fn.is_number(lhs) && fn.is_number(rhs);
+	}
+}
+
+// A loop is code[header..end], entered only by falling into header and left
+// only by returning or jumping to exit, which pops the loop condition.
+// Hoisting a value out of it keeps the value in a new slot just below the
+// loop's, which the loop reads, and pops it after exit's POP.
+struct Loop {
+	size_t header, end;
+	int exit = -1;
+	size_t base; // stack height at header, where the hoisted value goes
+};
+
+bool find_loop(Function &fn, size_t latch, Loop &loop) {
+	std::vector<Instruction> &code = fn.code;
+	size_t header = code[latch].target;
+	size_t end = latch;
+	for (bool grew = true; grew;) {
+		grew = false;
+		for (size_t i=end+1; i<code.size(); i++) {
+			if (code[i].op == +OP::LOOP && static_cast<size_t>(code[i].target) >= header &&
+					static_cast<size_t>(code[i].target) <= end) {
+				end = i;
+				grew = true;
+			}
+		}
+	}
+	if (header == 0 || is_unconditional(code[header - 1].op) || fn.height[header] == -1) return false;
+	loop = {header, end, -1, static_cast<size_t>(fn.height[header])};
+	size_t exits = 0;
+	for (size_t i=0; i<code.size(); i++) {
+		int target = code[i].target;
+		if (target == -1) continue;
+		bool inside = i >= header && i <= end;
+		bool lands_inside = static_cast<size_t>(target) >= header && static_cast<size_t>(target) <= end;
+		if (!inside && (lands_inside || static_cast<size_t>(target) == end + 1)) return false;
+		if (inside && !lands_inside) {
+			if (static_cast<size_t>(target) != end + 1) return false;
+			exits++;
+		}
+		// an inner loop's end is the end of this one too
+		if (inside && code[i].op == +OP::LOOP && static_cast<size_t>(target) < header) return false;
+	}
+	if (exits > 0) {
+		loop.exit = end + 1;
+		if (code[loop.exit].op != +OP::POP || static_cast<size_t>(fn.height[loop.exit]) != loop.base + 1) {
+			return false;
+		}
+	}
+
+	// slots at or above base move up one inside the loop
+	if (loop.base > UINT8_MAX) return false;
+	for (size_t i=header; i<=end; i++) {
+		Instruction &ins = code[i];
+		if (ins.op == +OP::GET_LOCAL || ins.op == +OP::SET_LOCAL) {
+			if (ins.operands[0] == UINT8_MAX) return false;
+		}
+		if (ins.op == +OP::CLOSURE) {
+			for (size_t j=1; j+1<ins.operands.size(); j+=2) {
+				if (ins.operands[j] && ins.operands[j + 1] == UINT8_MAX) return false;
+			}
+		}
+	}
+	return true;
+}
+
+// Moves one computation of the loop whose inputs are the same on every
+// iteration, and that can't fail, to before its header
+bool hoist(Function &fn, Loop &loop) {
+	std::vector<Instruction> &code = fn.code;
+	std::vector<ValueId> &invariant = fn.blocks[fn.block_of[loop.header]].entry;
+	int header_block = fn.block_of[loop.header];
+	int best_start = -1, best_end = -1;
+	for (Block &block : fn.blocks) {
+		if (block.first < loop.header || block.last > loop.end || block.entry.empty()) continue;
+		std::vector<ValueId> slots = block.entry;
+		// like propagate's starts, but only for code that could run before the loop
+		std::vector<int> starts(slots.size(), -1);
+		for (size_t i=block.first; i<=block.last; i++) {
+			Instruction &ins = code[i];
+			int start = -1;
+			if (ins.op == +OP::GET_LOCAL) {
+				u8 slot = ins.operands[0];
+				ValueId value = slots[slot];
+				// phis of the header are whatever the previous iteration left
+				bool is_header_phi = fn.values[value].kind == Value::PHI &&
+						fn.values[value].origin == header_block;
+				if (slot < loop.base && !fn.captured[slot] && value == invariant[slot] && !is_header_phi) {
+					start = i;
+				}
+			}
+			else if (pushes_constant(ins.op)) {
+				start = i;
+			}
+			else if (is_pure(ins.op)) {
+				bool unary = is_unary(ins.op);
+				size_t base = slots.size() - (unary ? 1 : 2);
+				bool known = std::all_of(starts.begin() + base, starts.end(), [](int s) { return s != -1; });
+				if (known && cannot_fail(fn, checked_form(ins.op), slots[base], unary ? -1 : slots[base + 1])) {
+					start = starts[base];
+				}
+			}
+
+			fn.step(slots, i);
+			if (start == -1 && ins.op != +OP::POP) std::fill(starts.begin(), starts.end(), -1);
+			starts.resize(slots.size(), -1);
+			if (start == -1) continue;
+			starts.back() = start;
+			if (is_pure(ins.op) && static_cast<int>(i) - start > best_end - best_start) {
+				best_start = start;
+				best_end = i;
+			}
+		}
+	}
+	if (best_start == -1) return false;
+
+	std::vector<Instruction> hoisted(code.begin() + best_start, code.begin() + best_end + 1);
+	for (int i=best_start; i<best_end; i++) {
+		code[i].removed = true;
+	}
+	for (size_t i=loop.header; i<=loop.end; i++) {
+		Instruction &ins = code[i];
+		if (ins.op == +OP::GET_LOCAL || ins.op == +OP::SET_LOCAL) {
+			if (ins.operands[0] >= loop.base) ins.operands[0]++;
+		}
+		if (ins.op == +OP::CLOSURE) {
+			for (size_t j=1; j+1<ins.operands.size(); j+=2) {
+				if (ins.operands[j] && ins.operands[j + 1] >= loop.base) ins.operands[j + 1]++;
+			}
+		}
+	}
+	code[best_end].op = +OP::GET_LOCAL;
+	code[best_end].operands = {static_cast<u8>(loop.base)};
+
+	// the hoisted code goes before the header and a POP after the exit's
+	std::vector<size_t> moved_to(code.size());
+	std::vector<Instruction> result;
+	result.reserve(code.size() + hoisted.size() + 1);
+	for (size_t i=0; i<code.size(); i++) {
+		if (i == loop.header) result.insert(result.end(), hoisted.begin(), hoisted.end());
+		moved_to[i] = result.size();
+		result.push_back(code[i]);
+		if (static_cast<int>(i) == loop.exit) {
+			Instruction pop{+OP::POP, {}, -1, code[i].line};
+			result.push_back(pop);
+		}
+	}
+	for (Instruction &ins : result) {
+		if (ins.target != -1) ins.target = moved_to[ins.target];
+	}
+	code = std::move(result);
+	return true;
+}
+
+// Replaces arithmetic and comparisons on values that are always numbers with
+// their unchecked forms
+bool specialize_numbers(Function &fn) {
+	bool changed = false;
+	for (Block &block : fn.blocks) {
+		if (block.entry.empty()) continue;
+		std::vector<ValueId> slots = block.entry;
+		for (size_t i=block.first; i<=block.last; i++) {
+			Instruction &ins = fn.code[i];
+			u8 unchecked = unchecked_form(ins.op);
+			if (unchecked != ins.op && fn.is_number(slots[slots.size() - 2]) && fn.is_number(slots.back())) {
+				ins.op = unchecked;
+				changed = true;
+			}
+			fn.step(slots, i);
+		}
+	}
+	return changed;
+}
+
+bool hoist_invariants(Function &fn) {
+	for (size_t i=0; i<fn.code.size(); i++) {
+		Loop loop;
+		if (fn.code[i].op == +OP::LOOP && find_loop(fn, i, loop) && hoist(fn, loop)) return true;
+	}
+	return false;
+}
+
+}
+
+}
+
+void optimize_ssa(Chunk &chunk, int arity, bool peephole) {
+	// each pass changes the code under the others, so the SSA form is
+	// rebuilt after every one
+	constexpr int MAX_ROUNDS = 16;
+	for (int round=0; round<MAX_ROUNDS; round++) {
+		bool changed = false;
+		for (auto pass : {ssa::propagate, ssa::remove_dead_stores, ssa::hoist_invariants}) {
+			ssa::Function fn(chunk, arity);
+			if (!fn.build()) return;
+			if (pass(fn)) {
+				encode_chunk(chunk, fn.code);
+				changed = true;
+			}
+		}
+		if (peephole) {
+			ChunkArray<u8> before = chunk.code;
+			optimize_chunk(chunk);
+			changed |= chunk.code != before;
+		}
+		if (!changed) break;
+	}
+	ssa::Function fn(chunk, arity);
+	if (fn.build() && ssa::specialize_numbers(fn)) encode_chunk(chunk, fn.code);
+}
+
+}
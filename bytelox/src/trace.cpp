@@ -0,0 +1,766 @@
+#include "trace.hpp"
+#include "assembler.hpp"
+#include "lox_object.hpp"
+#include "optimizer.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+
+namespace bytelox {
+
+#ifdef BYTELOX_JIT
+
+namespace {
+
+using namespace x64;
+using Frame = VM::CallFrame;
+
+// instructions recorded before giving up on a loop
+constexpr size_t MAX_TRACE_LENGTH = 512;
+
+// an instruction the recorded iteration ran
+struct Step {
+	u32 offset;
+	bool taken = false; // whether a conditional jump jumped
+};
+
+// where the jump instruction at ip goes
+u8 *jump_target(u8 *ip, size_t size) {
+	u8 *field = ip + size - 2;
+	return field + jump_direction(*ip) * (field[0] | (field[1] << 8));
+}
+
+// Runs the loop body like the interpreter does, as long as it only runs
+// instructions a trace can compile, on types a trace can keep unboxed: locals
+// from before the loop have to stay numbers, anything pushed since can also be
+// a boolean or nil.
+struct Recorder {
+	VM &vm;
+	Frame &frame;
+	Chunk &chunk;
+	u32 depth; // frame's stack size at the top of the loop
+	std::vector<Step> steps;
+
+	Recorder(VM &vm, Frame &frame): vm(vm), frame(frame), chunk(frame.closure->function->chunk),
+			depth(vm.stack.size() - frame.slots) {}
+
+	LoxValue &local(u8 slot) {
+		return vm.stack[frame.slots + slot];
+	}
+	// values pushed since the top of the loop
+	size_t height() {
+		return vm.stack.size() - frame.slots - depth;
+	}
+	bool can_write(u8 slot, LoxValue value) {
+		return slot >= depth || value.is_number();
+	}
+
+	// reads a register op's operands, popping STACK ones, false if they
+	// aren't numbers
+	bool read_numbers(u8 mode, u8 lhs_index, u8 rhs_index, f64 &lhs, f64 &rhs) {
+		RegisterKind kinds[] = {static_cast<RegisterKind>(mode & 3), static_cast<RegisterKind>((mode >> 2) & 3)};
+		u8 indices[] = {lhs_index, rhs_index};
+		size_t pops = (kinds[0] == RegisterKind::STACK) + (kinds[1] == RegisterKind::STACK);
+		if (height() < pops) return false;
+		LoxValue values[2];
+		size_t on_stack = pops;
+		for (int i=0; i<2; i++) {
+			switch (kinds[i]) {
+				case RegisterKind::STACK: values[i] = vm.peek(--on_stack); break;
+				case RegisterKind::LOCAL: values[i] = local(indices[i]); break;
+				case RegisterKind::CONSTANT: values[i] = chunk.constants[indices[i]]; break;
+			}
+			if (!values[i].is_number()) return false;
+		}
+		for (size_t i=0; i<pops; i++) vm.stack.pop_back();
+		lhs = values[0].as.number;
+		rhs = values[1].as.number;
+		return true;
+	}
+
+	// false if recording stopped before the loop got back to header. The
+	// increment of a for loop is its own loop, jumping back to the condition,
+	// so any jump is followed, but running anything twice means an inner loop.
+	bool record(u8 *header) {
+		std::vector<bool> visited(chunk.code.size());
+		for (;;) {
+			u8 *ip = frame.ip;
+			size_t size = chunk.instruction_size(ip - chunk.code.data());
+			Step step{static_cast<u32>(ip - chunk.code.data())};
+			if (steps.size() == MAX_TRACE_LENGTH || visited[step.offset]) return false;
+			visited[step.offset] = true;
+			u8 *next = ip + size;
+			switch (*ip) {
+				case +OP::CONSTANT:
+				case +OP::CONSTANT_LONG: {
+					size_t index = *ip == +OP::CONSTANT ? ip[1] : ip[1] | (ip[2] << 8) | (ip[3] << 16);
+					if (!chunk.constants[index].is_number()) return false;
+					vm.stack.push_back(chunk.constants[index]);
+					break;
+				}
+				case +OP::NIL: vm.stack.push_back(LoxValue()); break;
+				case +OP::TRUE: vm.stack.push_back(LoxValue(true)); break;
+				case +OP::FALSE: vm.stack.push_back(LoxValue(false)); break;
+				case +OP::POP:
+					if (height() < 1) return false;
+					vm.stack.pop_back();
+					break;
+				case +OP::GET_LOCAL:
+					if (ip[1] < depth && !local(ip[1]).is_number()) return false;
+					vm.stack.push_back(local(ip[1]));
+					break;
+				case +OP::SET_LOCAL:
+				case +OP::SET_LOCAL_POP:
+					if (height() < 1 || !can_write(ip[1], vm.peek())) return false;
+					local(ip[1]) = vm.peek();
+					if (*ip == +OP::SET_LOCAL_POP) vm.stack.pop_back();
+					break;
+				case +OP::EQUAL:
+				case +OP::NOT_EQUAL:
+				case +OP::GREATER:
+				case +OP::GREATER_EQUAL:
+				case +OP::LESS:
+				case +OP::LESS_EQUAL:
+				case +OP::ADD:
+				case +OP::ADD_NUM:
+				case +OP::ADD_STR:
+				case +OP::SUB:
+				case +OP::MUL:
+				case +OP::DIV:
+				case +OP::ADD_UNCHECKED:
+				case +OP::SUB_UNCHECKED:
+				case +OP::MUL_UNCHECKED:
+				case +OP::DIV_UNCHECKED:
+				case +OP::GREATER_UNCHECKED:
+				case +OP::GREATER_EQUAL_UNCHECKED:
+				case +OP::LESS_UNCHECKED:
+				case +OP::LESS_EQUAL_UNCHECKED: {
+					if (height() < 2 || !vm.peek(1).is_number() || !vm.peek().is_number()) return false;
+					f64 a = vm.peek(1).as.number, b = vm.peek().as.number;
+					LoxValue result;
+					switch (checked_form(*ip)) {
+						case +OP::EQUAL: result = LoxValue(a == b); break;
+						case +OP::NOT_EQUAL: result = LoxValue(a != b); break;
+						case +OP::GREATER: result = LoxValue(a > b); break;
+						case +OP::GREATER_EQUAL: result = LoxValue(a >= b); break;
+						case +OP::LESS: result = LoxValue(a < b); break;
+						case +OP::LESS_EQUAL: result = LoxValue(a <= b); break;
+						case +OP::SUB: result = LoxValue(a - b); break;
+						case +OP::MUL: result = LoxValue(a * b); break;
+						case +OP::DIV: result = LoxValue(a / b); break;
+						default: result = LoxValue(a + b); break;
+					}
+					vm.stack.pop_back();
+					vm.peek() = result;
+					break;
+				}
+				case +OP::NOT:
+					if (height() < 1) return false;
+					vm.peek() = is_falsey(vm.peek());
+					break;
+				case +OP::NEGATE:
+					if (height() < 1 || !vm.peek().is_number()) return false;
+					vm.peek().as.number *= -1;
+					break;
+				case +OP::JUMP:
+					next = jump_target(ip, size);
+					break;
+				case +OP::JUMP_IF_FALSE:
+					if (height() < 1) return false;
+					step.taken = is_falsey(vm.peek());
+					if (step.taken) next = jump_target(ip, size);
+					break;
+				case +OP::LOOP:
+				case +OP::LOOP_TRACE:
+					next = jump_target(ip, size);
+					if (next != header) break;
+					if (height() != 0) return false;
+					steps.push_back(step);
+					frame.ip = header;
+					return true;
+				case +OP::FOR_LOOP:
+				case +OP::FOR_LOOP_TRACE: {
+					LoxValue &counter = local(ip[2]);
+					LoxValue bound = static_cast<RegisterKind>(ip[1]) == RegisterKind::LOCAL ? local(ip[4]) : chunk.constants[ip[4]];
+					if (!counter.is_number() || !bound.is_number()) return false;
+					f64 value = counter.as.number + chunk.constants[ip[3]].as.number;
+					if (ip[4] == ip[2] && static_cast<RegisterKind>(ip[1]) == RegisterKind::LOCAL) bound = LoxValue(value);
+					step.taken = value < bound.as.number;
+					if (step.taken) next = jump_target(ip, size);
+					if (next == header && height() != 0) return false;
+					counter.as.number = value;
+					if (next != header) break;
+					steps.push_back(step);
+					frame.ip = header;
+					return true;
+				}
+				case +OP::ADD_LOCALS:
+				case +OP::ADD_LOCALS_NUM:
+				case +OP::ADD_LOCAL_CONSTANT:
+				case +OP::ADD_LOCAL_CONSTANT_NUM:
+				case +OP::SUB_LOCAL_CONSTANT:
+				case +OP::LESS_LOCALS_JUMP:
+				case +OP::LESS_LOCAL_CONSTANT_JUMP: {
+					bool locals = *ip == +OP::ADD_LOCALS || *ip == +OP::ADD_LOCALS_NUM || *ip == +OP::LESS_LOCALS_JUMP;
+					LoxValue a = local(ip[1]);
+					LoxValue b = locals ? local(ip[2]) : chunk.constants[ip[2]];
+					if (!a.is_number() || !b.is_number()) return false;
+					if (*ip == +OP::LESS_LOCALS_JUMP || *ip == +OP::LESS_LOCAL_CONSTANT_JUMP) {
+						step.taken = !(a.as.number < b.as.number);
+						if (step.taken) next = jump_target(ip, size);
+					}
+					else if (*ip == +OP::SUB_LOCAL_CONSTANT) {
+						vm.stack.push_back(LoxValue(a.as.number - b.as.number));
+					}
+					else {
+						vm.stack.push_back(LoxValue(a.as.number + b.as.number));
+					}
+					break;
+				}
+				case +OP::MOVE: {
+					auto kind = static_cast<RegisterKind>(ip[1] & 3);
+					LoxValue value = kind == RegisterKind::LOCAL ? local(ip[3]) : chunk.constants[ip[3]];
+					if (kind == RegisterKind::STACK || (kind == RegisterKind::CONSTANT && !value.is_number())) {
+						return false;
+					}
+					if ((kind == RegisterKind::LOCAL && ip[3] < depth && !value.is_number()) || !can_write(ip[2], value)) {
+						return false;
+					}
+					local(ip[2]) = value;
+					break;
+				}
+				case +OP::ADD_R:
+				case +OP::SUB_R:
+				case +OP::MUL_R:
+				case +OP::DIV_R: {
+					f64 a, b;
+					if (!read_numbers(ip[1], ip[3], ip[4], a, b)) return false;
+					LoxValue result;
+					switch (*ip) {
+						case +OP::ADD_R: result = LoxValue(a + b); break;
+						case +OP::SUB_R: result = LoxValue(a - b); break;
+						case +OP::MUL_R: result = LoxValue(a * b); break;
+						default: result = LoxValue(a / b); break;
+					}
+					if (static_cast<RegisterKind>((ip[1] >> 4) & 3) == RegisterKind::LOCAL) local(ip[2]) = result;
+					else vm.stack.push_back(result);
+					break;
+				}
+				default:
+					return false;
+			}
+			steps.push_back(step);
+			frame.ip = next;
+		}
+	}
+};
+
+// A number the trace keeps unboxed, in an xmm register or a constant
+struct Number {
+	int reg = -1;
+	const LoxValue *constant = nullptr;
+};
+
+// What the trace knows about a value pushed since the top of the loop
+struct Value {
+	enum Kind: u8 { NUMBER, BOOL, NIL, COMPARE } kind;
+	Number lhs;           // the NUMBER, or the operands of a COMPARE
+	Number rhs;
+	u8 compare = 0;       // COMPARE: the op, only evaluated by the jump that needs it
+	bool boolean = false; // BOOL, or a COMPARE negated by NOT
+
+	Value(Kind kind, Number lhs = {}, Number rhs = {}, u8 compare = 0):
+			kind(kind), lhs(lhs), rhs(rhs), compare(compare) {}
+	static Value of(bool boolean) {
+		Value value(BOOL);
+		value.boolean = boolean;
+		return value;
+	}
+};
+
+// Where a trace goes back to the VM. The stack above the loop's locals is
+// written out from what the trace knew about it there.
+struct Exit {
+	std::vector<size_t> jumps;
+	u8 *resume;
+	std::vector<Value> stack;
+};
+
+const LoxValue minus_one(-1.0);
+
+constexpr i32 VALUE_SIZE = sizeof(LoxValue);
+constexpr i32 NUMBER_OFFSET = offsetof(LoxValue, as);
+constexpr int FIRST_REGISTER = 2; // xmm0 and xmm1 are scratch
+constexpr int REGISTERS = 16;
+
+// Compiles the recorded iteration into a loop over it. Locals from before the
+// loop are checked to be numbers once on entry and live in registers after
+// that, so nothing inside the loop checks types. Only the conditional jumps
+// whose direction isn't already known from the recording are guarded.
+// Entered with the frame's slots in rdi and the stack in rsi, r8 counts
+// iterations.
+struct TraceCompiler {
+	Chunk &chunk;
+	Trace &trace;
+	const std::vector<Step> &steps;
+	u8 *header;
+	bool hoist_constants; // keep constants in registers for the whole loop too
+	Assembler as;
+	bool failed = false;
+	int local_registers[UINT8_MAX + 1];
+	std::vector<u8> locals; // with a register
+	std::vector<std::pair<const LoxValue *, int>> constants; // with a register
+	bool reserved[REGISTERS] = {}; // by a local or a constant
+	bool temporary[REGISTERS] = {}; // used for a value somewhere in the loop
+	std::vector<Value> stack;
+	std::vector<Exit> exits;
+	u32 max_stack = 0;
+
+	TraceCompiler(Chunk &chunk, Trace &trace, const std::vector<Step> &steps, u8 *header, bool hoist_constants):
+			chunk(chunk), trace(trace), steps(steps), header(header), hoist_constants(hoist_constants) {
+		std::fill(std::begin(local_registers), std::end(local_registers), -1);
+	}
+
+	bool referenced(int reg) {
+		for (Value &value : stack) {
+			if (value.lhs.reg == reg || value.rhs.reg == reg) return true;
+		}
+		return false;
+	}
+	// a register no value uses, other than avoid
+	int allocate(int avoid = -1) {
+		for (int reg = FIRST_REGISTER; reg < REGISTERS; reg++) {
+			if (!reserved[reg] && reg != avoid && !referenced(reg)) {
+				temporary[reg] = true;
+				return reg;
+			}
+		}
+		failed = true;
+		return FIRST_REGISTER;
+	}
+	// a register for the whole loop, from the other end to the temporaries
+	// since it's reserved after values earlier in the loop got theirs
+	int reserve() {
+		for (int reg = REGISTERS - 1; reg >= FIRST_REGISTER; reg--) {
+			if (!reserved[reg] && !temporary[reg]) {
+				reserved[reg] = true;
+				return reg;
+			}
+		}
+		failed = true;
+		return FIRST_REGISTER;
+	}
+
+	// a register holding number, constants are loaded into scratch
+	XMM in_register(Number number, XMM scratch) {
+		if (number.reg != -1) return XMM(number.reg);
+		as.mov(RAX, (u64) number.constant);
+		as.sse(MOVSD, scratch, RAX, NUMBER_OFFSET);
+		return scratch;
+	}
+	void load(XMM reg, Number number) {
+		if (number.reg == reg) return;
+		if (number.reg != -1) as.sse(MOVSD, reg, XMM(number.reg));
+		else in_register(number, reg);
+	}
+
+	Number constant(const LoxValue *value) {
+		if (!hoist_constants) return {-1, value};
+		for (auto [hoisted, reg] : constants) {
+			if (std::bit_cast<u64>(hoisted->as.number) == std::bit_cast<u64>(value->as.number)) return {reg};
+		}
+		int reg = reserve();
+		constants.push_back({value, reg});
+		return {reg};
+	}
+	Number constant_at(size_t index) {
+		return constant(&chunk.constants[index]);
+	}
+	Number frame_local(u8 slot) {
+		if (local_registers[slot] == -1) {
+			local_registers[slot] = reserve();
+			locals.push_back(slot);
+		}
+		return {local_registers[slot]};
+	}
+
+	void push(Value value) {
+		stack.push_back(value);
+		max_stack = std::max<u32>(max_stack, stack.size());
+	}
+	Value pop() {
+		if (stack.empty()) {
+			failed = true;
+			return {Value::NIL};
+		}
+		Value value = stack.back();
+		stack.pop_back();
+		return value;
+	}
+	Number number(Value value) {
+		if (value.kind != Value::NUMBER) failed = true;
+		return value.lhs;
+	}
+	Value get_local(u8 slot) {
+		if (slot < trace.depth) return {Value::NUMBER, frame_local(slot)};
+		if (slot - trace.depth >= stack.size()) {
+			failed = true;
+			return {Value::NIL};
+		}
+		return stack[slot - trace.depth];
+	}
+	void set_local(u8 slot, Value value) {
+		if (slot >= trace.depth) {
+			if (slot - trace.depth >= stack.size()) failed = true;
+			else stack[slot - trace.depth] = value;
+			return;
+		}
+		Number local = frame_local(slot);
+		if (value.kind != Value::NUMBER) {
+			failed = true;
+			return;
+		}
+		// values pushed from the local before keep what it was
+		int copy = -1;
+		for (Value &pushed : stack) {
+			for (Number *operand : {&pushed.lhs, &pushed.rhs}) {
+				if (operand->reg != local.reg) continue;
+				if (copy == -1) {
+					copy = allocate(value.lhs.reg);
+					as.sse(MOVSD, XMM(copy), XMM(local.reg));
+				}
+				operand->reg = copy;
+			}
+		}
+		load(XMM(local.reg), value.lhs);
+	}
+	// a register operand of a register op, STACK ones are popped
+	Value read_register(RegisterKind kind, u8 index) {
+		switch (kind) {
+			case RegisterKind::STACK: return pop();
+			case RegisterKind::LOCAL: return get_local(index);
+			case RegisterKind::CONSTANT: return {Value::NUMBER, constant_at(index)};
+		}
+		return {Value::NIL}; // unreachable
+	}
+
+	// into is the register of a local the result is stored to, which is
+	// updated in place if lhs is that local and nothing else needs it
+	Value arithmetic(SSE op, Number lhs, Number rhs, int into = -1) {
+		bool in_place = lhs.reg != -1 && lhs.reg != rhs.reg && !referenced(lhs.reg) &&
+				(!reserved[lhs.reg] || lhs.reg == into);
+		int reg = in_place ? lhs.reg : allocate(rhs.reg);
+		load(XMM(reg), lhs);
+		as.sse(op, XMM(reg), in_register(rhs, XMM1));
+		return {Value::NUMBER, {reg}};
+	}
+	void binary(SSE op) {
+		Number rhs = number(pop());
+		Number lhs = number(pop());
+		push(arithmetic(op, lhs, rhs));
+	}
+	void compare(u8 op) {
+		Number rhs = number(pop());
+		Number lhs = number(pop());
+		push({Value::COMPARE, lhs, rhs, op});
+	}
+
+	// exits to resume with exit_stack, unless compare comes out as want
+	void guard(Value compare, bool want, u8 *resume, std::vector<Value> exit_stack) {
+		for (Value &value : exit_stack) {
+			if (value.kind == Value::COMPARE) failed = true;
+		}
+		u8 op = compare.compare;
+		Number a = compare.lhs, b = compare.rhs;
+		want ^= compare.boolean;
+		if (op == +OP::NOT_EQUAL) {
+			op = +OP::EQUAL;
+			want = !want;
+		}
+		if (op == +OP::LESS || op == +OP::LESS_EQUAL) {
+			std::swap(a, b);
+			op = op == +OP::LESS ? +OP::GREATER : +OP::GREATER_EQUAL;
+		}
+		XMM lhs = in_register(a, XMM0);
+		XMM rhs = in_register(b, XMM1);
+		as.compare_double(lhs, rhs);
+		Exit exit{{}, resume, std::move(exit_stack)};
+		// ucomisd sets flags like an unsigned compare, with unordered as
+		// below and equal, with parity set
+		switch (op) {
+			case +OP::GREATER:
+				exit.jumps.push_back(as.jump_if(want ? BELOW_EQUAL : ABOVE));
+				break;
+			case +OP::GREATER_EQUAL:
+				exit.jumps.push_back(as.jump_if(want ? BELOW : ABOVE_EQUAL));
+				break;
+			default:
+				if (want) {
+					exit.jumps.push_back(as.jump_if(NOT_EQUAL));
+					exit.jumps.push_back(as.jump_if(PARITY));
+				}
+				else {
+					size_t unordered = as.jump_if(PARITY);
+					exit.jumps.push_back(as.jump_if(EQUAL));
+					as.bind(unordered);
+				}
+				break;
+		}
+		max_stack = std::max<u32>(max_stack, exit.stack.size());
+		exits.push_back(std::move(exit));
+	}
+
+	void compile_step(const Step &step) {
+		u8 *ip = &chunk.code[step.offset];
+		size_t size = chunk.instruction_size(step.offset);
+		u8 *next = ip + size;
+		switch (*ip) {
+			case +OP::CONSTANT: push({Value::NUMBER, constant_at(ip[1])}); break;
+			case +OP::CONSTANT_LONG: push({Value::NUMBER, constant_at(ip[1] | (ip[2] << 8) | (ip[3] << 16))}); break;
+			case +OP::NIL: push({Value::NIL}); break;
+			case +OP::TRUE: push(Value::of(true)); break;
+			case +OP::FALSE: push(Value::of(false)); break;
+			case +OP::POP: pop(); break;
+			case +OP::GET_LOCAL: push(get_local(ip[1])); break;
+			case +OP::SET_LOCAL:
+			case +OP::SET_LOCAL_POP:
+				if (stack.empty()) {
+					failed = true;
+					break;
+				}
+				set_local(ip[1], stack.back());
+				if (*ip == +OP::SET_LOCAL_POP) pop();
+				break;
+			case +OP::EQUAL:
+			case +OP::NOT_EQUAL:
+			case +OP::GREATER:
+			case +OP::GREATER_EQUAL:
+			case +OP::LESS:
+			case +OP::LESS_EQUAL:
+			case +OP::GREATER_UNCHECKED:
+			case +OP::GREATER_EQUAL_UNCHECKED:
+			case +OP::LESS_UNCHECKED:
+			case +OP::LESS_EQUAL_UNCHECKED:
+				compare(checked_form(*ip));
+				break;
+			case +OP::ADD:
+			case +OP::ADD_NUM:
+			case +OP::ADD_STR:
+			case +OP::ADD_UNCHECKED:
+				binary(ADDSD);
+				break;
+			case +OP::SUB:
+			case +OP::SUB_UNCHECKED:
+				binary(SUBSD);
+				break;
+			case +OP::MUL:
+			case +OP::MUL_UNCHECKED:
+				binary(MULSD);
+				break;
+			case +OP::DIV:
+			case +OP::DIV_UNCHECKED:
+				binary(DIVSD);
+				break;
+			case +OP::NOT: {
+				Value value = pop();
+				switch (value.kind) {
+					case Value::NUMBER: value = Value::of(false); break;
+					case Value::NIL: value = Value::of(true); break;
+					default: value.boolean = !value.boolean; break;
+				}
+				push(value);
+				break;
+			}
+			case +OP::NEGATE:
+				push(arithmetic(MULSD, number(pop()), constant(&minus_one)));
+				break;
+			case +OP::JUMP:
+			case +OP::LOOP:
+			case +OP::LOOP_TRACE:
+				break;
+			case +OP::JUMP_IF_FALSE: {
+				if (stack.empty()) {
+					failed = true;
+					break;
+				}
+				Value &condition = stack.back();
+				bool truthy = condition.kind == Value::NUMBER || (condition.kind == Value::BOOL && condition.boolean);
+				if (condition.kind != Value::COMPARE && truthy == step.taken) failed = true;
+				if (condition.kind == Value::COMPARE) {
+					// the condition is left on the stack for the other path
+					std::vector<Value> exit_stack = stack;
+					exit_stack.back() = Value::of(step.taken);
+					Value compare = condition;
+					condition = Value::of(!step.taken);
+					guard(compare, !step.taken, step.taken ? next : jump_target(ip, size), exit_stack);
+				}
+				// numbers are always truthy, booleans and nil known to be what was recorded
+				break;
+			}
+			case +OP::ADD_LOCALS:
+			case +OP::ADD_LOCALS_NUM:
+				push(arithmetic(ADDSD, number(get_local(ip[1])), number(get_local(ip[2]))));
+				break;
+			case +OP::ADD_LOCAL_CONSTANT:
+			case +OP::ADD_LOCAL_CONSTANT_NUM:
+				push(arithmetic(ADDSD, number(get_local(ip[1])), constant_at(ip[2])));
+				break;
+			case +OP::SUB_LOCAL_CONSTANT:
+				push(arithmetic(SUBSD, number(get_local(ip[1])), constant_at(ip[2])));
+				break;
+			case +OP::LESS_LOCALS_JUMP:
+			case +OP::LESS_LOCAL_CONSTANT_JUMP: {
+				Number a = number(get_local(ip[1]));
+				Number b = *ip == +OP::LESS_LOCALS_JUMP ? number(get_local(ip[2])) : constant_at(ip[2]);
+				guard({Value::COMPARE, a, b, +OP::LESS}, !step.taken, step.taken ? next : jump_target(ip, size), stack);
+				break;
+			}
+			case +OP::FOR_LOOP:
+			case +OP::FOR_LOOP_TRACE: {
+				int into = ip[2] < trace.depth ? frame_local(ip[2]).reg : -1;
+				set_local(ip[2], arithmetic(ADDSD, number(get_local(ip[2])), constant_at(ip[3]), into));
+				Number counter = number(get_local(ip[2]));
+				Number bound = number(read_register(static_cast<RegisterKind>(ip[1]), ip[4]));
+				// jumping back is the way round the loop
+				guard({Value::COMPARE, counter, bound, +OP::LESS}, step.taken, step.taken ? next : jump_target(ip, size), stack);
+				break;
+			}
+			case +OP::MOVE:
+				set_local(ip[2], read_register(static_cast<RegisterKind>(ip[1] & 3), ip[3]));
+				break;
+			case +OP::ADD_R:
+			case +OP::SUB_R:
+			case +OP::MUL_R:
+			case +OP::DIV_R: {
+				Number rhs = number(read_register(static_cast<RegisterKind>((ip[1] >> 2) & 3), ip[4]));
+				Number lhs = number(read_register(static_cast<RegisterKind>(ip[1] & 3), ip[3]));
+				SSE op = *ip == +OP::ADD_R ? ADDSD : *ip == +OP::SUB_R ? SUBSD : *ip == +OP::MUL_R ? MULSD : DIVSD;
+				if (static_cast<RegisterKind>((ip[1] >> 4) & 3) == RegisterKind::STACK) {
+					push(arithmetic(op, lhs, rhs));
+					break;
+				}
+				int into = ip[2] < trace.depth ? frame_local(ip[2]).reg : -1;
+				set_local(ip[2], arithmetic(op, lhs, rhs, into));
+				break;
+			}
+			default:
+				failed = true;
+				break;
+		}
+	}
+
+	// writes value to [rdx + disp]
+	void store(i32 disp, const Value &value) {
+		switch (value.kind) {
+			case Value::NUMBER:
+				as.store32(RDX, disp, +ValueType::NUMBER);
+				as.store_double(RDX, disp + NUMBER_OFFSET, in_register(value.lhs, XMM0));
+				break;
+			case Value::BOOL:
+				as.store32(RDX, disp, +ValueType::BOOL);
+				as.store64(RDX, disp + NUMBER_OFFSET, value.boolean);
+				break;
+			default:
+				as.store32(RDX, disp, +ValueType::NIL);
+				as.store64(RDX, disp + NUMBER_OFFSET, 0);
+				break;
+		}
+	}
+
+	bool compile() {
+		size_t entry = as.jmp();
+		size_t loop = as.code.size();
+		// the LOOP back to the top of the last step compiles to nothing, but a
+		// FOR_LOOP still has its increment and condition
+		for (size_t i=0; i<steps.size() && !failed; i++) {
+			compile_step(steps[i]);
+		}
+		if (failed || !stack.empty()) return false;
+		as.add(R8, 1);
+		as.patch(as.jmp(), loop);
+
+		// exits write back the stack, then share writing back the locals
+		std::vector<size_t> to_tail;
+		for (Exit &exit : exits) {
+			for (size_t jump : exit.jumps) as.bind(jump);
+			if (!exit.stack.empty()) {
+				as.load(RDX, RSI, offsetof(ValueStack, top));
+				for (size_t i=0; i<exit.stack.size(); i++) {
+					store(i * VALUE_SIZE, exit.stack[i]);
+				}
+				as.add(RDX, exit.stack.size() * VALUE_SIZE);
+				as.store(RSI, offsetof(ValueStack, top), RDX);
+			}
+			as.mov(RAX, (u64) exit.resume);
+			to_tail.push_back(as.jmp());
+		}
+		for (size_t jump : to_tail) as.bind(jump);
+		for (u8 slot : locals) {
+			as.store_double(RDI, slot * VALUE_SIZE + NUMBER_OFFSET, XMM(local_registers[slot]));
+		}
+		as.mov(RCX, (u64) &trace.iterations);
+		as.add_to(RCX, 0, R8);
+		as.ret();
+
+		// entering with a local that isn't a number runs nothing
+		size_t bail = as.code.size();
+		as.mov(RAX, (u64) header);
+		as.ret();
+
+		as.bind(entry);
+		for (u8 slot : locals) {
+			as.cmp32(RDI, slot * VALUE_SIZE, +ValueType::NUMBER);
+			as.patch(as.jump_if(NOT_EQUAL), bail);
+		}
+		for (u8 slot : locals) {
+			as.sse(MOVSD, XMM(local_registers[slot]), RDI, slot * VALUE_SIZE + NUMBER_OFFSET);
+		}
+		for (auto [value, reg] : constants) {
+			as.mov(RAX, (u64) value);
+			as.sse(MOVSD, XMM(reg), RAX, NUMBER_OFFSET);
+		}
+		as.mov(R8, 0);
+		as.patch(as.jmp(), loop);
+		return true;
+	}
+};
+
+}
+
+u8 *Trace::run(VM &vm, VM::CallFrame &frame) {
+	using Entry = u8 *(*)(LoxValue *slots, ValueStack *stack);
+	return reinterpret_cast<Entry>(native->code)(&vm.stack[frame.slots], &vm.stack);
+}
+
+bool record_trace(VM &vm, VM::CallFrame &frame, Trace &trace) {
+	u8 *header = frame.ip;
+	Recorder recorder(vm, frame);
+	if (!recorder.record(header)) return false;
+	trace.depth = recorder.depth;
+	Chunk &chunk = frame.closure->function->chunk;
+	for (bool hoist_constants : {true, false}) {
+		TraceCompiler compiler(chunk, trace, recorder.steps, header, hoist_constants);
+		if (!compiler.compile()) continue;
+		trace.max_stack = compiler.max_stack;
+		trace.native = vm.code_cache.install(compiler.as.code, {});
+		return trace.native != nullptr;
+	}
+	return false;
+}
+
+#else
+
+u8 *Trace::run(VM &, VM::CallFrame &frame) {
+	return frame.ip;
+}
+
+bool record_trace(VM &, VM::CallFrame &, Trace &) {
+	return false;
+}
+
+#endif
+
+}
@@ -0,0 +1,349 @@
+#include "verifier.hpp"
+#include "chunk.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace bytelox {
+
+namespace {
+
+// A decoded instruction, with only what checking it needs
+struct Step {
+	size_t size = 0;
+	int pops = 0;   // values it reads off the top, counting ones it only peeks at
+	int pushes = 0; // values it leaves in their place
+	int peak = 0;   // most values it has above the height before it at once
+	// slots of the frame it reads or writes, which have to be under the
+	// height before it
+	u32 slots = 0;
+	size_t target = SIZE_MAX; // offset it can jump to
+	bool falls_through = true;
+};
+
+// the ops the compiler makes WIDE, and run_wide runs
+bool can_be_wide(u8 op) {
+	switch (op) {
+		case +OP::CONSTANT:
+		case +OP::GET_LOCAL:
+		case +OP::SET_LOCAL:
+		case +OP::GET_GLOBAL:
+		case +OP::DEFINE_GLOBAL:
+		case +OP::SET_GLOBAL:
+		case +OP::GET_UPVALUE:
+		case +OP::SET_UPVALUE:
+		case +OP::GET_PROPERTY:
+		case +OP::SET_PROPERTY:
+		case +OP::GET_SUPER:
+		case +OP::JUMP:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::LOOP:
+		case +OP::INVOKE:
+		case +OP::SUPER_INVOKE:
+		case +OP::CLOSURE:
+		case +OP::CLASS:
+		case +OP::METHOD:
+			return true;
+		default:
+			return false;
+	}
+}
+
+struct Verifier {
+	ObjectFunction &fn;
+	Chunk &chunk;
+
+	explicit Verifier(ObjectFunction &fn): fn(fn), chunk(fn.chunk) {}
+
+	// decodes the instruction at offset into step, false if it isn't one
+	bool decode(size_t offset, Step &step) {
+		ChunkArray<u8> &code = chunk.code;
+		size_t at = offset;
+		bool wide = code[at] == +OP::WIDE;
+		if (wide && ++at == code.size()) return false;
+		u8 op = code[at++];
+		if (wide && !can_be_wide(op)) return false;
+		bool ok = true;
+
+		auto byte = [&]() -> u32 {
+			if (at == code.size()) {
+				ok = false;
+				return 0;
+			}
+			return code[at++];
+		};
+		// the next operand, 2 bytes after WIDE
+		auto read = [&]() -> u32 {
+			u32 operand = byte();
+			if (wide) operand |= byte() << 8;
+			return operand;
+		};
+		auto constant = [&](u32 index) {
+			if (index >= chunk.constants.size()) {
+				ok = false;
+				return LoxValue();
+			}
+			return chunk.constants[index];
+		};
+		auto string = [&](u32 index) {
+			ok = constant(index).is_string() && ok;
+		};
+		auto local = [&](u32 slot) {
+			step.slots = std::max(step.slots, slot + 1);
+		};
+		auto upvalue = [&](u32 index) {
+			ok = ok && index < static_cast<u32>(fn.upvalue_count);
+		};
+		// a register op operand of kind RegisterKind
+		auto register_operand = [&](int kind, u32 index) {
+			switch (static_cast<RegisterKind>(kind)) {
+				case RegisterKind::STACK: step.pops++; break;
+				case RegisterKind::LOCAL: local(index); break;
+				case RegisterKind::CONSTANT: constant(index); break;
+				default: ok = false; break;
+			}
+		};
+		// the jump offset, always last, relative to its own start
+		auto jump = [&](int direction) {
+			size_t field = at;
+			u32 offset = byte();
+			offset |= byte() << 8;
+			if (wide) {
+				offset |= byte() << 16;
+				offset |= byte() << 24;
+			}
+			if (direction < 0 && offset > field) ok = false;
+			else step.target = direction > 0 ? field + offset : field - offset;
+		};
+		auto effect = [&](int pops, int pushes) {
+			step.pops += pops;
+			step.pushes += pushes;
+		};
+
+		switch (op) {
+			case +OP::CONSTANT: constant(read()); effect(0, 1); break;
+			case +OP::CONSTANT_LONG: {
+				u32 index = byte();
+				index |= byte() << 8;
+				index |= byte() << 16;
+				constant(index);
+				effect(0, 1);
+				break;
+			}
+			case +OP::NIL:
+			case +OP::TRUE:
+			case +OP::FALSE:
+				effect(0, 1);
+				break;
+			case +OP::POP:
+			case +OP::PRINT:
+			case +OP::CLOSE_UPVALUE:
+				effect(1, 0);
+				break;
+			case +OP::GET_LOCAL: local(read()); effect(0, 1); break;
+			case +OP::SET_LOCAL: local(read()); effect(1, 1); break;
+			case +OP::GET_GLOBAL: string(read()); effect(0, 1); break;
+			case +OP::DEFINE_GLOBAL: string(read()); effect(1, 0); break;
+			case +OP::SET_GLOBAL: string(read()); effect(1, 1); break;
+			case +OP::GET_UPVALUE: upvalue(read()); effect(0, 1); break;
+			case +OP::SET_UPVALUE: upvalue(read()); effect(1, 1); break;
+			case +OP::GET_PROPERTY: string(read()); effect(1, 1); break;
+			case +OP::SET_PROPERTY:
+			case +OP::GET_SUPER:
+			case +OP::METHOD:
+				string(read());
+				effect(2, 1);
+				break;
+			case +OP::EQUAL:
+			case +OP::NOT_EQUAL:
+			case +OP::GREATER:
+			case +OP::GREATER_EQUAL:
+			case +OP::LESS:
+			case +OP::LESS_EQUAL:
+			case +OP::ADD:
+			case +OP::SUB:
+			case +OP::MUL:
+			case +OP::DIV:
+			case +OP::INHERIT:
+			case +OP::ADD_NUM:
+			case +OP::ADD_STR:
+			case +OP::ADD_UNCHECKED:
+			case +OP::SUB_UNCHECKED:
+			case +OP::MUL_UNCHECKED:
+			case +OP::DIV_UNCHECKED:
+			case +OP::GREATER_UNCHECKED:
+			case +OP::GREATER_EQUAL_UNCHECKED:
+			case +OP::LESS_UNCHECKED:
+			case +OP::LESS_EQUAL_UNCHECKED:
+				effect(2, 1);
+				break;
+			case +OP::NOT:
+			case +OP::NEGATE:
+				effect(1, 1);
+				break;
+			case +OP::JUMP:
+				jump(1);
+				step.falls_through = false;
+				break;
+			case +OP::JUMP_IF_FALSE: effect(1, 1); jump(1); break;
+			case +OP::LOOP:
+			case +OP::LOOP_TRACE:
+				jump(-1);
+				step.falls_through = false;
+				break;
+			case +OP::CALL:
+			case +OP::TAIL_CALL:
+				effect(read() + 1, 1);
+				break;
+			case +OP::INVOKE:
+			case +OP::SUPER_INVOKE:
+				string(read());
+				effect(read() + (op == +OP::INVOKE ? 1 : 2), 1);
+				break;
+			case +OP::CLOSURE: {
+				LoxValue function = constant(read());
+				if (!function.is_function()) return false;
+				int upvalue_count = function.as_function().upvalue_count;
+				if (upvalue_count < 0) return false;
+				for (int i=0; i<upvalue_count && ok; i++) {
+					u32 is_local = read();
+					u32 index = read();
+					// a closure can capture the slot it's about to be pushed to
+					if (is_local == 1) step.slots = std::max(step.slots, index);
+					else if (is_local == 0) upvalue(index);
+					else ok = false;
+				}
+				effect(0, 1);
+				break;
+			}
+			case +OP::RETURN:
+				effect(1, 0);
+				step.falls_through = false;
+				break;
+			case +OP::CLASS: string(read()); effect(0, 1); break;
+			case +OP::ADD_LOCALS:
+			case +OP::ADD_LOCALS_NUM:
+				local(read());
+				local(read());
+				effect(0, 1);
+				step.peak = 2; // both, to concatenate them
+				break;
+			case +OP::ADD_LOCAL_CONSTANT:
+			case +OP::ADD_LOCAL_CONSTANT_NUM:
+				local(read());
+				constant(read());
+				effect(0, 1);
+				step.peak = 2;
+				break;
+			case +OP::SUB_LOCAL_CONSTANT: local(read()); constant(read()); effect(0, 1); break;
+			case +OP::LESS_LOCALS_JUMP: local(read()); local(read()); jump(1); break;
+			case +OP::LESS_LOCAL_CONSTANT_JUMP: local(read()); constant(read()); jump(1); break;
+			case +OP::GET_LOCAL_PROPERTY: local(read()); string(read()); effect(0, 1); break;
+			case +OP::SET_LOCAL_POP: local(read()); effect(1, 0); break;
+			case +OP::MOVE: {
+				u32 mode = read();
+				local(read());
+				register_operand(mode & 3, read());
+				break;
+			}
+			case +OP::ADD_R:
+			case +OP::SUB_R:
+			case +OP::MUL_R:
+			case +OP::DIV_R: {
+				u32 mode = read();
+				u32 dst = read();
+				register_operand(mode & 3, read());
+				register_operand((mode >> 2) & 3, read());
+				switch (static_cast<RegisterKind>((mode >> 4) & 3)) {
+					case RegisterKind::STACK: effect(0, 1); break;
+					case RegisterKind::LOCAL: local(dst); break;
+					default: return false;
+				}
+				// both operands pushed back, to concatenate them
+				step.peak = 2 - step.pops;
+				break;
+			}
+			case +OP::GUARD_CALL:
+			case +OP::GUARD_INVOKE: {
+				if (!constant(read()).is_function()) return false;
+				if (op == +OP::GUARD_INVOKE) string(read());
+				int arg_count = read();
+				effect(arg_count + 1, arg_count + 1);
+				jump(1);
+				break;
+			}
+			case +OP::RETURN_INLINED:
+				effect(read() + 1, 1);
+				jump(1);
+				step.falls_through = false;
+				break;
+			case +OP::FOR_LOOP:
+			case +OP::FOR_LOOP_TRACE: {
+				u32 mode = read();
+				local(read());
+				ok = constant(read()).is_number() && ok;
+				RegisterKind bound = static_cast<RegisterKind>(mode);
+				if (bound != RegisterKind::LOCAL && bound != RegisterKind::CONSTANT) return false;
+				register_operand(mode, read());
+				jump(-1);
+				break;
+			}
+			default:
+				return false;
+		}
+		step.peak = std::max(step.peak, step.pushes - step.pops);
+		step.size = at - offset;
+		return ok;
+	}
+
+	bool verify() {
+		if (fn.arity < 0 || fn.arity > UINT8_MAX || fn.upvalue_count < 0 || chunk.code.size() == 0) {
+			return false;
+		}
+		std::vector<Step> steps;
+		std::vector<int> step_at(chunk.code.size(), -1);
+		for (size_t offset = 0; offset < chunk.code.size(); offset += steps.back().size) {
+			step_at[offset] = steps.size();
+			if (!decode(offset, steps.emplace_back())) return false;
+		}
+		for (Step &step : steps) {
+			if (step.target == SIZE_MAX) continue;
+			if (step.target >= chunk.code.size() || step_at[step.target] == -1) return false;
+			step.target = step_at[step.target];
+		}
+
+		// stack height before each step, from the callee and its arguments
+		std::vector<int> heights(steps.size(), -1);
+		std::vector<std::pair<size_t, int>> work{{0, fn.arity + 1}};
+		int max_stack = fn.arity + 1;
+		while (!work.empty()) {
+			auto [i, height] = work.back();
+			work.pop_back();
+			for (;; i++) {
+				if (i == steps.size()) return false; // ran off the end
+				if (heights[i] != -1) {
+					if (heights[i] != height) return false;
+					break;
+				}
+				heights[i] = height;
+				Step &step = steps[i];
+				if (step.pops > height || step.slots > static_cast<u32>(height)) return false;
+				max_stack = std::max(max_stack, height + step.peak);
+				height += step.pushes - step.pops;
+				if (step.target != SIZE_MAX) work.push_back({step.target, height});
+				if (!step.falls_through) break;
+			}
+		}
+		fn.max_stack = max_stack;
+		return true;
+	}
+};
+
+}
+
+bool verify_function(ObjectFunction &fn) {
+	return Verifier(fn).verify();
+}
+
+}
@@ -3,6 +3,10 @@
 #include "lox_value.hpp"
 #include "vm.hpp"
 #include "debug.hpp"
+#include "inliner.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
 
 namespace bytelox {
 
@@ -14,8 +18,7 @@ LoxValue clock_native(int, LoxValue *) {
 using enum InterpretResult;
 
 VM::VM(): objects(nullptr) {
-	Scanner scanner("");
-	compiler = new Compiler(scanner, *this);
+	compiler = std::make_unique<Compiler>(*this);
 	define_native("clock", clock_native);
 	init_string = &get_ObjectString("init").as_string();
 }
@@ -28,13 +31,37 @@ VM::~VM() {
 	}
 }
 
-InterpretResult VM::interpret(std::string_view src) {
+ObjectFunction *VM::compile(std::string_view src) {
+	if (compiler_options.lazy) {
+		sources.push_back(std::make_unique<char[]>(src.size()));
+		std::copy(src.begin(), src.end(), sources.back().get());
+		src = {sources.back().get(), src.size()};
+	}
+	return compiler->compile(Scanner(src));
+}
+
+ObjectFunction *VM::compile(std::unique_ptr<MappedFile> file) {
+	std::string_view src(file->data, file->size);
 	Scanner scanner(src);
-	compiler = new Compiler(scanner, *this);
-	ObjectFunction *fn = compiler->compile(src);
+	scanner.file = file.get();
+	source_files.push_back(std::move(file));
+	return compiler->compile(scanner);
+}
+
+bool VM::compile_lazy(ObjectFunction &fn) {
+	return compiler->compile_lazy(fn);
+}
+
+InterpretResult VM::interpret(std::string_view src) {
+	ObjectFunction *fn = compile(src);
 	if (fn == nullptr) return INTERPRET_COMPILE_ERROR;
-	
-	stack.push_back(GC<ObjectClosure>(fn));
+	return interpret(*fn);
+}
+
+InterpretResult VM::interpret(ObjectFunction &script) {
+	// on the stack while its closure is made, which can collect garbage
+	stack.push_back(&script);
+	stack.back() = GC<ObjectClosure>(&script);
 	call(stack.back().as_closure(), 0);
 	//frames.emplace_back(fn, fn->chunk.code.data(), 0);
 
@@ -67,20 +94,24 @@ template LoxValue VM::GC<ObjectFunction>();
 // Each ObjectString uniquely owns its string
 // Instead, make each LoxValue point toward a Hash Set of ObjectStrings in memory
 LoxValue VM::get_ObjectString(std::string_view str) {
-	ObjectString *interned = strings.find_string(str);
+	u32 hash = hash_string(str);
+	ObjectString *interned = strings.find_string(str, hash);
 	LoxValue res(interned);
 	if (interned == nullptr) {
-		bytes_allocated += sizeof(ObjectString);
+		bytes_allocated += sizeof(ObjectString) + str.size() + 1;
 		if (bytes_allocated > next_GC) collect_garbage();
 
-		res.as.obj = (LoxObject *) new ObjectString(str);
+		interned = new ObjectString(str);
+		interned->hash = hash;
+		interned->interned = true;
+		res.as.obj = (LoxObject *) interned;
 		res.as.obj->next = objects;
 		objects = res.as.obj;
 #ifdef DEBUG_LOG_GC
 		fmt::print("{} allocate {} for {}\n", (void *) res.as.obj, sizeof(ObjectString), "ObjectString");
 #endif
 
-		strings.set((ObjectString *) res.as.obj, LoxValue());
+		strings.set(interned, LoxValue());
 	}
 #ifdef DEBUG_STRESS_GC
 	stack.push_back(res); // prevent immediate collection
@@ -90,6 +121,44 @@ LoxValue VM::get_ObjectString(std::string_view str) {
 	return res;	
 }
 
+LoxValue VM::new_ObjectString(std::unique_ptr<char[]> chars, u32 length) {
+	// counting the chars too, which are what add up when they aren't shared
+	bytes_allocated += sizeof(ObjectString) + length + 1;
+	if (bytes_allocated > next_GC) collect_garbage();
+
+	LoxValue res((LoxObject *) new ObjectString(std::move(chars), length));
+	res.as.obj->next = objects;
+	objects = res.as.obj;
+#ifdef DEBUG_LOG_GC
+	fmt::print("{} allocate {} for {}\n", (void *) res.as.obj, sizeof(ObjectString), "ObjectString");
+#endif
+#ifdef DEBUG_STRESS_GC
+	stack.push_back(res); // prevent immediate collection
+	collect_garbage();
+	stack.pop_back();
+#endif
+	return res;
+}
+
+ObjectString *VM::intern(ObjectString &string) {
+	if (string.interned) return &string;
+	std::string_view chars(string.chars.get(), string.length);
+	if (string.hash == 0) string.hash = hash_string(chars);
+	ObjectString *interned = strings.find_string(chars, string.hash);
+	if (interned != nullptr) return interned;
+	string.interned = true;
+	strings.set(&string, LoxValue());
+	return &string;
+}
+
+bool VM::values_equal(LoxValue a, LoxValue b) {
+	if (!a.is_string() || !b.is_string() || a == b) return a == b;
+	ObjectString &x = a.as_string();
+	ObjectString &y = b.as_string();
+	if ((x.interned && y.interned) || x.length != y.length) return false;
+	return intern(x) == intern(y);
+}
+
 // end_compiler takes the function from the FunctionScope, pass it here to create
 // it in the VM
 
@@ -97,25 +166,34 @@ void VM::free_LoxObject(LoxObject *object) {
 #ifdef DEBUG_LOG_GC
 	fmt::print("{} free type {}\n", (void *) object, static_cast<int>(object->type));
 #endif
+	// deleted as what they are, LoxObject has no virtual destructor
 	switch (object->type) {
 		case ObjectType::STRING: {
-			bytes_allocated -= sizeof(ObjectString);
-			delete object; // unique_ptr frees chars
+			ObjectString *string = (ObjectString *) object;
+			bytes_allocated -= sizeof(ObjectString) + string->length + 1;
+			delete string; // unique_ptr frees chars
 			break;
 		}
 		case ObjectType::UPVALUE: {
 			bytes_allocated -= sizeof(ObjectUpvalue);
-			delete object;
+			delete (ObjectUpvalue *) object;
 			break;
 		}
 		case ObjectType::FUNCTION: {
 			bytes_allocated -= sizeof(ObjectFunction);
-			delete object;
+			ObjectFunction *fn = (ObjectFunction *) object;
+			code_cache.release(fn->jit);
+			delete fn->lazy;
+			for (Trace *trace : fn->traces) {
+				code_cache.release(trace->native);
+				delete trace;
+			}
+			delete fn;
 			break;
 		}
 		case ObjectType::NATIVE: {
 			bytes_allocated -= sizeof(ObjectNative);
-			delete object;
+			delete (ObjectNative *) object;
 			break;
 		} 
 		case ObjectType::CLOSURE: {
@@ -123,22 +201,22 @@ void VM::free_LoxObject(LoxObject *object) {
 			bytes_allocated -= sizeof(ObjectClosure);
 			bytes_allocated -= sizeof(closure->upvalues);
 			delete[] closure->upvalues;
-			delete object;
+			delete closure;
 			break;
 		}
 		case ObjectType::CLASS: {
 			bytes_allocated -= sizeof(ObjectClass);
-			delete object;
+			delete (ObjectClass *) object;
 			break;
 		}
 		case ObjectType::INSTANCE: {
 			bytes_allocated -= sizeof(ObjectInstance);
-			delete object;
+			delete (ObjectInstance *) object;
 			break;
 		}
 		case ObjectType::BOUND_METHOD: {
 			bytes_allocated -= sizeof(ObjectBoundMethod);
-			delete object;
+			delete (ObjectBoundMethod *) object;
 			break;
 		}
 	}
@@ -146,7 +224,7 @@ void VM::free_LoxObject(LoxObject *object) {
 
 void VM::define_native(std::string_view name, NativeFn fn) {
 	stack.push_back(get_ObjectString(name));
-	stack.push_back(GC<ObjectNative>(fn));
+	stack.push_back(GC<ObjectNative>(fn, name));
 	globals.set(&stack[0].as_string(), stack[1]);
 	stack.pop_back();
 	stack.pop_back();
@@ -164,15 +242,26 @@ void VM::concatenate() {
 	std::memcpy(chars.get(), a.chars.get(), a.length);
 	std::memcpy(chars.get() + a.length, b.chars.get(), b.length);
 	chars[length] = '\0';
-	LoxValue concat = get_ObjectString(chars.get());
+	LoxValue concat = new_ObjectString(std::move(chars), length);
 	stack.pop_back();
 	stack.pop_back();
 	stack.push_back(concat);
 }
 
+void ValueStack::reserve(size_t n) {
+	n = std::max<size_t>(n, 256);
+	if (values + n <= limit) return;
+	LoxValue *moved = new LoxValue[n];
+	std::copy(values, top, moved);
+	top = moved + size();
+	delete[] values;
+	values = moved;
+	limit = moved + n;
+}
+
 // inline?
 LoxValue &VM::peek(size_t i) {
-	return *(stack.rbegin() + i);
+	return stack.top[-1 - i];
 }
 
 LoxValue &VM::peek() {
@@ -184,10 +273,34 @@ bool VM::call(ObjectClosure &closure, int arg_count) {
 		runtime_error("Expected {} arguments but got {}.", closure.function->arity, arg_count);
 		return false;
 	}
-	frames.emplace_back(&closure, closure.function->chunk.code.data(), stack.size() - arg_count - 1);
+	ObjectFunction *fn = closure.function;
+	if (fn->lazy != nullptr && !compile_lazy(*fn)) [[unlikely]] {
+		runtime_error("Could not compile {}.", fn->name->chars.get());
+		return false;
+	}
+	if (fn->jit == nullptr && compiler_options.jit && ++fn->call_count == compiler_options.jit_threshold) {
+		fn->jit = jit_compile(*this, *fn);
+	}
+	size_t slots = stack.size() - arg_count - 1;
+	// the only check the frame's instructions need before pushing
+	if (slots + fn->max_stack > stack.capacity()) [[unlikely]] {
+		stack.reserve(2 * (slots + fn->max_stack));
+	}
+	frames.emplace_back(&closure, fn->chunk.code.data(), slots);
 	return true;
 }
 
+void VM::replace_caller_frame() {
+	CallFrame &caller = frames[frames.size() - 2];
+	CallFrame &callee = frames.back();
+	close_upvalues(caller.slots);
+	std::copy(&stack[callee.slots], stack.end(), &stack[caller.slots]);
+	stack.resize(caller.slots + stack.size() - callee.slots);
+	callee.slots = caller.slots;
+	caller = callee;
+	frames.pop_back();
+}
+
 bool VM::call_value(LoxValue callee, int arg_count) {
 	if (callee.is_object()) {
 		switch(callee.as.obj->type) {
@@ -227,15 +340,16 @@ bool VM::call_value(LoxValue callee, int arg_count) {
 }
 
 ObjectUpvalue *VM::capture_upvalue(u32 local_index) {
+	if (local_index < open_upvalue_at.size() && open_upvalue_at[local_index] != nullptr) {
+		return open_upvalue_at[local_index];
+	}
+	// new upvalues are almost always for the top frame, near the head
 	ObjectUpvalue *prev_upvalue = nullptr;
 	ObjectUpvalue *upvalue = open_upvalues;
 	while (upvalue != nullptr && upvalue->stack_index > local_index) {
 		prev_upvalue = upvalue;
 		upvalue = upvalue->next;
 	}
-	if (upvalue != nullptr && upvalue->stack_index == local_index) {
-		return upvalue;
-	}
 	LoxValue val = GC<ObjectUpvalue>(local_index);
 	ObjectUpvalue *created_upvalue = &val.as_upvalue();
 
@@ -246,13 +360,18 @@ ObjectUpvalue *VM::capture_upvalue(u32 local_index) {
 	else {
 		prev_upvalue->next = created_upvalue;
 	}
+	if (local_index >= open_upvalue_at.size()) open_upvalue_at.resize(local_index + 1);
+	open_upvalue_at[local_index] = created_upvalue;
 	return created_upvalue;
 }
 
 void VM::close_upvalues(u32 last_index) {
 	while (open_upvalues != nullptr && open_upvalues->stack_index >= last_index) {
 		ObjectUpvalue *upvalue = open_upvalues;
-		upvalue->closed = stack[upvalue->stack_index];
+		// a local the compiler didn't close, whose closures are all gone, can
+		// be left open past the top of the stack
+		upvalue->closed = upvalue->stack_index < stack.size() ? stack[upvalue->stack_index] : LoxValue();
+		open_upvalue_at[upvalue->stack_index] = nullptr;
 		upvalue->stack_index = UINT32_MAX;
 		open_upvalues = upvalue->next;
 	}
@@ -277,6 +396,21 @@ bool VM::bind_method(ObjectClass *klass, ObjectString *name) {
 	return true;
 }
 
+bool VM::get_property(ObjectString *name) {
+	if (!peek().is_object() || !peek().is_instance()) {
+		runtime_error("Only instances have properties.");
+		return false;
+	}
+	ObjectInstance &instance = peek().as_instance();
+	LoxValue val;
+	if (instance.fields.get(name, &val)) {
+		stack.pop_back(); // instance
+		stack.push_back(val);
+		return true;
+	}
+	return bind_method(instance.klass, name);
+}
+
 bool VM::invoke(ObjectString *name, int arg_count) {
 	LoxValue receiver = peek(arg_count);
 	if (!receiver.is_instance()) {
@@ -303,11 +437,265 @@ bool VM::invoke_from_class(ObjectClass *klass, ObjectString *name, int arg_count
 	return call(method.as_closure(), arg_count);
 }
 
+bool VM::inlined_target(CallFrame *frame, u8 *guard) {
+	Chunk &chunk = frame->closure->function->chunk;
+	ObjectFunction *fn = &chunk.constants[guard[1]].as_function();
+	LoxValue callee = peek(guard[*guard == +OP::GUARD_INVOKE ? 3 : 2]);
+	if (*guard == +OP::GUARD_INVOKE) {
+		// a field by the method's name is called instead
+		ObjectString *name = &chunk.constants[guard[2]].as_string();
+		LoxValue field;
+		if (!callee.is_instance() || callee.as_instance().fields.get(name, &field) ||
+				!callee.as_instance().klass->methods.get(name, &callee)) {
+			return false;
+		}
+	}
+	return callee.is_closure() && callee.as_closure().function == fn;
+}
+
+void VM::return_inlined(u8 drop) {
+	LoxValue result = stack.back();
+	stack.resize(stack.size() - drop);
+	stack.back() = result;
+}
+
+FeedbackSlot &VM::feedback_slot(CallFrame *frame, u8 *instruction) {
+	ObjectFunction *fn = frame->closure->function;
+	if (fn->feedback.empty()) {
+		fn->feedback.resize(fn->chunk.code.size());
+	}
+	return fn->feedback[instruction - fn->chunk.code.data()];
+}
+
+void VM::record_receiver(CallFrame *frame, u8 *instruction, LoxValue receiver) {
+	if (receiver.is_object() && receiver.as.obj->is_instance()) {
+		feedback_slot(frame, instruction).record_target((LoxObject *) receiver.as_instance().klass);
+	}
+}
+
+void VM::record_callee(CallFrame *frame, u8 *instruction, LoxValue callee) {
+	if (!callee.is_object()) return;
+	// closures of the same function are the same call target
+	LoxObject *target = callee.as.obj->is_closure() ? (LoxObject *) callee.as_closure().function : callee.as.obj;
+	feedback_slot(frame, instruction).record_target(target);
+}
+
+void VM::dump_feedback() {
+	for (LoxObject *obj = objects; obj != nullptr; obj = obj->next) {
+		if (obj->is_function() && !obj->as_function().feedback.empty()) {
+			ObjectFunction &fn = obj->as_function();
+			print_feedback(fn, fn.name != nullptr ? fn.name->chars.get() : "<script>");
+		}
+	}
+}
+
+LoxValue VM::read_register(CallFrame *frame, int kind, u8 index) {
+	switch (static_cast<RegisterKind>(kind)) {
+		case RegisterKind::LOCAL: return stack[frame->slots + index];
+		case RegisterKind::CONSTANT: return frame->closure->function->chunk.constants[index];
+		case RegisterKind::STACK: break;
+	}
+	LoxValue value = stack.back();
+	stack.pop_back();
+	return value;
+}
+
+void VM::push_closure(CallFrame *frame, ObjectFunction *fn, u8 *captures, bool wide) {
+	if (fn->upvalue_count == 0) {
+		if (fn->closure == nullptr) fn->closure = &GC<ObjectClosure>(fn).as_closure();
+		stack.push_back(LoxValue(fn->closure));
+		return;
+	}
+	stack.push_back(GC<ObjectClosure>(fn));
+	ObjectClosure *closure = &stack.back().as_closure();
+	for (int i=0; i<closure->upvalue_count; i++) {
+		u16 is_local = *captures++;
+		if (wide) is_local |= *captures++ << 8;
+		u16 index = *captures++;
+		if (wide) index |= *captures++ << 8;
+		if (is_local) {
+			closure->upvalues[i] = capture_upvalue(frame->slots + index);
+		}
+		else {
+			closure->upvalues[i] = frame->closure->upvalues[index];
+		}
+	}
+}
+
+bool VM::run_compiled(InterpretResult &result) {
+	for (;;) {
+		CallFrame &frame = frames.back();
+		ObjectFunction *fn = frame.closure->function;
+		if (fn->jit == nullptr) return false;
+		u32 entry = fn->jit->entries[frame.ip - fn->chunk.code.data()];
+		if (entry == UINT32_MAX) return false;
+		switch (fn->jit->enter(*this, &frame, entry)) {
+			case JitStatus::FRAME_CHANGED: break;
+			case JitStatus::DONE:
+				result = INTERPRET_OK;
+				return true;
+			default:
+				result = INTERPRET_RUNTIME_ERROR;
+				return true;
+		}
+	}
+}
+
+namespace {
+
+Trace *find_trace(ObjectFunction &fn, u8 *loop) {
+	u32 offset = loop - fn.chunk.code.data();
+	for (Trace *trace : fn.traces) {
+		if (trace->loop == offset) return trace;
+	}
+	return nullptr;
+}
+
+}
+
+void VM::hot_loop(CallFrame *frame, u8 *loop) {
+	loop_counter(frame->ip) = 0;
+	ObjectFunction &fn = *frame->closure->function;
+	// only ever recorded once, a loop that failed to compile stays interpreted
+	if (!compiler_options.trace || find_trace(fn, loop) != nullptr) return;
+	Trace *trace = fn.traces.emplace_back(new Trace{static_cast<u32>(loop - fn.chunk.code.data())});
+	if (!record_trace(*this, *frame, *trace)) return;
+	*loop = *loop == +OP::LOOP ? +OP::LOOP_TRACE : +OP::FOR_LOOP_TRACE;
+	enter_trace(frame, loop);
+}
+
+void VM::enter_trace(CallFrame *frame, u8 *loop) {
+	Trace *trace = find_trace(*frame->closure->function, loop);
+	if (trace == nullptr || trace->native == nullptr || stack.size() - frame->slots != trace->depth) return;
+	if (static_cast<size_t>(stack.limit - stack.top) < trace->max_stack) {
+		stack.reserve(stack.size() + trace->max_stack);
+	}
+	frame->ip = trace->run(*this, *frame);
+	// a trace that keeps exiting early costs more than it saves
+	if (++trace->entries >= 64 && trace->iterations < 4 * trace->entries) {
+		*loop = *loop == +OP::LOOP_TRACE ? +OP::LOOP : +OP::FOR_LOOP;
+		code_cache.release(trace->native);
+		trace->native = nullptr;
+	}
+}
+
 LoxValue VM::read_constant(CallFrame *frame) {
 	return frame->closure->function->chunk.constants[*frame->ip++];
 }
 
+bool VM::run_wide(CallFrame *frame) {
+	u8 *wide = frame->ip - 1;
+	auto read_operand = [&] {
+		u16 operand = frame->ip[0] | (frame->ip[1] << 8);
+		frame->ip += 2;
+		return operand;
+	};
+	ChunkArray<LoxValue> &constants = frame->closure->function->chunk.constants;
+	switch (*frame->ip++) {
+		case +OP::CONSTANT: stack.push(constants[read_operand()]); return true;
+		case +OP::GET_LOCAL: stack.push(stack[frame->slots + read_operand()]); return true;
+		case +OP::SET_LOCAL: stack[frame->slots + read_operand()] = peek(); return true;
+		case +OP::GET_GLOBAL: {
+			ObjectString *name = &constants[read_operand()].as_string();
+			LoxValue value;
+			if (!globals.get(name, &value)) {
+				runtime_error("Undefined variable '{}'.", name->chars.get());
+				return false;
+			}
+			stack.push(value);
+			return true;
+		}
+		case +OP::DEFINE_GLOBAL:
+			globals.set(&constants[read_operand()].as_string(), peek());
+			stack.pop_back();
+			return true;
+		case +OP::SET_GLOBAL: {
+			ObjectString *name = &constants[read_operand()].as_string();
+			if (globals.set(name, peek())) {
+				globals.del(name);
+				runtime_error("Undefined variable '{}'.", name->chars.get());
+				return false;
+			}
+			return true;
+		}
+		case +OP::GET_UPVALUE: {
+			ObjectUpvalue *upvalue = frame->closure->upvalues[read_operand()];
+			if (upvalue->stack_index == UINT32_MAX) stack.push(upvalue->closed);
+			else stack.push(stack[upvalue->stack_index]);
+			return true;
+		}
+		case +OP::SET_UPVALUE: {
+			ObjectUpvalue *upvalue = frame->closure->upvalues[read_operand()];
+			if (upvalue->stack_index == UINT32_MAX) upvalue->closed = peek();
+			else stack[upvalue->stack_index] = peek();
+			return true;
+		}
+		case +OP::GET_PROPERTY:
+			record_receiver(frame, wide, peek());
+			return get_property(&constants[read_operand()].as_string());
+		case +OP::SET_PROPERTY: {
+			record_receiver(frame, wide, peek(1));
+			if (!peek(1).is_object() || !peek(1).is_instance()) {
+				runtime_error("Only instances have fields.");
+				return false;
+			}
+			peek(1).as_instance().fields.set(&constants[read_operand()].as_string(), peek());
+			peek(1) = peek();
+			stack.pop_back();
+			return true;
+		}
+		case +OP::GET_SUPER: {
+			ObjectString *name = &constants[read_operand()].as_string();
+			ObjectClass *superclass = &peek().as_class();
+			stack.pop_back();
+			return bind_method(superclass, name);
+		}
+		case +OP::JUMP:
+		case +OP::JUMP_IF_FALSE:
+		case +OP::LOOP: {
+			u8 op = frame->ip[-1];
+			u32 offset = frame->ip[0] | (frame->ip[1] << 8) | (frame->ip[2] << 16) | (frame->ip[3] << 24);
+			// loops this long aren't worth tracing, and aren't counted
+			if (op == +OP::LOOP) frame->ip -= offset;
+			else if (op == +OP::JUMP || is_falsey(peek())) frame->ip += offset;
+			else frame->ip += 4;
+			return true;
+		}
+		case +OP::INVOKE: {
+			ObjectString *method = &constants[read_operand()].as_string();
+			int arg_count = read_operand();
+			record_receiver(frame, wide, peek(arg_count));
+			return invoke(method, arg_count);
+		}
+		case +OP::SUPER_INVOKE: {
+			ObjectString *method = &constants[read_operand()].as_string();
+			int arg_count = read_operand();
+			ObjectClass *superclass = &peek().as_class();
+			stack.pop_back();
+			return invoke_from_class(superclass, method, arg_count);
+		}
+		case +OP::CLOSURE: {
+			ObjectFunction *fn = &constants[read_operand()].as_function();
+			push_closure(frame, fn, frame->ip, true);
+			frame->ip += 4 * fn->upvalue_count;
+			return true;
+		}
+		case +OP::CLASS: stack.push(GC<ObjectClass>(&constants[read_operand()].as_string())); return true;
+		case +OP::METHOD: define_method(&constants[read_operand()].as_string()); return true;
+	}
+	runtime_error("Unknown wide opcode {}.", frame->ip[-1]);
+	return false;
+}
+
+// after a call or return, switches to compiled code if the new frame has it
+#define ENTER_FRAME() \
+	do { \
+		InterpretResult result; \
+		if (frames.back().closure->function->jit != nullptr && run_compiled(result)) return result; \
+	} while (false)
+
 InterpretResult VM::run() {
+	ENTER_FRAME();
 	for (;;) {
 		CallFrame *frame = &frames.back();
 //#undef DEBUG_TRACE_EXECUTION
@@ -325,22 +713,22 @@ InterpretResult VM::run() {
 		u8 instruction;
 		switch (instruction = *frame->ip++) {
 		case +OP::CONSTANT: {
-			stack.push_back(read_constant(frame));
+			stack.push(read_constant(frame));
 			break;
 		}
 		case +OP::CONSTANT_LONG: {
 			size_t index = *frame->ip | (*(frame->ip+1) << 8) | (*(frame->ip+2) << 16);
 			frame->ip += 3;
-			stack.push_back(chunk->constants[index]);
+			stack.push(frame->closure->function->chunk.constants[index]);
 			break;
 		}
-		case +OP::NIL: stack.emplace_back(LoxValue()); break;
-		case +OP::TRUE: stack.emplace_back(LoxValue(true)); break;
-		case +OP::FALSE: stack.emplace_back(LoxValue(false)); break;
+		case +OP::NIL: stack.push(LoxValue()); break;
+		case +OP::TRUE: stack.push(LoxValue(true)); break;
+		case +OP::FALSE: stack.push(LoxValue(false)); break;
 		case +OP::POP: stack.pop_back(); break;
 		case +OP::GET_LOCAL: {
 			u8 slot = *frame->ip++;
-			stack.push_back(stack[slot + frame->slots]); // loads local to top of stack
+			stack.push(stack[slot + frame->slots]); // loads local to top of stack
 			break;
 		}
 		case +OP::SET_LOCAL: {
@@ -355,7 +743,7 @@ InterpretResult VM::run() {
 				runtime_error("Undefined variable '{}'.", name->chars.get());
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			stack.push_back(value);
+			stack.push(value);
 			break;
 		}
 		case +OP::DEFINE_GLOBAL: {
@@ -377,8 +765,8 @@ InterpretResult VM::run() {
 		case +OP::GET_UPVALUE: {
 			u8 slot = *frame->ip++;
 			ObjectUpvalue *upvalue = frame->closure->upvalues[slot];
-			if (upvalue->stack_index == UINT32_MAX) stack.push_back(upvalue->closed);
-			else stack.push_back(stack[upvalue->stack_index]);
+			if (upvalue->stack_index == UINT32_MAX) stack.push(upvalue->closed);
+			else stack.push(stack[upvalue->stack_index]);
 			break;
 		}
 		case +OP::SET_UPVALUE: {
@@ -394,27 +782,14 @@ InterpretResult VM::run() {
 			break;
 		}
 		case +OP::GET_PROPERTY: {
-			if (!peek().is_object() || !peek().is_instance()) {
-				runtime_error("Only instances have properties.");
-				return INTERPRET_RUNTIME_ERROR;
-			}
-			ObjectInstance &instance = peek().as_instance();
-			ObjectString *name = &read_constant(frame).as_string();
-			LoxValue val;
-			if (instance.fields.get(name, &val)) {
-				stack.pop_back(); // instance
-				stack.push_back(val);
-				break;
-			}
-			if (!bind_method(instance.klass, name)) {
+			record_receiver(frame, frame->ip - 1, peek());
+			if (!get_property(&read_constant(frame).as_string())) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
 			break;
-			
-			runtime_error("Undefined property '{}'.", name->chars.get());
-			return INTERPRET_RUNTIME_ERROR;
 		}
 		case +OP::SET_PROPERTY: {
+			record_receiver(frame, frame->ip - 1, peek(1));
 			if (!peek(1).is_object() || !peek(1).is_instance()) {
 				runtime_error("Only instances have fields.");
 				return INTERPRET_RUNTIME_ERROR;
@@ -436,12 +811,14 @@ InterpretResult VM::run() {
 			break;
 		}
 		case +OP::EQUAL: {
-			peek(1) = LoxValue(peek(1) == peek(0));
+			feedback_slot(frame, frame->ip - 1).record_types(peek(1), peek());
+			peek(1) = LoxValue(values_equal(peek(1), peek(0)));
 			stack.pop_back();
 			break;
 		}
 		case +OP::NOT_EQUAL: {
-			peek(1) = LoxValue(peek(1) != peek(0));
+			feedback_slot(frame, frame->ip - 1).record_types(peek(1), peek());
+			peek(1) = LoxValue(!values_equal(peek(1), peek(0)));
 			stack.pop_back();
 			break;
 		}
@@ -482,12 +859,16 @@ InterpretResult VM::run() {
 			break;
 		}
 		case +OP::ADD: {
+			FeedbackSlot &slot = feedback_slot(frame, frame->ip - 1);
+			slot.record_types(peek(1), peek());
 			if (peek().is_string() && peek(1).is_string()) {
 				concatenate();
+				if (slot.is_monomorphic()) *(frame->ip - 1) = +OP::ADD_STR;
 			}
 			else if (peek().is_number() && peek(1).is_number()) {
 				peek(1).as.number += peek().as.number;
 				stack.pop_back();
+				if (slot.is_monomorphic()) *(frame->ip - 1) = +OP::ADD_NUM;
 			}
 			else {
 				runtime_error("Operands must be two numbers or two strings.");
@@ -555,25 +936,100 @@ InterpretResult VM::run() {
 			break;
 		}
 		case +OP::LOOP: {
+			u8 *loop = frame->ip - 1;
 			u16 offset = *frame->ip | (*(frame->ip+1) << 8);
 			frame->ip -= offset;
+			if (++loop_counter(frame->ip) >= compiler_options.trace_threshold) {
+				hot_loop(frame, loop);
+			}
+			break;
+		}
+		case +OP::LOOP_TRACE: {
+			u8 *loop = frame->ip - 1;
+			u16 offset = *frame->ip | (*(frame->ip+1) << 8);
+			frame->ip -= offset;
+			enter_trace(frame, loop);
+			break;
+		}
+		case +OP::FOR_LOOP:
+		case +OP::FOR_LOOP_TRACE: {
+			u8 *loop = frame->ip - 1;
+			u8 mode = frame->ip[0];
+			LoxValue &counter = stack[frame->slots + frame->ip[1]];
+			if (!counter.is_number()) {
+				runtime_error("Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			counter.as.number += frame->closure->function->chunk.constants[frame->ip[2]].as.number;
+			LoxValue bound = read_register(frame, mode, frame->ip[3]);
+			if (!bound.is_number()) {
+				runtime_error("Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (!(counter.as.number < bound.as.number)) {
+				frame->ip += 6;
+				break;
+			}
+			u16 offset = frame->ip[4] | (frame->ip[5] << 8);
+			frame->ip += 4 - offset;
+			if (instruction == +OP::FOR_LOOP_TRACE) {
+				enter_trace(frame, loop);
+			}
+			else if (++loop_counter(frame->ip) >= compiler_options.trace_threshold) {
+				hot_loop(frame, loop);
+			}
 			break;
 		}
 		case +OP::CALL: {
 			int arg_count = *frame->ip++;
+			record_callee(frame, frame->ip - 2, peek(arg_count));
+			if (!call_value(peek(arg_count), arg_count)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			ENTER_FRAME();
+			break;
+		}
+		case +OP::TAIL_CALL: {
+			int arg_count = *frame->ip++;
+			record_callee(frame, frame->ip - 2, peek(arg_count));
+			size_t frame_count = frames.size();
 			if (!call_value(peek(arg_count), arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &frames.back();
+			// natives and classes without an initializer are done, and their
+			// result is returned by the RETURN after
+			if (frames.size() != frame_count) {
+				replace_caller_frame();
+				ENTER_FRAME();
+			}
 			break;
 		}
 		case +OP::INVOKE: {
 			ObjectString *method = &read_constant(frame).as_string();
 			int arg_count = *frame->ip++;
+			record_receiver(frame, frame->ip - 3, peek(arg_count));
 			if (!invoke(method, arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &frames.back();
+			ENTER_FRAME();
+			break;
+		}
+		case +OP::GUARD_CALL:
+		case +OP::GUARD_INVOKE: {
+			u8 *guard = frame->ip - 1;
+			frame->ip += instruction == +OP::GUARD_INVOKE ? 3 : 2;
+			if (!inlined_target(frame, guard)) {
+				u16 offset = *frame->ip | (*(frame->ip+1) << 8);
+				frame->ip += offset;
+				break;
+			}
+			frame->ip += 2; // past offset
+			break;
+		}
+		case +OP::RETURN_INLINED: {
+			return_inlined(READ_BYTE());
+			u16 offset = *frame->ip | (*(frame->ip+1) << 8);
+			frame->ip += offset;
 			break;
 		}
 		case +OP::SUPER_INVOKE: {
@@ -584,24 +1040,14 @@ InterpretResult VM::run() {
 			if (!invoke_from_class(superclass, method, arg_count)) {
 				return INTERPRET_RUNTIME_ERROR;
 			}
-			frame = &frames.back();
+			ENTER_FRAME();
 			break;
 		}
 		case +OP::CLOSURE: {
 			// stays alive?
 			ObjectFunction *fn = &read_constant(frame).as_function();
-			stack.push_back(GC<ObjectClosure>(fn));
-			ObjectClosure *closure = &stack.back().as_closure();
-			for (int i=0; i<closure->upvalue_count; i++) {
-				u8 is_local = *frame->ip++;
-				u8 index = *frame->ip++;
-				if (is_local) {
-					closure->upvalues[i] = capture_upvalue(frame->slots + index);
-				}
-				else {
-					closure->upvalues[i] = frame->closure->upvalues[index];
-				}
-			}
+			push_closure(frame, fn, frame->ip);
+			frame->ip += 2 * fn->upvalue_count;
 			break;
 		}
 		case +OP::CLOSE_UPVALUE: {
@@ -609,6 +1055,13 @@ InterpretResult VM::run() {
 			stack.pop_back();
 			break;
 		}
+		case +OP::WIDE: {
+			if (!run_wide(frame)) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			ENTER_FRAME();
+			break;
+		}
 		case +OP::RETURN: {
 			LoxValue result = stack.back();
 			stack.pop_back(); // get rid of returned value
@@ -620,13 +1073,13 @@ InterpretResult VM::run() {
 			}
 			
 			stack.resize(frame->slots); // resize stack down (INDEX of frame is SIZE without frame)
-			stack.push_back(result); // put result at top of stack
+			stack.push(result); // put result at top of stack
 			frames.pop_back(); // drop frame
-			frame = &frames.back();
+			ENTER_FRAME();
 			break;
 		}
 		case +OP::CLASS: {
-			stack.push_back(GC<ObjectClass>(&read_constant(frame).as_string()));
+			stack.push(GC<ObjectClass>(&read_constant(frame).as_string()));
 			break;
 		}
 		case +OP::INHERIT: {
@@ -644,6 +1097,228 @@ InterpretResult VM::run() {
 			define_method(&read_constant(frame).as_string());
 			break;
 		}
+		case +OP::ADD_LOCALS: {
+			LoxValue a = stack[*frame->ip++ + frame->slots];
+			LoxValue b = stack[*frame->ip++ + frame->slots];
+			FeedbackSlot &slot = feedback_slot(frame, frame->ip - 3);
+			slot.record_types(a, b);
+			if (a.is_number() && b.is_number()) {
+				stack.push(LoxValue(a.as.number + b.as.number));
+				if (slot.is_monomorphic()) *(frame->ip - 3) = +OP::ADD_LOCALS_NUM;
+			}
+			else if (a.is_string() && b.is_string()) {
+				stack.push(a);
+				stack.push(b);
+				concatenate();
+			}
+			else {
+				runtime_error("Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
+		case +OP::ADD_LOCAL_CONSTANT: {
+			LoxValue a = stack[*frame->ip++ + frame->slots];
+			LoxValue b = read_constant(frame);
+			FeedbackSlot &slot = feedback_slot(frame, frame->ip - 3);
+			slot.record_types(a, b);
+			if (a.is_number() && b.is_number()) {
+				stack.push(LoxValue(a.as.number + b.as.number));
+				if (slot.is_monomorphic()) *(frame->ip - 3) = +OP::ADD_LOCAL_CONSTANT_NUM;
+			}
+			else if (a.is_string() && b.is_string()) {
+				stack.push(a);
+				stack.push(b);
+				concatenate();
+			}
+			else {
+				runtime_error("Operands must be two numbers or two strings.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
+		case +OP::SUB_LOCAL_CONSTANT: {
+			LoxValue a = stack[*frame->ip++ + frame->slots];
+			LoxValue b = read_constant(frame);
+			if (!a.is_number() || !b.is_number()) {
+				runtime_error("Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			stack.push(LoxValue(a.as.number - b.as.number));
+			break;
+		}
+		case +OP::LESS_LOCALS_JUMP: {
+			LoxValue a = stack[*frame->ip++ + frame->slots];
+			LoxValue b = stack[*frame->ip++ + frame->slots];
+			if (!a.is_number() || !b.is_number()) {
+				runtime_error("Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (a.as.number < b.as.number) {
+				frame->ip += 2;
+			}
+			else {
+				u16 offset = *frame->ip | (*(frame->ip+1) << 8);
+				frame->ip += offset;
+			}
+			break;
+		}
+		case +OP::LESS_LOCAL_CONSTANT_JUMP: {
+			LoxValue a = stack[*frame->ip++ + frame->slots];
+			LoxValue b = read_constant(frame);
+			if (!a.is_number() || !b.is_number()) {
+				runtime_error("Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (a.as.number < b.as.number) {
+				frame->ip += 2;
+			}
+			else {
+				u16 offset = *frame->ip | (*(frame->ip+1) << 8);
+				frame->ip += offset;
+			}
+			break;
+		}
+		case +OP::GET_LOCAL_PROPERTY: {
+			u8 slot = *frame->ip++;
+			stack.push(stack[slot + frame->slots]);
+			record_receiver(frame, frame->ip - 2, peek());
+			if (!get_property(&read_constant(frame).as_string())) {
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			break;
+		}
+		case +OP::SET_LOCAL_POP: {
+			u8 slot = *frame->ip++;
+			stack[slot + frame->slots] = peek();
+			stack.pop_back();
+			break;
+		}
+		case +OP::MOVE: {
+			u8 mode = frame->ip[0];
+			u8 dst = frame->ip[1];
+			LoxValue value = read_register(frame, mode & 3, frame->ip[2]);
+			frame->ip += 3;
+			stack[frame->slots + dst] = value;
+			break;
+		}
+		case +OP::ADD_R:
+		case +OP::SUB_R:
+		case +OP::MUL_R:
+		case +OP::DIV_R: {
+			u8 mode = frame->ip[0];
+			u8 dst = frame->ip[1];
+			LoxValue rhs = read_register(frame, (mode >> 2) & 3, frame->ip[3]);
+			LoxValue lhs = read_register(frame, mode & 3, frame->ip[2]);
+			frame->ip += 4;
+			LoxValue result;
+			if ((mode & UNCHECKED_NUMBERS) || (lhs.is_number() && rhs.is_number())) {
+				switch (instruction) {
+					case +OP::ADD_R: result = LoxValue(lhs.as.number + rhs.as.number); break;
+					case +OP::SUB_R: result = LoxValue(lhs.as.number - rhs.as.number); break;
+					case +OP::MUL_R: result = LoxValue(lhs.as.number * rhs.as.number); break;
+					case +OP::DIV_R: result = LoxValue(lhs.as.number / rhs.as.number); break;
+				}
+			}
+			else if (instruction == +OP::ADD_R && lhs.is_string() && rhs.is_string()) {
+				stack.push(lhs);
+				stack.push(rhs);
+				concatenate();
+				result = peek();
+				stack.pop_back();
+			}
+			else {
+				if (instruction == +OP::ADD_R) runtime_error("Operands must be two numbers or two strings.");
+				else runtime_error("Operands must be numbers.");
+				return INTERPRET_RUNTIME_ERROR;
+			}
+			if (static_cast<RegisterKind>((mode >> 4) & 3) == RegisterKind::LOCAL) {
+				stack[frame->slots + dst] = result;
+			}
+			else {
+				stack.push(result);
+			}
+			break;
+		}
+		case +OP::ADD_UNCHECKED: {
+			peek(1).as.number += peek().as.number;
+			stack.pop_back();
+			break;
+		}
+		case +OP::SUB_UNCHECKED: {
+			peek(1).as.number -= peek().as.number;
+			stack.pop_back();
+			break;
+		}
+		case +OP::MUL_UNCHECKED: {
+			peek(1).as.number *= peek().as.number;
+			stack.pop_back();
+			break;
+		}
+		case +OP::DIV_UNCHECKED: {
+			peek(1).as.number /= peek().as.number;
+			stack.pop_back();
+			break;
+		}
+		case +OP::GREATER_UNCHECKED: {
+			peek(1) = LoxValue(peek(1).as.number > peek().as.number);
+			stack.pop_back();
+			break;
+		}
+		case +OP::GREATER_EQUAL_UNCHECKED: {
+			peek(1) = LoxValue(peek(1).as.number >= peek().as.number);
+			stack.pop_back();
+			break;
+		}
+		case +OP::LESS_UNCHECKED: {
+			peek(1) = LoxValue(peek(1).as.number < peek().as.number);
+			stack.pop_back();
+			break;
+		}
+		case +OP::LESS_EQUAL_UNCHECKED: {
+			peek(1) = LoxValue(peek(1).as.number <= peek().as.number);
+			stack.pop_back();
+			break;
+		}
+		case +OP::ADD_NUM: {
+			if (!peek().is_number() || !peek(1).is_number()) {
+				*--frame->ip = +OP::ADD; // deoptimize and retry
+				break;
+			}
+			peek(1).as.number += peek().as.number;
+			stack.pop_back();
+			break;
+		}
+		case +OP::ADD_STR: {
+			if (!peek().is_string() || !peek(1).is_string()) {
+				*--frame->ip = +OP::ADD;
+				break;
+			}
+			concatenate();
+			break;
+		}
+		case +OP::ADD_LOCALS_NUM: {
+			LoxValue a = stack[frame->ip[0] + frame->slots];
+			LoxValue b = stack[frame->ip[1] + frame->slots];
+			if (!a.is_number() || !b.is_number()) {
+				*--frame->ip = +OP::ADD_LOCALS;
+				break;
+			}
+			frame->ip += 2;
+			stack.push(LoxValue(a.as.number + b.as.number));
+			break;
+		}
+		case +OP::ADD_LOCAL_CONSTANT_NUM: {
+			LoxValue a = stack[frame->ip[0] + frame->slots];
+			LoxValue b = frame->closure->function->chunk.constants[frame->ip[1]];
+			if (!a.is_number() || !b.is_number()) {
+				*--frame->ip = +OP::ADD_LOCAL_CONSTANT;
+				break;
+			}
+			frame->ip += 2;
+			stack.push(LoxValue(a.as.number + b.as.number));
+			break;
+		}
 		}
 	}
 }
@@ -656,21 +1331,42 @@ void VM::runtime_error(fmt::format_string<Args...> format, Args&&... args) {
 		CallFrame &frame = frames[i];
 		ObjectFunction *fn = frame.closure->function;
 		size_t instruction = frame.ip - fn->chunk.code.data() - 1;
-		fmt::print(stderr, "[line {}] in ", fn->chunk.get_line(instruction));
+		// inlined calls show up as the frames they would have had
+		u32 line = fn->chunk.get_line(instruction);
+		std::vector<size_t> guards = inlined_calls_at(fn->chunk, instruction);
+		for (auto guard = guards.rbegin(); guard != guards.rend(); guard++) {
+			ObjectFunction &callee = fn->chunk.constants[fn->chunk.code[*guard + 1]].as_function();
+			fmt::print(stderr, "[line {}] in {}()\n", line, callee.name->chars.get());
+			line = fn->chunk.get_line(*guard);
+		}
+		fmt::print(stderr, "[line {}] in ", line);
 		if (fn->name == nullptr) fmt::print(stderr, "script\n");
 		else fmt::print(stderr, "{}()\n", fn->name->chars.get());
 	}
 
 	CallFrame &frame = frames.back();
 	size_t instruction = frame.ip - frame.closure->function->chunk.code.data() - 1; // ip advances before executing
-	u16 line = frame.closure->function->chunk.get_line(instruction);
+	u32 line = frame.closure->function->chunk.get_line(instruction);
 	fmt::print(stderr, "[line {}] in script\n", line);
 	reset_stack();
 }
 
+// used by compiled code
+template LoxValue VM::GC<ObjectClass, ObjectString *>(ObjectString *&&);
+template void VM::runtime_error<>(fmt::format_string<>);
+template void VM::runtime_error<char *>(fmt::format_string<char *>, char *&&);
+template void VM::runtime_error<const char *&>(fmt::format_string<const char *&>, const char *&);
+template LoxValue VM::GC<ObjectClosure, ObjectFunction *&>(ObjectFunction *&);
+
+// used by snapshots
+template LoxValue VM::GC<ObjectUpvalue, u32>(u32 &&);
+template LoxValue VM::GC<ObjectInstance, ObjectClass *>(ObjectClass *&&);
+template LoxValue VM::GC<ObjectBoundMethod, LoxValue, ObjectClosure *>(LoxValue &&, ObjectClosure *&&);
+
 void VM::reset_stack() {
 	stack.clear();
 	open_upvalues = nullptr;
+	open_upvalue_at.clear();
 }
 
 
@@ -690,6 +1386,7 @@ void VM::mark_roots() {
 }
 
 void VM::mark_compiler_roots() {
+	if (compiler == nullptr) return; // still constructing it
 	Compiler::FunctionScope *fs = compiler->current_fn;
 	while (fs != nullptr) {
 		mark_object((LoxObject *) fs->function);
@@ -713,7 +1410,7 @@ void VM::mark_object(LoxObject *obj) {
 #endif
 }
 
-void VM::mark_vec(std::vector<LoxValue> &vec) {
+void VM::mark_vec(ChunkArray<LoxValue> &vec) {
 	for (LoxValue &val : vec) {
 		mark_value(val);
 	}
@@ -750,6 +1447,10 @@ void VM::blacken_object(LoxObject &obj) {
 			ObjectFunction *fn = (ObjectFunction *) &obj;
 			mark_object(((LoxObject *) fn->name));
 			mark_vec(fn->chunk.constants);
+			mark_object((LoxObject *) fn->closure);
+			for (FeedbackSlot &slot : fn->feedback) {
+				mark_object(slot.target);
+			}
 			break;
 		}
 		case ObjectType::CLOSURE: {
@@ -770,6 +1471,7 @@ void VM::blacken_object(LoxObject &obj) {
 			ObjectInstance &instance = obj.as_instance();
 			mark_object((LoxObject *) instance.klass);
 			mark_table(instance.fields);
+			break;
 		}
 		case ObjectType::BOUND_METHOD: {
 			ObjectBoundMethod &bound = obj.as_bound_method();
@@ -791,10 +1493,14 @@ void VM::collect_garbage() {
 	
 	mark_roots();
 	trace_references();
+	remove_white(strings);
 	sweep();
 	
 	constexpr int GC_HEAP_GROW_FACTOR = 2;
-	next_GC = bytes_allocated * GC_HEAP_GROW_FACTOR;
+	// not below where the first collection was, or a script whose heap is
+	// mostly short-lived strings collects every few of them
+	constexpr size_t GC_MIN_HEAP = 1024 * 1024;
+	next_GC = std::max(bytes_allocated * GC_HEAP_GROW_FACTOR, GC_MIN_HEAP);
 
 #ifdef DEBUG_LOG_GC
 	fmt::print("-- gc end\n");
@@ -805,8 +1511,10 @@ void VM::collect_garbage() {
 
 void VM::trace_references() {
 	while (!gray_stack.empty()) {
-		blacken_object(*gray_stack.back());
+		// blackening pushes more gray objects
+		LoxObject *obj = gray_stack.back();
 		gray_stack.pop_back();
+		blacken_object(*obj);
 	}
 }
 